@@ -0,0 +1,138 @@
+/*
+ * Benchmark for the cost of garbage collection.
+ *
+ * Fills the store with keys whose version lists hold versions created by
+ * many committed transactions.  It then walks every list, reading the status
+ * of each creator, as garbage collection does, from an increasing number of
+ * threads.  Each walk is done with trans_get_status() and, for comparison,
+ * with the mutex-protected read that status reads used to be.  Finally it
+ * times garbageCollect() over every list.
+ *
+ * Usage: gc_bench [-k <keys>] [-v <versions per key>] [-t <max threads>] [-n <passes>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "store.h"
+#include "helpers.h"
+#include "epoch.h"
+
+static int num_keys = 100;
+static int num_versions = 64;
+static int passes = 200;
+static MAP_ENTRY **entries;
+
+typedef struct {
+    TRANS_STATUS (*status)(TRANSACTION *tp);
+    long committed;
+} WALKER;
+
+static TRANS_STATUS oldStatus(TRANSACTION *tp) {
+    pthread_mutex_lock(&tp->mutex);
+    TRANS_STATUS status = tp->status;
+    pthread_mutex_unlock(&tp->mutex);
+    return status;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static KEY *makeKey(int n) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "key%d", n);
+    return key_create(blob_create(buf, len));
+}
+
+static void *walker(void *arg) {
+    WALKER *w = arg;
+    for(int pass = 0; pass < passes; pass++) {
+        for(int i = 0; i < num_keys; i++) {
+            for(VERSION *vp = entries[i]->versions; vp != NULL; vp = vp->next)
+                if(w->status(vp->creator) == TRANS_COMMITTED) w->committed++;
+        }
+    }
+    return NULL;
+}
+
+//  Walk every list from some threads, and return the time per status read.
+static double runWalk(int threads, TRANS_STATUS (*status)(TRANSACTION *tp)) {
+    pthread_t tids[threads];
+    WALKER walkers[threads];
+
+    double start = now();
+    for(int i = 0; i < threads; i++) {
+        walkers[i] = (WALKER){ .status = status, .committed = 0 };
+        pthread_create(&tids[i], NULL, walker, &walkers[i]);
+    }
+    for(int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+    double elapsed = now() - start;
+
+    return elapsed * 1e9 / ((double) threads * passes * num_keys * num_versions);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while((opt = getopt(argc, argv, "k:v:t:n:")) != -1) {
+        switch(opt) {
+        case 'k': num_keys = atoi(optarg); break;
+        case 'v': num_versions = atoi(optarg); break;
+        case 't': max_threads = atoi(optarg); break;
+        case 'n': passes = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-k <keys>] [-v <versions per key>] [-t <max threads>] [-n <passes>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    trans_init();
+    store_init();
+
+    //  Keep the reaper from collecting the lists before we do.
+    trans_set_completion_hook(NULL);
+
+    //  Each transaction puts a version in every key, and commits before the next one starts.
+    for(int v = 0; v < num_versions; v++) {
+        TRANSACTION *tp = trans_create();
+        for(int i = 0; i < num_keys; i++) store_put(tp, makeKey(i), blob_create("value", 5));
+        trans_commit(tp);
+    }
+
+    epoch_enter();
+    entries = malloc(num_keys * sizeof(MAP_ENTRY *));
+    for(int i = 0; i < num_keys; i++) {
+        entries[i] = findMapEntry(makeKey(i));
+        pthread_mutex_unlock(&entries[i]->mutex);
+    }
+
+    printf("%d keys, %d versions per key, %d passes\n", num_keys, num_versions, passes);
+    printf("threads  status ns/read  mutex ns/read\n");
+    for(int threads = 1; threads <= max_threads; threads *= 2)
+        printf("%7d %15.2f %14.2f\n", threads, runWalk(threads, trans_get_status), runWalk(threads, oldStatus));
+    if(max_threads & (max_threads - 1))
+        printf("%7d %15.2f %14.2f\n", max_threads, runWalk(max_threads, trans_get_status), runWalk(max_threads, oldStatus));
+
+    //  Collect every list, leaving only its last version.
+    double start = now();
+    for(int i = 0; i < num_keys; i++) {
+        pthread_mutex_lock(&entries[i]->mutex);
+        garbageCollect(entries[i]);
+        pthread_mutex_unlock(&entries[i]->mutex);
+    }
+    double elapsed = now() - start;
+    printf("garbageCollect: %.1f ns per version collected\n", elapsed * 1e9 / ((double) num_keys * (num_versions - 1)));
+
+    free(entries);
+    epoch_exit();
+
+    store_fini();
+    trans_fini();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,83 @@
+/*
+ * Microbenchmark for key hashing.
+ *
+ * Hashes keys of sizes from 8 bytes to 4 KB with blob_hash(), and for
+ * comparison with the hash the store used to have (a strndup() of the key
+ * followed by 32-bit djb2, stopping at the first null byte), and prints
+ * the time per hash and the throughput for each size.
+ *
+ * Usage: hash_bench [-n <hashes per size>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "data.h"
+
+//  Consumed so the compiler cannot drop the hashing.
+static volatile uint64_t sink;
+
+static int oldHash(BLOB *bp) {
+    int bpHash = 6823, temp;
+    char *copy = strndup(bp->content, bp->size);
+    char *orig = copy;
+
+    while((temp = *copy++)) bpHash = (bpHash + (bpHash << 5)) + temp;
+
+    free(orig);
+    return bpHash;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void runSize(size_t size, long iterations) {
+    char *content = malloc(size);
+    for(size_t i = 0; i < size; i++) content[i] = 'a' + i % 26;
+    BLOB *bp = blob_create(content, size);
+
+    //  Vary the first byte, so that every hash is of different content.
+    double start = now();
+    for(long i = 0; i < iterations; i++) {
+        bp->content[0] = i;
+        sink += blob_hash(bp);
+    }
+    double hash_ns = (now() - start) * 1e9 / iterations;
+
+    start = now();
+    for(long i = 0; i < iterations; i++) {
+        bp->content[0] = 'a' + i % 26;
+        sink += oldHash(bp);
+    }
+    double old_ns = (now() - start) * 1e9 / iterations;
+
+    printf("%6lu %12.1f %10.2f %12.1f %10.2f\n", size, hash_ns, size / hash_ns, old_ns, size / old_ns);
+
+    blob_unref(bp, "for benchmark blob");
+    free(content);
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = 1000000;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:")) != -1) {
+        switch(opt) {
+        case 'n': iterations = atol(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-n <hashes per size>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    blob_hash_seed(time(NULL));
+
+    printf("  size   blob_hash ns       GB/s     djb2 ns       GB/s\n");
+    for(size_t size = 8; size <= 4096; size *= 2) runSize(size, iterations);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,142 @@
+/*
+ * Thread-scaling benchmark for the object store.
+ *
+ * Runs transactions of one or more operations (each a GET or PUT of a
+ * uniformly chosen key) from an increasing number of threads directly against
+ * the store, and prints the committed throughput and the share of transactions
+ * aborted for each thread count.  Fewer keys make for more conflicts.
+ *
+ * Usage: scaling_bench [-t <max threads>] [-k <keys>] [-d <seconds>] [-r <read %>]
+ *                      [-o <operations>] [-i chained|swiss] [-e ordered|mvcc|occ|2pl]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "store.h"
+#include "helpers.h"
+
+static int num_keys = 100000;
+static int read_pct = 50;
+static int num_ops = 1;
+static char *index_name = "chained";
+static char *engine_name = "ordered";
+static atomic_int running;
+
+typedef struct {
+    unsigned int seed;
+    long commits;
+    long aborts;
+} WORKER;
+
+static KEY *makeKey(int n) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "key%d", n);
+    return key_create(blob_create(buf, len));
+}
+
+static void *worker(void *arg) {
+    WORKER *w = arg;
+
+    while(atomic_load_explicit(&running, memory_order_relaxed)) {
+        TRANSACTION *tp = trans_create();
+        TRANS_STATUS status = TRANS_PENDING;
+
+        for(int i = 0; i < num_ops && status == TRANS_PENDING; i++) {
+            KEY *kp = makeKey(rand_r(&w->seed) % num_keys);
+            if(rand_r(&w->seed) % 100 < read_pct) {
+                BLOB *bp;
+                status = store_get(tp, kp, &bp);
+                blob_unref(bp, "obtained from store_get");
+            }
+            else {
+                char buf[32];
+                int len = snprintf(buf, sizeof(buf), "value%d", rand_r(&w->seed));
+                status = store_put(tp, kp, blob_create(buf, len));
+            }
+        }
+
+        if(status == TRANS_ABORTED) status = trans_abort(tp);
+        else status = trans_commit(tp);
+
+        if(status == TRANS_COMMITTED) w->commits++;
+        else w->aborts++;
+    }
+    return NULL;
+}
+
+static void runRound(int threads, int seconds) {
+    pthread_t tids[threads];
+    WORKER workers[threads];
+
+    trans_init();
+    store_init();
+    store_reserve(num_keys);
+
+    //  Load every key in a single transaction.
+    TRANSACTION *tp = trans_create();
+    for(int i = 0; i < num_keys; i++) store_put(tp, makeKey(i), blob_create("init", 4));
+    trans_commit(tp);
+
+    atomic_store(&running, 1);
+    for(int i = 0; i < threads; i++) {
+        workers[i] = (WORKER){ .seed = i + 1, .commits = 0, .aborts = 0 };
+        pthread_create(&tids[i], NULL, worker, &workers[i]);
+    }
+    sleep(seconds);
+    atomic_store(&running, 0);
+
+    long commits = 0, aborts = 0;
+    for(int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        commits += workers[i].commits;
+        aborts += workers[i].aborts;
+    }
+
+    printf("%7d %14.0f %10ld %8.2f\n", threads, (double) commits / seconds, aborts,
+           commits + aborts ? 100.0 * aborts / (commits + aborts) : 0.0);
+    fflush(stdout);
+
+    store_fini();
+    trans_fini();
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int seconds = 2;
+    int opt;
+
+    while((opt = getopt(argc, argv, "t:k:d:r:o:i:e:")) != -1) {
+        switch(opt) {
+        case 't': max_threads = atoi(optarg); break;
+        case 'k': num_keys = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'r': read_pct = atoi(optarg); break;
+        case 'o': num_ops = atoi(optarg); break;
+        case 'i':
+            index_name = optarg;
+            store_select_index(!strcmp(optarg, "swiss") ? INDEX_SWISS : INDEX_CHAINED);
+            break;
+        case 'e':
+            engine_name = optarg;
+            trans_select_engine(!strcmp(optarg, "mvcc") ? ENGINE_MVCC : !strcmp(optarg, "occ") ? ENGINE_OCC :
+                                !strcmp(optarg, "2pl") ? ENGINE_2PL : ENGINE_ORDERED);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t <max threads>] [-k <keys>] [-d <seconds>] [-r <read %%>] [-o <operations>] "
+                    "[-i chained|swiss] [-e ordered|mvcc|occ|2pl]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%d keys, %d%% reads, %d operations per transaction, uniform key distribution, %s index, %s engine\n",
+           num_keys, read_pct, num_ops, index_name, engine_name);
+    printf("threads    commits/sec     aborts  abort %%\n");
+    for(int threads = 1; threads <= max_threads; threads *= 2) runRound(threads, seconds);
+    if(max_threads & (max_threads - 1)) runRound(max_threads, seconds);
+
+    return EXIT_SUCCESS;
+}
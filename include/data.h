@@ -11,6 +11,7 @@
 #define DATA_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <pthread.h>
 #include "transaction.h"
 
@@ -35,9 +36,11 @@ typedef struct blob {
 
 /*
  * A key consists of a pointer to a blob and a hash of the blob data.
+ * The full 64-bit hash is kept, so that the store can take bucket indices,
+ * stripes and fingerprints from it without ever hashing the data again.
  */
 typedef struct key {
-    int hash;
+    uint64_t hash;
     BLOB *blob;
 } KEY;
 
@@ -45,10 +48,14 @@ typedef struct key {
  * A VERSION represents a single version of a value associated with a key
  * in the transactional store.  Each version has a creator transaction,
  * a pointer to a blob and links to the next and previous versions in the
- * list of all versions in the same map entry.
+ * list of all versions in the same map entry.  Versions are kept in order of
+ * their stamp, which is the creator's ID, or its commit timestamp under
+ * ENGINE_MVCC (see transaction.h).
  */
 typedef struct version {
     TRANSACTION *creator;
+    unsigned int generation;  // Generation of creator when the version was made.
+    uint64_t ts;              // Stamp giving the version's place in the list.
     BLOB *blob;
     struct version *next;
     struct version *prev;
@@ -95,11 +102,32 @@ int blob_compare(BLOB *bp1, BLOB *bp2);
 
 /*
  * Hash function for hashing the content of a blob.
- * 
+ * The whole content is hashed, including any null bytes, and nothing is
+ * allocated.  The result depends on the seed set by blob_hash_seed().
+ *
  * @param bp  The blob.
  * @return  Hash of the blob.
  */
-int blob_hash(BLOB *bp);
+uint64_t blob_hash(BLOB *bp);
+
+/*
+ * Hash arbitrary content with the same function as blob_hash(), so that
+ * content not yet in a blob can be compared against existing keys.
+ *
+ * @param content  The content.
+ * @param size  The size in bytes of the content.
+ * @return  Hash of the content.
+ */
+uint64_t content_hash(const char *content, size_t size);
+
+/*
+ * Set the seed used by blob_hash().  Choosing a random seed at startup keeps
+ * clients from constructing keys that all land in the same bucket.  This must
+ * not be called while any keys exist.
+ *
+ * @param seed  The seed.
+ */
+void blob_hash_seed(uint64_t seed);
 
 /*
  * Create a key from a blob.
@@ -113,7 +141,9 @@ KEY *key_create(BLOB *bp);
 /*
  * Dispose of a key, decreasing the reference count of the contained blob.
  * A key must be disposed of only once and must not be referred to again
- * after it has been disposed.
+ * after it has been disposed.  The key is freed at once, so a key that
+ * lock-free readers can reach must be retired through the epoch module
+ * first, as the store does with the map entry that holds it.
  *
  * @param kp  The key.
  */
@@ -0,0 +1,48 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/*
+ * Epoch-based reclamation of objects that lock-free readers may still be using.
+ *
+ * A thread that wants to traverse shared structures without locks brackets the
+ * traversal with epoch_enter() and epoch_exit().  Objects unlinked from those
+ * structures are not freed immediately, but handed to epoch_retire(), which
+ * frees them only after every thread that might still hold a pointer to them
+ * has left its critical section.  There is a global epoch counter; a thread in
+ * a critical section has "observed" the value of the counter at entry, and the
+ * counter can only advance once every thread in a critical section has observed
+ * its current value.  An object retired in epoch e can therefore be freed once
+ * the global epoch reaches e + 2.
+ *
+ * Critical sections may be nested; only the outermost pair has any effect.
+ * Each thread keeps its own list of retired objects, so retiring takes no lock.
+ * When a thread exits, its remaining retired objects are handed to a shared
+ * list, which is drained by whichever thread next advances the epoch.
+ */
+
+/*
+ * Begin a read-side critical section.
+ */
+void epoch_enter(void);
+
+/*
+ * End a read-side critical section.
+ */
+void epoch_exit(void);
+
+/*
+ * Retire an object that has been unlinked from all shared structures.
+ * It will be passed to free_fn once no thread can still be referring to it.
+ *
+ * @param ptr  The object.
+ * @param free_fn  Function that frees the object.
+ */
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+/*
+ * Free every retired object immediately.  This must only be called when no
+ * other thread is using the shared structures, e.g. when the store is finalized.
+ */
+void epoch_fini(void);
+
+#endif
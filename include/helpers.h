@@ -10,8 +10,32 @@ void *thread(void *vargp);
 
 void xacto_get(int connfd, BLOB *bp);
 
+void xacto_range_emit(KEY *key, BLOB *value, void *arg);
+
+void xacto_reply(int connfd, TRANSACTION *tp, int status);
+
+void xacto_commit_done(TRANSACTION *tp, TRANS_STATUS status, void *arg);
+
+void store_select_index(int index);
+
+void store_set_budget(long bytes);
+
+int store_over_budget(void);
+
+void store_reserve(size_t num_keys);
+
 MAP_ENTRY *findMapEntry(KEY *key);
 
+MAP_ENTRY *findRawMapEntry(char *content, size_t size);
+
+void mapEntryRef(MAP_ENTRY *mapEntry);
+
+void mapEntryUnref(MAP_ENTRY *mapEntry);
+
+int reclaimMapEntry(MAP_ENTRY *mapEntry, uint64_t watermark);
+
+int evictMapEntries(uint64_t watermark, int max);
+
 void garbageCollect(MAP_ENTRY *mapEntry);
 
 void addVersion(MAP_ENTRY *mapEntry, TRANSACTION *tp, BLOB *bp, KEY *kp);
@@ -36,6 +36,17 @@
  *	      (reply returns value and status)
  *   COMMIT:  Try to commit a transaction
  *            (reply returns status)
+ *   RANGE:   Get the store values for the keys in a range
+ *            (sends limit, least key, and key past the end)
+ *            (reply returns keys and values, then status)
+ *   READONLY: Make the transaction read-only (see transaction.h)
+ *            (must be the first request; reply returns status)
+ *   RETRY:   Retry a transaction that aborted, keeping its priority
+ *            (sends retry token; must be the first request; reply returns status)
+ *   BEGIN:   Start a new transaction, and keep the connection open after it
+ *            (reply returns status)
+ *   ABORT:   Abort the transaction
+ *            (reply returns status)
  * 
  * Server-to-client responses:
  *   REPLY:
@@ -49,6 +60,42 @@
  * a fixed-size packet, which specifies the length of the data payload, followed by
  * the data payload itself, which consists of exactly the number of bytes
  * specified in the payload_length field of the header.
+ *
+ * A RANGE packet carries as its payload the greatest number of keys to return,
+ * as a 32-bit integer in network byte order (zero, or no payload, for no limit).
+ * It is followed by two data packets giving the least key in the range and the
+ * key just past its end; a null data value leaves that end of the range open.
+ * Keys are ordered as byte strings.  The server replies with a pair of data
+ * packets for each key found, in order: the key, and then its value, which is
+ * null if the key has no value.  The last pair is followed by a REPLY packet
+ * giving the status.
+ *
+ * A REPLY packet with status 2 (aborted) carries as its payload a retry token
+ * for the transaction, of TRANS_TOKEN_SIZE bytes (see transaction.h), which is
+ * opaque to the client.  Sent as the payload of a RETRY packet, as the first
+ * request of a new connection, it gives the new transaction the priority of
+ * the one that aborted, so that retrying does not lose it conflicts it would
+ * have won.  A token that the server did not issue, or that has expired or
+ * been used before, aborts the transaction.
+ *
+ * A connection starts with a transaction open, and is closed by the server
+ * once that transaction commits or aborts, unless the client has sent BEGIN.
+ * Then the connection stays open, and the next request after the end of a
+ * transaction starts another, so a client can run any number of transactions,
+ * one after the other, on one connection.  BEGIN starts a transaction
+ * explicitly, and does not count as the first request for READONLY and RETRY.
+ * BEGIN in the middle of a transaction that has done anything aborts it, as a
+ * late READONLY or RETRY does, and replies with status 2; the session still
+ * starts, and the next request starts a new transaction.  Every abort is
+ * reported by the REPLY to the request that caused it, with status 2, COMMIT
+ * included.
+ *
+ * Outside a session, the server requests a commit and goes on without waiting
+ * for it: the REPLY to COMMIT is sent, and the connection closed, by whichever
+ * thread decides the transaction, once its dependencies have finished.  In a
+ * session, the connection's next request may only start once the commit has
+ * been decided, so the server waits for the decision before replying and
+ * reading on.  Either way the client sees the same REPLY.
  */
 
 /*
@@ -57,7 +104,8 @@
 typedef enum {
     XACTO_NO_PKT,  // Not used
     XACTO_PUT_PKT, XACTO_GET_PKT, XACTO_DATA_PKT, XACTO_COMMIT_PKT,
-    XACTO_REPLY_PKT
+    XACTO_REPLY_PKT, XACTO_RANGE_PKT, XACTO_READONLY_PKT, XACTO_RETRY_PKT,
+    XACTO_BEGIN_PKT, XACTO_ABORT_PKT
 } XACTO_PACKET_TYPE;
 
 /*
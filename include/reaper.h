@@ -0,0 +1,60 @@
+#ifndef REAPER_H
+#define REAPER_H
+
+#include "store.h"
+
+/*
+ * Background garbage collection of version lists.
+ *
+ * A version list only has garbage to collect once the creator of one of its
+ * versions has committed or aborted.  Each transaction therefore records the
+ * map entries in which it has created versions, and when it completes those
+ * entries are marked "dirty" and put on a queue.  The queue is lock-free, so
+ * completing transactions never contend for a lock to hand entries over.  A
+ * reaper thread takes entries off the queue and garbage collects them, at most
+ * a fixed budget of entries per cycle, yielding the processor between cycles.
+ * Entries of keys that are no longer accessed are thus still cleaned up, and
+ * the transactions and blobs referenced by their dead versions released.
+ *
+ * The reaper also removes entries left without a value (see store.h).  Those
+ * that must wait for older transactions to finish first are kept on a second
+ * list, which is retried every REAPER_DEFER_MS milliseconds.  In cache mode it
+ * also evicts entries while the store is over its memory budget, looking again
+ * just as often while none can be evicted.
+ *
+ * An entry is on the queue at most once, and its dirty flag is set for as long
+ * as it is.  A request that finds a dirty entry collects it itself, since it is
+ * holding the entry's mutex anyway; a request that finds a clean entry knows
+ * that there is nothing to collect and skips garbage collection entirely.
+ */
+#define REAPER_BUDGET 256   // Default number of entries collected per cycle.
+#define REAPER_DEFER_MS 10  // Interval at which deferred removals are retried.
+
+/*
+ * Start the reaper thread and hook it into transaction completion.
+ */
+void reaper_init(void);
+
+/*
+ * Stop the reaper thread, and forget any entries still queued.
+ */
+void reaper_fini(void);
+
+/*
+ * Set the number of entries the reaper collects per cycle.
+ *
+ * @param budget  The number of entries.
+ */
+void reaper_set_budget(int budget);
+
+/*
+ * Record that a transaction has created a version in a map entry, so that the
+ * entry is queued for collection once the transaction completes.
+ * Caller holds mapEntry->mutex.
+ *
+ * @param mapEntry  The map entry.
+ * @param tp  The creator of the version.
+ */
+void reaper_touch(MAP_ENTRY *mapEntry, TRANSACTION *tp);
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef SKIPLIST_H
+#define SKIPLIST_H
+
+#include "store.h"
+
+/*
+ * An ordered index of map entries, kept alongside the hash index so that the
+ * keys in a range can be visited in order.  Keys are ordered as byte strings:
+ * by their content, compared bytewise, and a key that is a prefix of another
+ * coming first.
+ *
+ * The index is a skiplist: a sorted linked list of nodes, one per map entry,
+ * in which a node also links to later nodes at up to SKIPLIST_MAX_LEVEL - 1
+ * higher levels, each level skipping about three in four of the nodes of the
+ * one below.  Only the creation and removal of map entries change the index,
+ * so GET and PUT of existing keys never touch it.
+ *
+ * The index is concurrent ("lazy" locking, after Herlihy, Lev, Luchangco and
+ * Shavit): searches follow the links without locking, while each node has a
+ * mutex of its own, which is held to change the links out of the node or to
+ * cover the gap after it.  An insert or removal locks only the predecessors
+ * of the node at each of its levels, and the node itself for a removal, and
+ * checks that nothing has changed since the search, or else searches again.
+ * Mutexes are always taken in order of key, so that nobody can deadlock, and
+ * a scan holds the mutex of one node until it has that of the next, so that
+ * no gap it covers can change under it.  Removed nodes are freed through the
+ * epoch module, so every call must be made inside an epoch critical section,
+ * except skiplist_init() and skiplist_fini().
+ *
+ * To protect scans against phantoms, each node records a "gap read timestamp":
+ * the greatest ID of a transaction that has scanned the gap between that node
+ * and the next one, and found no key there.  The head of the list does the same
+ * for the keys before the first node.  An entry inserted into a gap inherits its
+ * read timestamp (see store.h), and a removed entry hands its own back to the gap.
+ */
+#define SKIPLIST_MAX_LEVEL 24
+
+typedef struct skiplist SKIPLIST;
+
+/*
+ * Create an empty index.
+ *
+ * @return  The new index.
+ */
+SKIPLIST *skiplist_init(void);
+
+/*
+ * Finalize an index.  The map entries it refers to are left alone.
+ *
+ * @param slp  The index.
+ */
+void skiplist_fini(SKIPLIST *slp);
+
+/*
+ * Insert a map entry, which must not already be in the index.  The entry's
+ * read timestamp is raised to that of the gap it is inserted into.  A removed
+ * entry for the same key may still be on its way out of the index, in which
+ * case this waits for it to be gone.  Caller holds mapEntry->mutex.
+ *
+ * @param slp  The index.
+ * @param mapEntry  The map entry.
+ */
+void skiplist_insert(SKIPLIST *slp, MAP_ENTRY *mapEntry);
+
+/*
+ * Remove a map entry, if present, handing its read timestamp back to the gap
+ * left behind.  Caller holds mapEntry->mutex, and has already taken the entry
+ * out of the map, so that no new entry for the key waits for this one for long.
+ *
+ * @param slp  The index.
+ * @param mapEntry  The map entry.
+ */
+void skiplist_remove(SKIPLIST *slp, MAP_ENTRY *mapEntry);
+
+/*
+ * Collect the map entries whose keys lie in a range, in order, raising the read
+ * timestamps of the entries and of the gaps between them to a transaction's ID.
+ * If the limit is reached, the gap after the last entry collected is not covered.
+ * Each entry collected is returned with a reference (see mapEntryRef()).
+ *
+ * @param slp  The index.
+ * @param lo  The least key in the range, or NULL for no lower bound.
+ * @param hi  The key just past the range, or NULL for no upper bound.
+ * @param limit  The greatest number of entries to collect, or 0 for no limit.
+ * @param id  ID of the transaction scanning the range, or 0 to leave the read
+ *   timestamps alone.
+ * @param countp  Variable into which the number of entries collected is stored.
+ * @return  An array of the entries collected, which the caller must free.
+ */
+MAP_ENTRY **skiplist_scan(SKIPLIST *slp, BLOB *lo, BLOB *hi, int limit, uint64_t id, int *countp);
+
+#endif
@@ -48,12 +48,19 @@
  * at least one committed version before garbage collection, there will be exactly
  * one committed version afterwards.  Also, if there were only aborted versions
  * before garbage collection, then the version list will be empty afterwards.
+ * The exception is while a snapshot could still need an older committed version
+ * (see trans_watermark() in transaction.h): then the last committed version below
+ * the watermark is kept too, with the committed versions after it, so that every
+ * snapshot, whether in use or taken later, finds its value.
  *
  * After garbage collection, a GET or a PUT operation is only permitted to succeed
  * if the transaction ID of the performing transaction is greater than or equal to the
  * transaction ID of the creator of any existing version.
- * If this is not the case, then the operation has no effect and the performing transaction
- * is aborted.  If the transaction ID of the performing transaction is indeed the greatest,
+ * If this is not the case, conflicts are settled by wound-wait (see transaction.h):
+ * if none of the later versions has committed and the performing transaction is older
+ * than each of their pending creators, it "wounds" them, aborting them, and their
+ * versions are collected.  Otherwise the operation has no effect and the performing
+ * transaction is aborted.  If the transaction ID of the performing transaction is the greatest,
  * then a new version is created, and that version is either added to the end of
  * the version list (if the transaction ID of the performing transaction is strictly
  * greater than the existing transaction IDs), or else it replaces the last version
@@ -71,8 +78,33 @@
  * transactions with greater transaction IDs.  In database jargon, the sequence of
  * operations performed by transactions is "serializable" using the ordering of the
  * transaction IDs as the serialization order.
+ *
+ * A RANGE operation reads, in key order, the keys lying in a range.  Each key
+ * found is read just as by GET, creating a version.  So that a key cannot appear
+ * in the range after a transaction has scanned it (a "phantom"), the transaction
+ * also leaves its ID as the "read timestamp" of every key and every gap between
+ * keys that the scan covered.  A GET or PUT of a key is only permitted if the ID
+ * of the performing transaction is greater than or equal to the key's read
+ * timestamp, and a key that comes into existence inside a gap takes over the
+ * gap's read timestamp.  Otherwise the operation has no effect and the
+ * transaction is aborted, exactly as if the scanning transaction had created a
+ * version of the key.
+ *
+ * All of the above describes the default engine.  Under ENGINE_MVCC (see
+ * transaction.h) a GET or RANGE only reads, from the transaction's own writes
+ * or from its snapshot, and a PUT only buffers the write in the transaction.
+ * A version list then holds nothing but the versions installed by commits, in
+ * order of commit timestamp, of which only one that is being committed, or
+ * whose creator was aborted while it was, can be other than committed.  Garbage
+ * collection drops the aborted versions without aborting anybody else.  Under
+ * ENGINE_OCC, PUT and the version lists are the same, but a GET or RANGE reads
+ * the last committed version of each key, noting what it read for the commit
+ * to check, and leaves no read timestamps.  Under ENGINE_2PL, a GET, PUT or
+ * RANGE also locks the entry of each key it touches, which keeps the entry from
+ * being removed; otherwise it is the same.
  */
 
+#include <stdatomic.h>
 #include "data.h"
 #include "transaction.h"
 
@@ -81,36 +113,162 @@
  * A "bucket" is a singly linked list of "map entries", where each map entry
  * contains the version list associated with a single key.
  *
- * The following defines the number of buckets in the map.
- * To make things easy and simple, we will not change the number of buckets once the
- * map has been initialized, but in a more realistic implementation the number of
- * buckets would be increased if the "load factor" (average number of entries per
- * bucket) gets too high.
+ * The following defines the initial number of buckets in the map.
+ * The number of buckets is always a power of two, so that the bucket for a key
+ * is simply the low-order bits of its hash.  The table is doubled when the
+ * "load factor" (average number of entries per bucket) exceeds MAX_LOAD_FACTOR,
+ * and halved when it drops below MIN_LOAD_FACTOR (but never below the size
+ * requested at startup).  Entries are moved to the new table a few buckets at a
+ * time by ordinary GET and PUT operations, so no single request pays for the
+ * whole resize.
+ *
+ * Concurrency control is "striped": a bucket is protected by the stripe mutex
+ * selected by the low-order bits of its index.  Because the table never has fewer
+ * buckets than there are stripes, all keys in a bucket (in either table during a
+ * resize) use the same stripe.  Each map entry has its own mutex protecting its
+ * version list, so operations on different keys proceed in parallel.
+ *
+ * Lookups of keys that already have an entry take no lock at all: the bucket
+ * chains are traversed with atomic loads inside an epoch critical section
+ * (see epoch.h), and anything unlinked from the map is retired rather than freed.
+ * Only a lookup that misses falls back to the stripe mutex, to insert the entry.
+ */
+#define NUM_STRIPES 64
+#define NUM_BUCKETS NUM_STRIPES
+#define MAX_LOAD_FACTOR 1
+#define MIN_LOAD_FACTOR 8   // Shrink when entries < buckets / MIN_LOAD_FACTOR.
+#define REHASH_STEP 4       // Buckets migrated per operation during a resize.
+
+/*
+ * Instead of the chained map, the store can index its map entries with an
+ * open-addressing table (see swiss.h).  The index is chosen before the store
+ * is initialized, and applies for as long as the store exists.
+ */
+#define INDEX_CHAINED 0
+#define INDEX_SWISS 1
+
+/*
+ * The store can be run as a cache, with a budget on the memory used by its map
+ * entries, keys, versions and blobs.  Map entries are kept on a ring swept by a
+ * CLOCK hand: an entry used since the hand last passed is given another turn,
+ * while one that holds nothing but a committed version is evicted, losing its
+ * value.  Entries with pending versions are never evicted, and nor is an entry
+ * whose committed version is newer than some pending transaction, for the same
+ * reason as below.  Eviction is done by the reaper (see reaper.h) for as long
+ * as the budget is exceeded, examining as many entries per cycle as it collects.
+ * Without a budget no memory is accounted and entries are never evicted.
  */
-#define NUM_BUCKETS 8
 
 /*
  * A map entry represents one entry in the map.
  * Each map entry contains associated key, a singly linked list of versions,
- * and a pointer to the next entry in the same bucket.
+ * and a pointer to the next entry in the same bucket.  Since versions are
+ * sorted by creator ID, the tail of the list has the greatest creator ID and
+ * the value a new version would read, so keeping a pointer to it makes both
+ * available without a walk.  Versions after the committed one are the only
+ * ones a new version can depend on.  An entry whose version
+ * list may have garbage to collect is "dirty", and queued for the reaper
+ * (see reaper.h).
+ *
+ * An entry that is left with no versions, or with only a committed NULL version
+ * (from a GET of a missing key, or a PUT of NULL), is removed from the map by
+ * the reaper.  In the latter case this waits until every transaction older
+ * than the version's creator has finished, since such a transaction would have
+ * been aborted on finding the entry, but not on finding no entry.  A removed
+ * entry is marked "dead" before its mutex is released, and an operation that
+ * finds a dead entry after locking it looks the key up again.  Entries are
+ * reference counted, since the reaper's queues and the transactions that have
+ * touched an entry may still refer to it after it has been removed.  An entry
+ * locked under ENGINE_2PL is not removed until the lock is let go of.
  */
+struct entry_lock;
 typedef struct map_entry {
     KEY *key;
     VERSION *versions;
-    struct map_entry *next;
+    VERSION *tail;          // Last version, whose creator has the greatest ID.
+    VERSION *committed;     // Latest version known to be committed, or NULL.
+    _Atomic(struct map_entry *) next;
+    pthread_mutex_t mutex;  // Mutex to protect the version list.
+    atomic_int dirty;       // Nonzero while queued for garbage collection.
+    _Atomic(struct map_entry *) dirty_next;  // Next in the reaper's queue.
+    int deferred;           // Nonzero while waiting in the reaper's deferred list.
+    struct map_entry *defer_next;  // Next in the reaper's deferred list.
+    int dead;               // Nonzero once removed from the map.
+    atomic_int refcnt;      // Number of references, including one from the map.
+    atomic_int referenced;  // Nonzero if used since the CLOCK hand last passed.
+    struct map_entry *clock_next;  // Neighbours in the CLOCK ring, in cache mode.
+    struct map_entry *clock_prev;
+    struct skipnode *node;  // Node in the ordered index, once inserted there.
+    _Atomic uint64_t rts;   // Read timestamp left by range scans.
+    uint64_t collected;     // Creator ID of the first committed version collected, or UINT64_MAX.
+    struct entry_lock *lock;  // Lock under ENGINE_2PL, made when first taken, or NULL.
 } MAP_ENTRY;
 
 /*
- * The map is an array of buckets.
- * Each bucket is a singly linked list of map entries whose keys all hash
- * to the same location.
+ * The lock on a map entry under ENGINE_2PL, held shared by any number of
+ * transactions or exclusively by one, and protected by the entry's mutex.
+ * Transactions waiting for it wait on the condition, with the mutex.
+ */
+typedef struct entry_lock {
+    struct transaction **holders;  // Transactions holding the lock.
+    int num_holders;        // Number of entries in holders.
+    int max_holders;        // Allocated size of holders.
+    int exclusive;          // Nonzero if the one holder holds the lock exclusively.
+    int waiters;            // Number of transactions waiting.
+    pthread_cond_t cond;    // Signalled when the lock is let go of.
+} ENTRY_LOCK;
+
+/*
+ * An array of buckets, each a singly linked list of map entries whose keys all hash
+ * to the same location.  The size is kept with the buckets, so a reader that loads
+ * a table pointer without locking always sees the matching size.
+ */
+typedef struct buckets {
+    int num_buckets;                     // Size of the table.
+    _Atomic(MAP_ENTRY *) bucket[];       // Heads of the bucket chains.
+} BUCKETS;
+
+/*
+ * The map is an array of buckets.  While a resize is in progress, entries live in
+ * either the old table or the new one: buckets of the old table below rehash_idx
+ * have already been emptied into the new table.  The table pointers only change
+ * while every stripe is held, so holding any one stripe is enough to read them.
  */
 struct map {
-    MAP_ENTRY **table;      // The hash table.
-    int num_buckets;        // Size of the table.
-    pthread_mutex_t mutex;  // Mutex to protect the table.
+    _Atomic(BUCKETS *) table;      // The hash table.
+    _Atomic(BUCKETS *) old_table;  // Table being drained by a resize, or NULL.
+    int rehash_idx;                // Next bucket of the old table to be migrated.
+    atomic_int num_entries;        // Number of map entries in both tables.
+    int min_buckets;               // The table is never shrunk below this size.
+    pthread_mutex_t mutex;         // Mutex held by the thread resizing the table.
+    pthread_mutex_t stripes[NUM_STRIPES];  // Mutexes to protect the buckets.
+    int index;                     // INDEX_CHAINED or INDEX_SWISS.
+    int engine;                    // Concurrency-control engine (see transaction.h).
+    struct swiss *swiss;           // The open-addressing index, if selected.
+    atomic_long removed;           // Number of entries removed by the reaper.
+    atomic_long removed_bytes;     // Memory released by removing them.
+    long budget;                   // Memory budget in cache mode, or 0.
+    atomic_long bytes;             // Memory in use, accounted in cache mode only.
+    atomic_long evicted;           // Number of entries evicted to stay within budget.
+    atomic_long evicted_bytes;     // Memory released by evicting them.
+    MAP_ENTRY *clock_hand;         // Next entry to be examined for eviction.
+    pthread_mutex_t clock_mutex;   // Mutex to protect the CLOCK ring.
+    struct skiplist *ordered;      // The ordered index of all entries (see skiplist.h).
 } the_map;
 
+/*
+ * Statistics about the store.
+ */
+typedef struct store_stats {
+    long entries;                  // Number of map entries.
+    long removed;                  // Number of entries removed because they held no value.
+    long removed_bytes;            // Approximate memory released by removing them.
+    long budget;                   // Memory budget in cache mode, or 0.
+    long bytes;                    // Approximate memory in use, in cache mode.
+    long evicted;                  // Number of entries evicted to stay within budget.
+    long evicted_bytes;            // Approximate memory released by evicting them.
+} STORE_STATS;
+
 /*
  * Initialize the store.
  */
@@ -138,6 +296,21 @@ void store_fini(void);
  */
 TRANS_STATUS store_put(TRANSACTION *tp, KEY *key, BLOB *value);
 
+/*
+ * Put a key/value mapping in the store, where the key is given as raw content
+ * rather than as a KEY.  This is equivalent to store_put() with a key created
+ * from the content, except that the key is only copied if the store has no
+ * entry for it yet.  The content remains the caller's.
+ *
+ * @param tp  The transaction in which the operation is being performed.
+ * @param key  The content of the key.
+ * @param size  The size in bytes of the key.
+ * @param value  The value.
+ * @return  Updated status of the transation, either TRANS_PENDING,
+ *   or TRANS_ABORTED.
+ */
+TRANS_STATUS store_put_raw(TRANSACTION *tp, char *key, size_t size, BLOB *value);
+
 /*
  * Get the value associated with a specified key.  A pointer to the
  * associated value is stored in the specified variable.
@@ -156,6 +329,58 @@ TRANS_STATUS store_put(TRANSACTION *tp, KEY *key, BLOB *value);
  */
 TRANS_STATUS store_get(TRANSACTION *tp, KEY *key, BLOB **valuep);
 
+/*
+ * Get the value associated with a key given as raw content.  This is
+ * equivalent to store_get() with a key created from the content, except
+ * that the key is only copied if the store has no entry for it yet.
+ * The content remains the caller's.
+ *
+ * @param tp  The transaction in which the operation is being performed.
+ * @param key  The content of the key.
+ * @param size  The size in bytes of the key.
+ * @param valuep  A variable into which a returned value pointer may be stored.
+ * @return  Updated status of the transation, either TRANS_PENDING,
+ *   or TRANS_ABORTED.
+ */
+TRANS_STATUS store_get_raw(TRANSACTION *tp, char *key, size_t size, BLOB **valuep);
+
+/*
+ * Read the values associated with the keys in a range, in order of key (see
+ * skiplist.h).  Each key is read as by store_get(), and keys that have no
+ * value for the transaction are reported with a NULL value, so that the last
+ * key reported shows how far the scan got.  The range is protected against
+ * phantoms as far as the scan got, except in a read-only transaction, whose
+ * snapshot needs no protection.  The scan stops early if the transaction
+ * aborts.
+ *
+ * @param tp  The transaction in which the operation is being performed.
+ * @param lo  The content of the least key in the range, or NULL for no lower bound.
+ * @param lo_size  The size in bytes of lo.
+ * @param hi  The content of the key just past the range, or NULL for no upper bound.
+ * @param hi_size  The size in bytes of hi.
+ * @param limit  The greatest number of keys to read, or 0 for no limit.
+ * @param emit  Function called with each key and its value, in order, which
+ *   remain the store's.  The value may be NULL.  It is only called once all
+ *   the keys have been read, with nothing locked, so it may block.
+ * @param arg  Argument passed through to emit.
+ * @return  Updated status of the transation, either TRANS_PENDING,
+ *   or TRANS_ABORTED.
+ */
+TRANS_STATUS store_range(TRANSACTION *tp, char *lo, size_t lo_size, char *hi, size_t hi_size, int limit,
+                         void (*emit)(KEY *key, BLOB *value, void *arg), void *arg);
+
+/*
+ * Get statistics about the store.
+ *
+ * @param sp  Structure into which the statistics are stored.
+ */
+void store_stats(STORE_STATS *sp);
+
+/*
+ * Print statistics about the store to stderr.
+ */
+void store_show_stats(void);
+
 /*
  * Print the contents of the store to stderr.
  * No locking is performed, so this is not thread-safe.
@@ -0,0 +1,100 @@
+#ifndef SWISS_H
+#define SWISS_H
+
+#include "store.h"
+
+/*
+ * An open-addressing ("Swiss table") index of map entries, usable by the store
+ * in place of the chained hash map.
+ *
+ * Slots are arranged in groups of GROUP_WIDTH.  Alongside the slot array is an
+ * array of one-byte "control" values, one per slot: either EMPTY, DELETED, or the
+ * top seven bits of the key's hash (its "fingerprint") for a full slot.  A lookup
+ * loads a whole group of control bytes at once and compares them all against the
+ * fingerprint with a single SIMD instruction (SSE2, or AVX2 when the compiler is
+ * allowed to use it, e.g. with CC="gcc -mavx2").  The entry, its key and the key's
+ * blob are only touched for slots whose fingerprint matches, and the probe stops
+ * at the first group containing an EMPTY slot.
+ *
+ * To allow concurrent use, the table is split into SWISS_SHARDS independent shards
+ * selected by the hash, each with its own mutex.  As with the chained map, lookups
+ * of existing keys take no lock: a lookup that finds its key can trust the result,
+ * while one that misses must be repeated under the mutex by swiss_insert().
+ * Control bytes are therefore atomic, written with relaxed stores and read
+ * with relaxed loads, or a group at a time by the vector load, which reads
+ * each byte once.
+ * Slot arrays replaced by a resize are retired through the epoch module, so
+ * lookups must be made inside an epoch critical section.  A resize rehashes a
+ * single shard, so it pauses only the inserts into that shard.
+ */
+#define SWISS_SHARDS 64
+
+typedef struct swiss SWISS;
+
+/*
+ * Create an empty index.
+ *
+ * @param num_keys  Number of keys to size the index for.
+ * @return  The new index.
+ */
+SWISS *swiss_init(size_t num_keys);
+
+/*
+ * Grow an index, if necessary, so that it can hold a given number of keys
+ * without further resizing.
+ *
+ * @param sp  The index.
+ * @param num_keys  Number of keys.
+ */
+void swiss_reserve(SWISS *sp, size_t num_keys);
+
+/*
+ * Finalize an index, passing every entry in it to a disposal function.
+ *
+ * @param sp  The index.
+ * @param dispose  Function called on each entry.
+ */
+void swiss_fini(SWISS *sp, void (*dispose)(MAP_ENTRY *));
+
+/*
+ * Look up the entry for a key, without locking.
+ *
+ * @param sp  The index.
+ * @param key  The key.
+ * @return  The entry for the key, or NULL if none was found.  A NULL result is
+ *   not definitive, since the key may be being inserted concurrently.
+ */
+MAP_ENTRY *swiss_lookup(SWISS *sp, KEY *key);
+
+/*
+ * Insert a new entry, unless an entry with the same key is already present.
+ *
+ * @param sp  The index.
+ * @param mapEntry  The new entry.
+ * @return  The entry now in the index for the key: either mapEntry, or the
+ *   existing entry, in which case mapEntry has not been inserted.
+ */
+MAP_ENTRY *swiss_insert(SWISS *sp, MAP_ENTRY *mapEntry);
+
+/*
+ * Remove an entry from an index.  The slot is marked DELETED rather than
+ * EMPTY, so that probes for other keys continue past it; DELETED slots are
+ * cleaned out when the shard is next resized.  Lookups may still be holding
+ * the entry, so the caller must not free it until they are done.
+ *
+ * @param sp  The index.
+ * @param mapEntry  The entry.
+ * @return  Nonzero if the entry was found and removed.
+ */
+int swiss_remove(SWISS *sp, MAP_ENTRY *mapEntry);
+
+/*
+ * Print the contents of an index to stderr, for debugging.
+ * No locking is performed, so this is not thread-safe.
+ *
+ * @param sp  The index.
+ * @param show  Function called to print each entry.
+ */
+void swiss_show(SWISS *sp, void (*show)(MAP_ENTRY *));
+
+#endif
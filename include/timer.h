@@ -0,0 +1,75 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * A single hashed timing wheel, driven by one thread, on which deadlines of
+ * any kind can be armed.
+ *
+ * Time is counted in ticks of TIMER_TICK_MS milliseconds since the wheel was
+ * started.  The wheel has TIMER_SLOTS slots, each a circular, doubly linked list
+ * of the timers due at a tick with that number modulo TIMER_SLOTS, so arming
+ * and cancelling a timer take constant time whatever the deadline, and each
+ * tick only looks at one slot.  Timers further off than a turn of the wheel
+ * stay in their slot until a turn in which they are due.
+ *
+ * A timer is embedded in the object it belongs to.  When it fires it is taken
+ * off the wheel first, and its function is called without any lock held, so the
+ * function may arm it again.  Whoever arms a timer on an object that can be
+ * freed must keep the object alive for as long as the timer is armed: the
+ * function is then responsible for that reference when the timer fires, and
+ * the caller of timer_cancel() when it returns nonzero.
+ *
+ * While no timer is armed the thread sleeps until one is.
+ */
+#define TIMER_TICK_MS 10    // Length of a tick.
+#define TIMER_SLOTS 512     // Number of slots, a power of two.
+
+typedef struct timer {
+  struct timer *next;        // Next in slot, or in list of timers that fired.
+  struct timer *prev;        // Prev in slot.
+  uint64_t expires;          // Tick at which the timer fires.
+  int armed;                 // Nonzero while on the wheel.
+  void (*fire)(void *arg);   // Function called when the timer fires.
+  void *arg;                 // Argument passed to fire.
+} TIMER;
+
+/*
+ * Start the wheel and its thread.
+ */
+void timer_init(void);
+
+/*
+ * Stop the thread.  Timers still armed are forgotten without firing.
+ */
+void timer_fini(void);
+
+/*
+ * Arm a timer, or move it if it is armed already.
+ *
+ * @param tmp  The timer.
+ * @param ms  Milliseconds from now at which the timer should fire; it fires at
+ *   the first tick at or after that.
+ * @param fire  Function to call when the timer fires.
+ * @param arg  Argument passed to fire.
+ * @return  Nonzero if the timer was armed already.
+ */
+int timer_arm(TIMER *tmp, long ms, void (*fire)(void *arg), void *arg);
+
+/*
+ * Take a timer off the wheel, if it is on it.
+ *
+ * @param tmp  The timer.
+ * @return  Nonzero if the timer was armed, and so will not fire.
+ */
+int timer_cancel(TIMER *tmp);
+
+/*
+ * Get the time on the wheel's clock.
+ *
+ * @return  Milliseconds since the wheel was started.
+ */
+uint64_t timer_now(void);
+
+#endif
@@ -12,6 +12,9 @@
 
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "timer.h"
 
 /*
  * A transaction is a context within which to perform a sequence of operations
@@ -44,39 +47,266 @@ typedef enum { TRANS_PENDING, TRANS_COMMITTED, TRANS_ABORTED } TRANS_STATUS;
  * ID.  Once that occurs, the dependent transaction cannot commit until the
  * the transaction on which it depends has committed.  Moreover, if the
  * other transaction aborts, then the dependent transaction must also abort.
+ * Each transaction keeps an edge back to every pending transaction that
+ * depends on it, so that the abort is passed on at once, and transitively,
+ * rather than found out when the dependent tries to commit: a doomed client's
+ * next request fails without touching the store, and a doomed commit is
+ * reported without waiting for its other dependencies.  The same edge counts
+ * the dependent down once its commit has been requested (see
+ * trans_commit_async()).
  *
  * The dependencies of a transaction are recorded in a "dependency set",
- * which is part of the representation of a transaction.  A dependency set
- * is represented as a singly linked list of "dependency" nodes having the
- * following structure.  Any given transaction can occur at most once in a
- * single dependency set.
+ * which is part of the representation of a transaction.  Any given
+ * transaction can occur at most once in a single dependency set, and the set
+ * holds a single reference to it.  The first DEPS_INLINE dependencies are
+ * kept in an array inside the set; beyond that the set moves to a hash
+ * table, open-addressed and kept at most half full.  Dependencies that have
+ * committed have nothing left to wait for, so whenever the set is full they
+ * are dropped before it grows.
  */
 typedef struct dependency {
   struct transaction *trans;  // Transaction on which the dependency depends.
-  struct dependency *next;    // Next dependency in the set.
+  unsigned int generation;    // Generation of trans when the dependency was added.
+  int edge;                   // Index of the edge back in trans->dependents, or -1 if none.
 } DEPENDENCY;
 
+/*
+ * The edge a dependency keeps back to a transaction that depends on it, so as
+ * to abort the transaction as soon as the dependency aborts and, once the
+ * transaction's commit has been requested, to count it down when the
+ * dependency finishes either way.  The edge holds a reference.
+ */
+typedef struct dependent {
+  struct transaction *trans;  // Transaction that depends on this one.
+  int counted;                // Nonzero if trans is committing and counts this one as unresolved.
+} DEPENDENT;
+
+#define DEPS_INLINE 4
+
+typedef struct dependency_set {
+  int count;                  // Number of dependencies in the set.
+  int capacity;               // Size of table, or 0 while the array is used.
+  DEPENDENCY *table;          // Hash table of dependencies, or NULL.
+  DEPENDENCY array[DEPS_INLINE];  // The dependencies, while there are few enough.
+} DEPENDENCY_SET;
+
+/*
+ * A write buffered by a transaction until it commits, under an engine that
+ * does not put versions in the store as it goes (see ENGINE_MVCC).  The write
+ * holds a reference to the map entry and to the value.
+ */
+typedef struct write {
+  struct map_entry *entry;   // Entry written.
+  struct blob *value;        // Value to install, or NULL.
+  int seq;                   // Position in the order the writes were made.
+} WRITE;
+
+/*
+ * A read made by a transaction under ENGINE_OCC, checked when it commits.
+ * The read holds a reference to the map entry.
+ */
+typedef struct read {
+  struct map_entry *entry;   // Entry read.
+  uint64_t ts;               // Stamp of the committed version read, or 0 if there was none.
+} READ;
+
+/*
+ * A range scanned by a transaction under ENGINE_OCC or ENGINE_2PL, scanned
+ * again when it commits, to find keys put in it since.  The bounds are copies.
+ */
+typedef struct scan {
+  struct blob *lo;           // Least key in the range, or NULL for none.
+  struct blob *hi;           // Key just past the range, or NULL for none.
+  int limit;                 // Greatest number of keys scanned, or 0 for no limit.
+} SCAN;
+
+/*
+ * Function called when a transaction whose commit was requested with
+ * trans_commit_async() has committed or aborted.
+ */
+struct transaction;
+typedef void (*TRANS_CALLBACK)(struct transaction *tp, TRANS_STATUS status, void *arg);
+
 /*
  * Structure representing a transaction.
  */
 typedef struct transaction {
-  unsigned int id;           // Transaction ID.
+  uint64_t id;               // Transaction ID.
+  uint64_t priority;         // Age in conflicts: the ID of the first attempt, smaller winning.
+  int read_only;             // Nonzero if the transaction only reads a snapshot.
+  uint64_t snapshot;         // Version stamps below this are visible to the snapshot.
+  uint64_t commit_ts;        // Commit timestamp, if the engine takes one, or 0 if none taken.
+  WRITE *writes;             // Writes buffered until commit.
+  int num_writes;            // Number of entries in writes.
+  int max_writes;            // Allocated size of writes.
+  READ *reads;               // Reads to check at commit.
+  int num_reads;             // Number of entries in reads.
+  int max_reads;             // Allocated size of reads.
+  SCAN *scans;               // Ranges to scan again at commit.
+  int num_scans;             // Number of entries in scans.
+  int max_scans;             // Allocated size of scans.
   unsigned int refcnt;       // Number of references (pointers) to transaction.
-  TRANS_STATUS status;       // Current transaction status.
-  DEPENDENCY *depends;       // Singly-linked list of dependencies.
-  int waitcnt;               // Number of transactions waiting for this one.
-  sem_t sem;                 // Semaphore to wait for transaction to commit or abort.
+  _Atomic TRANS_STATUS status;  // Current transaction status, set under mutex.
+  DEPENDENCY_SET depends;    // Set of dependencies.
+  _Atomic int unresolved;    // Dependencies a committing transaction still waits for.
+  DEPENDENT *dependents;     // Edges back from this transaction to those depending on it.
+  int num_dependents;        // Number of entries in dependents.
+  int max_dependents;        // Allocated size of dependents.
+  TRANS_CALLBACK on_commit;  // Function to call once a requested commit is decided.
+  void *commit_arg;          // Argument for on_commit.
+  struct transaction *ready_next;  // Next in list of transactions ready to be decided.
+  struct transaction *doomed_next;  // Next in list of commits aborted with a dependency, to report.
+  atomic_int reported;       // Set once on_commit has been called.
+  TIMER timer;               // Idle timeout, or deadline of a requested commit.
+  long idle_ms;              // Idle timeout in milliseconds, or 0 for none.
+  long commit_ms;            // Longest wait for a requested commit, or 0 for no limit.
+  _Atomic uint64_t last_active;  // Time of the last request, on the timer wheel's clock.
+  uint64_t commit_due;       // Time at which a requested commit is given up, or 0.
   pthread_mutex_t mutex;     // Mutex to protect fields.
-  struct transaction *next;  // Next in list of all transactions
-  struct transaction *prev;  // Prev in list of all transactions.
+  struct transaction *next;  // Next in registry list.
+  struct transaction *prev;  // Prev in registry list.
+  int shard;                 // Registry list the transaction is on.
+  struct transaction *pending_next;  // Next in list of pending transactions.
+  struct transaction *pending_prev;  // Prev in list of pending transactions.
+  struct map_entry **touched;  // Store entries holding a version by this transaction.
+  int num_touched;           // Number of entries in touched.
+  int max_touched;           // Allocated size of touched.
+  struct map_entry **locks;  // Store entries locked by this transaction, under ENGINE_2PL.
+  int num_locks;             // Number of entries in locks.
+  int max_locks;             // Allocated size of locks.
+  struct map_entry *waiting; // Entry whose lock the transaction is waiting for, or NULL.
+  unsigned int generation;   // Number of times the object has been recycled.
 } TRANSACTION;
 
+/*
+ * Transaction objects are pooled.  When its last reference is dropped, a
+ * transaction goes on a free list of the thread that dropped it, keeping its
+ * mutex initialized, and trans_create() takes objects from the
+ * calling thread's list before allocating new ones.  A thread keeps at most
+ * TRANS_POOL_LOCAL objects, moving half of them to a shared list beyond that
+ * and refilling from it when it runs out; the list of a thread that exits goes
+ * to the shared list too.
+ *
+ * Each reuse of an object advances its generation.  A reference to a
+ * transaction that is kept in another structure records the generation it was
+ * taken in, and is checked with trans_check() when it is used, so that a
+ * reference that outlived the transaction is caught rather than silently
+ * referring to an unrelated one.
+ */
+#define TRANS_POOL_LOCAL 64
+
 /*
  * For debugging purposes, all transactions having a nonzero reference count
- * are maintained in a circular, doubly linked list which has the following
- * sentinel as its head.
+ * are maintained in a registry, split into TRANS_SHARDS circular, doubly linked
+ * lists, each with a sentinel as its head and a mutex of its own.  Each thread
+ * registers the transactions it creates on one of the lists, so that threads
+ * seldom share a mutex, and a transaction is unlinked from its list in constant
+ * time when it is freed.  Release builds can leave the registry out altogether
+ * by defining NO_TRANS_REGISTRY.
+ */
+#define TRANS_SHARDS 16
+
+/*
+ * A transaction that is left pending keeps every later transaction that
+ * touches the same keys from committing.  Each transaction therefore has an
+ * idle timeout, after which it is aborted if no request has been made in it,
+ * and a deadline for a requested commit, after which the commit is given up
+ * and reported as aborted.  Both are kept on the timer wheel (see timer.h), by
+ * a single timer per transaction: a request only stamps the time, and the timer
+ * looks at the stamp when it fires, moving itself on if there was activity.
+ * The versions of a transaction aborted this way are collected as for any
+ * other abort, aborting in turn the pending transactions that read them.
+ */
+typedef struct trans_stats {
+    long idle_aborts;          // Transactions aborted for being idle too long.
+    long commit_aborts;        // Commits given up for taking too long.
+    long wounds;               // Transactions aborted by older ones (see trans_wound()).
+    long retries;              // Transactions created with a retry token.
+    long cascades;             // Transactions aborted because a dependency aborted.
+} TRANS_STATS;
+
+/*
+ * Conflicts are settled by wound-wait, on the priority of each transaction,
+ * which is its age: the ID of its first attempt.  An older transaction that
+ * is too late for a younger one's pending versions "wounds" it, aborting it
+ * instead of being aborted, while a younger one waits for an older one, as a
+ * dependency.  So that retrying does not make a transaction younger, a client
+ * whose transaction aborts is given a retry token, which it can present in
+ * the next transaction to take over the priority of the first attempt.  A
+ * token carries the ID of the transaction that aborted, its priority and the
+ * time it was issued, authenticated by SipHash-2-4 keyed with a secret chosen
+ * at startup, so that a client cannot make up one it was not given.  A token
+ * can be redeemed once, within TRANS_TOKEN_TTL milliseconds of being issued:
+ * the IDs of those redeemed are remembered until they would be too old anyway.
+ * Priority only orders conflicts: a retried transaction still gets a new ID,
+ * which fixes its place in the serial order.
+ */
+#define TRANS_TOKEN_SIZE 32
+#define TRANS_TOKEN_TTL 60000
+
+
+/*
+ * The store can run one of several concurrency-control engines, chosen before
+ * the transaction manager is initialized.
+ *
+ * ENGINE_ORDERED, the default, serializes transactions in order of ID, as
+ * described in store.h.
+ *
+ * ENGINE_MVCC gives snapshot isolation.  A transaction reads, as a read-only
+ * transaction does, a snapshot of the committed state of the store, so reads
+ * never wait for or abort anybody.  Writes are buffered in the transaction and
+ * installed when it commits, as versions stamped with a commit timestamp taken
+ * from a clock of their own.  A commit is published, advancing the snapshot
+ * clock past its timestamp, only once every earlier timestamp has been, so a
+ * snapshot sees either all or none of each transaction's writes.  Two
+ * transactions that write the same key concurrently conflict, and the first
+ * to commit wins: a commit that finds a version of one of its keys stamped
+ * after its snapshot aborts.  In this engine every transaction, not just a
+ * read-only one, has a snapshot, which is one past the timestamp last
+ * published when it was created.
+ *
+ * ENGINE_OCC is optimistic, and serializable.  Writes are buffered and
+ * installed with a commit timestamp, as under ENGINE_MVCC, but a transaction
+ * reads the last committed version of each key, and adds nothing to the
+ * store when it does: it only notes the entry read and the stamp of the
+ * version it found, and the ranges it scanned.  At commit the entries read and
+ * written are locked, and the transaction aborts if any entry read has had a
+ * version installed since, or a range scanned has gained a key.  Otherwise
+ * its writes are installed under the same locks.  Nothing waits for anything,
+ * so conflicts cost an abort at commit, and the engine suits workloads where
+ * they are rare.  A read-only transaction reads a snapshot, as under
+ * ENGINE_MVCC, and is never checked.
+ *
+ * ENGINE_2PL is pessimistic, and serializable: strict two-phase locking, for
+ * workloads in which conflicts are common.  A GET takes a shared lock on the
+ * key's map entry and a PUT an exclusive one, and the locks are held until the
+ * transaction commits or aborts.  Writes are buffered and installed at commit
+ * as under ENGINE_OCC, with the ranges scanned checked for new keys.  A
+ * transaction that finds a key locked in a conflicting mode waits for it if it
+ * is older (of smaller priority) than every transaction holding the lock, and
+ * otherwise aborts ("wait-die"), so that no cycle of transactions can be
+ * waiting for one another.  A read-only transaction reads a snapshot, taking
+ * no locks.
+ */
+#define ENGINE_ORDERED 0
+#define ENGINE_MVCC 1
+#define ENGINE_OCC 2
+#define ENGINE_2PL 3
+
+/*
+ * Select the concurrency-control engine.  This must be done before
+ * trans_init().
+ *
+ * @param engine  ENGINE_ORDERED, ENGINE_MVCC, ENGINE_OCC or ENGINE_2PL.
+ */
+void trans_select_engine(int engine);
+
+/*
+ * Get the concurrency-control engine in use.
+ *
+ * @return  ENGINE_ORDERED, ENGINE_MVCC, ENGINE_OCC or ENGINE_2PL.
  */
-TRANSACTION trans_list;
+int trans_engine(void);
 
 /*
  * Initialize the transaction manager.
@@ -96,6 +326,25 @@ void trans_fini(void);
  */
 TRANSACTION *trans_create(void);
 
+/*
+ * A read-only transaction reads a consistent snapshot of the store, without
+ * adding versions, taking dependencies, or leaving read timestamps, so it
+ * neither waits for nor aborts the transactions that write.  Its snapshot is
+ * the ID of the oldest transaction pending when it is created: every
+ * transaction with a smaller ID has finished, so the last committed version
+ * by one of them is what the snapshot sees of each key.  Read-only
+ * transactions are kept, in order of snapshot, on a list of their own rather
+ * than the pending list, and the smallest snapshot still in use is the
+ * "snapshot horizon".  Garbage collection keeps the last committed version of
+ * each key below the watermark (see trans_watermark()), which is no greater
+ * than the horizon nor than any snapshot taken later, so a read-only
+ * transaction always finds the version it needs.  A read-only transaction
+ * that writes is aborted.
+ *
+ * @return  A pointer to the new transaction (with reference count 1).
+ */
+TRANSACTION *trans_create_read_only(void);
+
 /*
  * Increase the reference count on a transaction.
  *
@@ -138,6 +387,49 @@ void trans_add_dependency(TRANSACTION *tp, TRANSACTION *dtp);
  */
 TRANS_STATUS trans_commit(TRANSACTION *tp);
 
+/*
+ * Request the commit of a transaction, without waiting for it to be decided.
+ * The transaction counts its dependencies that are still pending, through
+ * the edge back to it that each of them holds; as each one commits or aborts,
+ * it counts the transaction down, and whichever thread resolves the last one
+ * commits or aborts the transaction, as trans_commit() would, and calls the
+ * function.  If no dependency is pending, that happens before this function
+ * returns.  If the transaction has a commit deadline and it passes first, or
+ * a dependency aborts, or an older transaction wounds it, the transaction is
+ * aborted and the function called right away instead.
+ *
+ * The function is called with a reference to the transaction still held, and
+ * must not block, since it runs in whatever thread happened to decide the
+ * transaction: another client's, the reaper or the timer, though never while
+ * that thread holds the mutex of a map entry (see trans_defer_decisions()).
+ * Anything slow, such as replying to a client, is handed to another thread.
+ * This function consumes a single reference to the transaction object, which
+ * the caller must not use afterwards.
+ *
+ * @param tp  The transaction to be committed.
+ * @param callback  The function to call with the final status.
+ * @param arg  Argument passed to the function.
+ */
+void trans_commit_async(TRANSACTION *tp, TRANS_CALLBACK callback, void *arg);
+
+/*
+ * Hold back the deciding of transactions in the calling thread.  A transaction
+ * whose last dependency finishes is decided, and its commit function called,
+ * by the thread that finished the dependency, which may be one aborting it
+ * with map entries locked, where the engine's prepare hook could deadlock and
+ * the commit function would block everyone waiting for the entries.  Until
+ * the matching trans_decide_deferred(), such transactions are only queued.
+ * Calls nest, and the store makes them around anything it does with entries
+ * locked.
+ */
+void trans_defer_decisions(void);
+
+/*
+ * End a trans_defer_decisions(), deciding the transactions queued meanwhile
+ * if it was the outermost.  The caller must hold no map entry's mutex.
+ */
+void trans_decide_deferred(void);
+
 /*
  * Abort a transaction.  If the transaction has already committed, it is
  * a fatal error and the program crashes.  If the transaction has already
@@ -153,6 +445,167 @@ TRANS_STATUS trans_commit(TRANSACTION *tp);
  */
 TRANS_STATUS trans_abort(TRANSACTION *tp);
 
+/*
+ * Abort a transaction on behalf of an older one, unless it has committed
+ * already.  Unlike trans_abort(), this consumes no reference.  If the commit
+ * of the transaction had been requested, it is reported as aborted.
+ *
+ * @param tp  The transaction to be aborted.
+ * @return  The final status of the transaction.
+ */
+TRANS_STATUS trans_wound(TRANSACTION *tp);
+
+/*
+ * Make the retry token of a transaction, for its client to present in the
+ * next attempt.
+ *
+ * @param tp  The transaction.
+ * @param token  Buffer of TRANS_TOKEN_SIZE bytes into which the token is stored.
+ */
+void trans_retry_token(TRANSACTION *tp, unsigned char *token);
+
+/*
+ * Give a new transaction the priority carried by a retry token, if the token
+ * is genuine, has not expired or been redeemed before, and the priority is
+ * older than the transaction's own.
+ *
+ * @param tp  The transaction, before any operation has been done in it.
+ * @param token  The token.
+ * @param size  The size in bytes of the token.
+ * @return  Nonzero if the token was accepted.
+ */
+int trans_redeem_token(TRANSACTION *tp, const unsigned char *token, size_t size);
+
+/*
+ * Check that a stored reference to a transaction is not stale: that the object
+ * has not been recycled since the reference was taken.  A stale reference is
+ * a fatal error and the program crashes.
+ *
+ * @param tp  The transaction.
+ * @param generation  The generation of the transaction when the reference was taken.
+ */
+void trans_check(TRANSACTION *tp, unsigned int generation);
+
+/*
+ * Set a function to be called once when a transaction commits or aborts,
+ * after its final status has been set.  The function is called with a
+ * reference to the transaction still held.  Passing NULL removes the hook.
+ *
+ * @param hook  The function.
+ */
+void trans_set_completion_hook(void (*hook)(TRANSACTION *tp));
+
+/*
+ * Set a function to be called once when a transaction commits or aborts,
+ * after the completion hook, for the engine to let go of what it holds for
+ * the transaction (the locks under ENGINE_2PL).  The function is called with
+ * a reference to the transaction still held, and with no lock held by the
+ * transaction manager.  Passing NULL removes the hook.
+ *
+ * @param hook  The function.
+ */
+void trans_set_release_hook(void (*hook)(TRANSACTION *tp));
+
+/*
+ * Set a function to be called when a transaction whose commit was requested
+ * has nothing left to wait for, to decide whether it can commit after all and
+ * make its writes ready to be seen.  It is not called for a transaction one of
+ * whose dependencies aborted.  The function returns TRANS_COMMITTED or
+ * TRANS_ABORTED, which becomes the final status unless the transaction has
+ * been aborted meanwhile.  Passing NULL removes the hook.
+ *
+ * @param hook  The function.
+ */
+void trans_set_prepare_hook(TRANS_STATUS (*hook)(TRANSACTION *tp));
+
+/*
+ * Take a commit timestamp for a transaction being prepared under any engine
+ * but ENGINE_ORDERED.
+ * The timestamp is published once the transaction has its final status, and
+ * until then no later one is.
+ *
+ * @param tp  The transaction.
+ * @return  The timestamp, which is also stored in tp->commit_ts.
+ */
+uint64_t trans_take_commit_ts(TRANSACTION *tp);
+
+/*
+ * Drop the reads and ranges a transaction has noted under ENGINE_OCC, with
+ * the references they hold.
+ *
+ * @param tp  The transaction.
+ */
+void trans_release_reads(TRANSACTION *tp);
+
+/*
+ * Set the timeouts given to transactions created from now on.
+ *
+ * @param idle_ms  Idle timeout in milliseconds, or 0 for none.
+ * @param commit_ms  Longest wait for a requested commit, or 0 for no limit.
+ */
+void trans_set_default_timeouts(long idle_ms, long commit_ms);
+
+/*
+ * Set the timeouts of a pending transaction, before its commit is requested.
+ * The idle timeout runs from now.
+ *
+ * @param tp  The transaction.
+ * @param idle_ms  Idle timeout in milliseconds, or 0 for none.
+ * @param commit_ms  Longest wait for a requested commit, or 0 for no limit.
+ */
+void trans_set_timeouts(TRANSACTION *tp, long idle_ms, long commit_ms);
+
+/*
+ * Record that a request has been made in a transaction, restarting its idle
+ * timeout.  This takes no lock.
+ *
+ * @param tp  The transaction.
+ */
+void trans_keepalive(TRANSACTION *tp);
+
+/*
+ * Get statistics about the transaction manager.
+ *
+ * @param sp  Structure into which the statistics are stored.
+ */
+void trans_stats(TRANS_STATS *sp);
+
+/*
+ * Print statistics about the transaction manager to stderr.
+ */
+void trans_show_stats(void);
+
+/*
+ * Get the ID of the oldest transaction that is still pending.  Every
+ * transaction with a smaller ID has committed or aborted, and every
+ * transaction created from now on will have a greater ID.
+ *
+ * @return  The smallest ID of a pending transaction, or the ID the next
+ *   transaction will get if none is pending.
+ */
+uint64_t trans_oldest_pending(void);
+
+/*
+ * Get the snapshot horizon: the smallest snapshot of a read-only transaction
+ * that has not yet finished.  This takes no lock, and may be stale; a snapshot
+ * taken after it was read is never less than what trans_oldest_pending()
+ * returned before that.
+ *
+ * @return  The smallest snapshot in use, or UINT64_MAX if there is none.
+ */
+uint64_t trans_snapshot_horizon(void);
+
+/*
+ * Get the stamp below which a committed version is as old as any transaction
+ * could need: the oldest pending ID under ENGINE_ORDERED, or one past the last
+ * published commit timestamp under the other engines, or the snapshot horizon if
+ * that is less.  No transaction created later can need anything older.  Under
+ * ENGINE_ORDERED this takes no lock.
+ *
+ * @return  The watermark.
+ */
+uint64_t trans_watermark(void);
+
 /*
  * Get the current status of a transaction.
  * If the value returned is TRANS_PENDING, then we learn nothing,
@@ -161,6 +614,10 @@ TRANS_STATUS trans_abort(TRANSACTION *tp);
  * either TRANS_COMMITTED or TRANS_ABORTED, then that value is the
  * stable final status of the transaction.
  *
+ * The status is read without locking: it is published with a release
+ * store, so a final status read here comes with everything the
+ * transaction did before it committed or aborted.
+ *
  * @param tp  The transaction.
  * @return  The status of the transaction, as it was at the time of call.
  */
@@ -177,7 +634,8 @@ void trans_show(TRANSACTION *tp);
 
 /*
  * Print information about all transactions to stderr.
- * No locking is performed, so this is not thread-safe.
+ * The whole registry is locked while it is walked, so the transactions shown
+ * are all those alive at one moment, but their fields are read without locking.
  * This should only be used for debugging.
  */
 void trans_show_all(void);
@@ -56,16 +56,16 @@ void creg_unregister(CLIENT_REGISTRY *cr, int fd) {
     pthread_mutex_lock(&cr->mutex);
 
     //  Decrement client count and clear fd from fd_set
-    cr->client_count--;
+    int count = --cr->client_count;
     FD_CLR(fd, &cr->client_fds);
 
     //  Unlock
     pthread_mutex_unlock(&(cr->mutex));
 
-    debug("Unregister client %d (Total connected: %d)", fd, cr->client_count);
+    debug("Unregister client %d (Total connected: %d)", fd, count);
 
     //  Unblock when number of clients reaches zero
-    if(cr->client_count == 0) V(&cr->wait_sem);
+    if(count == 0) V(&cr->wait_sem);
 }
 
 void creg_wait_for_empty(CLIENT_REGISTRY *cr) {
@@ -1,4 +1,5 @@
 #include "data.h"
+#include "epoch.h"
 #include "debug.h"
 #include "csapp.h"
 #include "string.h"
@@ -45,16 +46,16 @@ void blob_unref(BLOB *bp, char *why) {
     //  Lock.
     pthread_mutex_lock(&bp->mutex);
 
-    //  Decrease ref count.
-    bp->refcnt--;
+    //  Decrease ref count and obtain the new value, so only one thread sees it reach zero.
+    int val = --bp->refcnt;
 
     //  Unlock.
     pthread_mutex_unlock(&bp->mutex);
 
-    debug("Decrease reference count on blob %p [%p] (%d -> %d) %s", bp, bp->prefix, bp->refcnt + 1, bp->refcnt, why);
+    debug("Decrease reference count on blob %p [%p] (%d -> %d) %s", bp, bp->prefix, val + 1, val, why);
 
     //  If ref count == 0, free blob content and blob.
-    if(bp->refcnt == 0) {
+    if(val == 0) {
         debug("Free blob %p [%s]", bp, bp->prefix);
         Free(bp->content);
         Free(bp->prefix);
@@ -69,19 +70,97 @@ int blob_compare(BLOB *bp1, BLOB *bp2) {
     return 1;
 }
 
-int blob_hash(BLOB *bp) {
-    if(bp == NULL) return -1;
-    int bpHash = 6823, temp;
+/*
+ * The hash is wyhash (final version 4, public domain): the data is consumed
+ * eight bytes at a time by 64x64->128 bit multiplies, in three independent
+ * lanes for long keys, and short keys are read with a few overlapping loads.
+ */
+static const uint64_t wyp[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+static uint64_t hash_seed = 0x9e3779b97f4a7c15ull;
+
+static inline void wymum(uint64_t *a, uint64_t *b) {
+    __uint128_t r = (__uint128_t) *a * *b;
+    *a = (uint64_t) r;
+    *b = (uint64_t) (r >> 64);
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+//  Unaligned little-endian loads.
+static inline uint64_t wyr8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t wyr3(const uint8_t *p, size_t k) {
+    return ((uint64_t) p[0] << 16) | ((uint64_t) p[k >> 1] << 8) | p[k - 1];
+}
 
-    //  Assign another pointer so that blob content isn't being incremented.
-    char *copy = strndup(bp->content, bp->size);
-    char *orig = copy;
+void blob_hash_seed(uint64_t seed) {
+    hash_seed = seed;
+}
 
-    while((temp = *copy++)) bpHash = (bpHash + (bpHash << 5)) + temp;
+uint64_t blob_hash(BLOB *bp) {
+    if(bp == NULL) return 0;
+    return content_hash(bp->content, bp->size);
+}
 
-    Free(orig);
+uint64_t content_hash(const char *content, size_t size) {
+    const uint8_t *p = (const uint8_t *) content;
+    size_t len = size;
+    uint64_t seed = hash_seed ^ wymix(hash_seed ^ wyp[0], wyp[1]);
+    uint64_t a, b;
+
+    if(len <= 16) {
+        if(len >= 4) {
+            a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+            b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if(len > 0) {
+            a = wyr3(p, len);
+            b = 0;
+        }
+        else a = b = 0;
+    }
+    else {
+        size_t i = len;
+        if(i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while(i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while(i > 16) {
+            seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
+    }
 
-    return bpHash;
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(&a, &b);
+    return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
 }
 
 KEY *key_create(BLOB *bp) {
@@ -100,14 +179,16 @@ KEY *key_create(BLOB *bp) {
 void key_dispose(KEY *kp) {
     debug("Dispose of key %p [%p]", kp, kp->blob->prefix);
 
-    //  Decrement blob ref count.
+    /*  The key of a map entry is only disposed of with the entry, which is itself retired
+     *  once lookups are done with it, so no lock-free lookup can still be comparing against it.
+     */
     blob_unref(kp->blob, "for blob in key");
 
     Free(kp);
 }
 
 int key_compare(KEY *kp1, KEY *kp2) {
-    //  If hashes are equal, content must be equal so return true, else return false.
+    //  Keys with different hashes differ; otherwise compare the content.
     if(kp1->hash == kp2->hash) {
         return(blob_compare(kp1->blob, kp2->blob));
     }
@@ -122,6 +203,8 @@ VERSION *version_create(TRANSACTION *tp, BLOB *bp) {
 
     //  Version inherits reference to transaction.
     vp->creator = tp;
+    vp->generation = tp->generation;
+    vp->ts = tp->id;
 
     //  Version inherits reference to blob.
     vp->blob = bp;
@@ -132,20 +215,28 @@ VERSION *version_create(TRANSACTION *tp, BLOB *bp) {
     //  Increment transaction ref count.
     trans_ref(tp, "as creator of version");
 
-    if(bp == NULL) debug("Create NULL version for transaction %d -> %p", tp->id, tp);
-    else debug("Create version of blob %p [%p] for transaction %d -> %p", bp, bp->prefix, tp->id, tp);
+    if(bp == NULL) debug("Create NULL version for transaction %lu -> %p", tp->id, tp);
+    else debug("Create version of blob %p [%p] for transaction %lu -> %p", bp, bp->prefix, tp->id, tp);
 
     return vp;
 }
 
-void version_dispose(VERSION *vp) {
-    debug("Dispose of version %p", vp);
+static void versionFree(void *arg) {
+    VERSION *vp = arg;
 
     //  Decrement transaction ref count.
+    trans_check(vp->creator, vp->generation);
     trans_unref(vp->creator, "as creator of version");
 
-    //  Decrement transaction ref count.
+    //  Decrement blob ref count.
     blob_unref(vp->blob, "for blob in version");
 
     Free(vp);
-}
\ No newline at end of file
+}
+
+void version_dispose(VERSION *vp) {
+    debug("Dispose of version %p", vp);
+
+    //  A lock-free reader may still be looking at the version, so free it later.
+    epoch_retire(vp, versionFree);
+}
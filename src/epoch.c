@@ -0,0 +1,183 @@
+#include <stdatomic.h>
+#include <string.h>
+#include <pthread.h>
+#include "epoch.h"
+#include "debug.h"
+#include "csapp.h"
+
+//  Number of retired objects a thread collects before trying to reclaim.
+#define EPOCH_RETIRE_BATCH 64
+
+typedef struct retired {
+    void *ptr;
+    void (*free_fn)(void *);
+    unsigned long epoch;       // Global epoch at the time of retirement.
+} RETIRED;
+
+//  A list of retired objects, in order of retirement (and so of epoch).
+typedef struct limbo {
+    RETIRED *items;
+    int count;
+    int size;
+} LIMBO;
+
+/*
+ * Per-thread epoch record.  Records are never freed: when a thread exits its
+ * record is released and may be claimed by a later thread.
+ */
+typedef struct epoch_record {
+    atomic_ulong state;        // (Observed epoch << 1) | 1 while in a critical section, else 0.
+    atomic_int in_use;         // Nonzero while owned by a thread.
+    int depth;                 // Nesting depth of critical sections.
+    LIMBO limbo;               // Objects retired by the owning thread.
+    int reclaim_at;            // Limbo size at which to next try to reclaim.
+    struct epoch_record *next; // Next in list of all records.
+} EPOCH_RECORD;
+
+static atomic_ulong global_epoch = 1;
+static _Atomic(EPOCH_RECORD *) records = NULL;
+
+//  Objects left behind by threads that have exited.
+static LIMBO orphans;
+static pthread_mutex_t orphans_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread EPOCH_RECORD *my_record = NULL;
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+
+static void limboAppend(LIMBO *lp, RETIRED *items, int count) {
+    if(lp->count + count > lp->size) {
+        lp->size = (lp->count + count) * 2;
+        lp->items = Realloc(lp->items, lp->size * sizeof(RETIRED));
+    }
+    memcpy(lp->items + lp->count, items, count * sizeof(RETIRED));
+    lp->count += count;
+}
+
+//  Free the objects in the list retired at least two epochs ago (or all of them).
+static void limboReclaim(LIMBO *lp, unsigned long epoch, int all) {
+    int n = 0;
+    while(n < lp->count && (all || lp->items[n].epoch + 2 <= epoch)) n++;
+    if(n == 0) return;
+
+    /*  Take the objects off the list before freeing them, since freeing one
+     *  may retire another onto the same list.
+     */
+    RETIRED *items = Malloc(n * sizeof(RETIRED));
+    memcpy(items, lp->items, n * sizeof(RETIRED));
+    memmove(lp->items, lp->items + n, (lp->count - n) * sizeof(RETIRED));
+    lp->count -= n;
+
+    for(int i = 0; i < n; i++) items[i].free_fn(items[i].ptr);
+    Free(items);
+}
+
+static void releaseRecord(void *arg) {
+    EPOCH_RECORD *rec = arg;
+
+    //  Hand anything still waiting over to the shared list.
+    if(rec->limbo.count > 0) {
+        pthread_mutex_lock(&orphans_mutex);
+        limboAppend(&orphans, rec->limbo.items, rec->limbo.count);
+        pthread_mutex_unlock(&orphans_mutex);
+        rec->limbo.count = 0;
+    }
+    rec->reclaim_at = EPOCH_RETIRE_BATCH;
+    atomic_store(&rec->in_use, 0);
+}
+
+static void makeRecordKey() {
+    pthread_key_create(&record_key, releaseRecord);
+}
+
+static EPOCH_RECORD *getRecord() {
+    if(my_record != NULL) return my_record;
+
+    //  Reuse the record of a thread that has exited, if there is one.
+    EPOCH_RECORD *rec;
+    for(rec = atomic_load(&records); rec != NULL; rec = rec->next) {
+        int unused = 0;
+        if(atomic_compare_exchange_strong(&rec->in_use, &unused, 1)) break;
+    }
+
+    //  Otherwise push a new record onto the list.
+    if(rec == NULL) {
+        rec = Calloc(sizeof(EPOCH_RECORD), 1);
+        atomic_init(&rec->state, 0);
+        atomic_init(&rec->in_use, 1);
+        rec->reclaim_at = EPOCH_RETIRE_BATCH;
+        rec->next = atomic_load(&records);
+        while(!atomic_compare_exchange_weak(&records, &rec->next, rec));
+        debug("Create epoch record %p", rec);
+    }
+
+    pthread_once(&record_key_once, makeRecordKey);
+    pthread_setspecific(record_key, rec);
+    my_record = rec;
+    return rec;
+}
+
+//  Advance the global epoch if every thread in a critical section has observed it.
+static unsigned long tryAdvance() {
+    unsigned long epoch = atomic_load(&global_epoch);
+
+    for(EPOCH_RECORD *rec = atomic_load(&records); rec != NULL; rec = rec->next) {
+        unsigned long state = atomic_load(&rec->state);
+        if((state & 1) && (state >> 1) != epoch) return epoch;
+    }
+
+    if(atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1)) epoch++;
+    return epoch;
+}
+
+void epoch_enter() {
+    EPOCH_RECORD *rec = getRecord();
+    if(rec->depth++ > 0) return;
+
+    //  Publish the observed epoch before reading any shared pointer.
+    atomic_store(&rec->state, (atomic_load(&global_epoch) << 1) | 1);
+}
+
+void epoch_exit() {
+    EPOCH_RECORD *rec = my_record;
+    if(--rec->depth > 0) return;
+    atomic_store_explicit(&rec->state, 0, memory_order_release);
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    EPOCH_RECORD *rec = getRecord();
+    RETIRED item = { ptr, free_fn, atomic_load(&global_epoch) };
+    limboAppend(&rec->limbo, &item, 1);
+
+    if(rec->limbo.count < rec->reclaim_at) return;
+
+    //  Try to move the epoch along, then free whatever has become safe.
+    unsigned long epoch = tryAdvance();
+    limboReclaim(&rec->limbo, epoch, 0);
+    rec->reclaim_at = rec->limbo.count + EPOCH_RETIRE_BATCH;
+
+    if(!pthread_mutex_trylock(&orphans_mutex)) {
+        limboReclaim(&orphans, epoch, 0);
+        pthread_mutex_unlock(&orphans_mutex);
+    }
+}
+
+void epoch_fini() {
+    debug("Reclaim all retired objects");
+
+    /*  Freeing an object may retire others (a version releases its blob, a
+     *  transaction its dependencies), so repeat until nothing is left.
+     */
+    int left;
+    do {
+        left = 0;
+        for(EPOCH_RECORD *rec = atomic_load(&records); rec != NULL; rec = rec->next) {
+            limboReclaim(&rec->limbo, 0, 1);
+            left += rec->limbo.count;
+        }
+        pthread_mutex_lock(&orphans_mutex);
+        limboReclaim(&orphans, 0, 1);
+        left += orphans.count;
+        pthread_mutex_unlock(&orphans_mutex);
+    } while(left > 0);
+}
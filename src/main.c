@@ -5,33 +5,98 @@
 #include "server.h"
 #include "csapp.h"
 #include "helpers.h"
+#include "reaper.h"
 
 static void terminate(int status);
 
+//  Parse a size in bytes, with an optional K, M or G suffix.
+static long parseSize(char *str) {
+    char *end;
+    long size = strtol(str, &end, 10);
+    switch(*end) {
+    case 'G': case 'g':
+        size <<= 10;
+        //  Fall through.
+    case 'M': case 'm':
+        size <<= 10;
+        //  Fall through.
+    case 'K': case 'k':
+        size <<= 10;
+    }
+    return size;
+}
+
 CLIENT_REGISTRY *client_registry;
 
 int main(int argc, char* argv[]){
     /*  Option processing should be performed here.
      *  Option '-p <port>' is required in order to specify the port number
-     *  on which the server should listen.
+     *  on which the server should listen.  Option '-k <keys>' pre-sizes the
+     *  store for the expected number of keys.  Option '-i <index>' selects
+     *  how the store indexes its keys: "chained" (the default) or "swiss".
+     *  Option '-g <entries>' sets how many map entries the background garbage
+     *  collector processes before yielding.  Option '-m <bytes>' runs the
+     *  store as a cache that evicts cold keys to stay within the given memory
+     *  budget, which may carry a K, M or G suffix.  Option '-t <ms>' aborts
+     *  transactions in which no request has been made for that long, and option
+     *  '-w <ms>' gives up on commits that have waited that long for their
+     *  dependencies.  Option
+     *  '-e <engine>' selects the concurrency control: "ordered" (the default),
+     *  "mvcc" for snapshot isolation, "occ" for optimistic validation at commit,
+     *  or "2pl" for two-phase locking with wait-die.
      */
     char optval;
     int listenfd, *connfdp;
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
     pthread_t tid;
+    size_t num_keys = 0;
+    long idle_ms = 0, commit_ms = 0;
 
     Signal(SIGHUP, sighupHandler);
 
     while(optind < argc) {
-        if((optval = getopt(argc, argv, "p:h:q")) != -1) {
+        if((optval = getopt(argc, argv, "p:h:qk:i:g:m:t:w:e:")) != -1) {
             switch(optval) {
             case '?':
-                fprintf(stderr, "Usage: %s -p <port> [-h <hostname>] [-q]\n", argv[0]);
+                fprintf(stderr, "Usage: %s -p <port> [-h <hostname>] [-q] [-k <keys>] [-i chained|swiss] [-g <entries>] [-m <bytes>] [-t <ms>] [-w <ms>] [-e ordered|mvcc|occ|2pl]\n", argv[0]);
                 exit(EXIT_FAILURE);
             case 'p':
                 listenfd = Open_listenfd(optarg);
                 break;
+            case 'k':
+                num_keys = strtoul(optarg, NULL, 10);
+                break;
+            case 'g':
+                reaper_set_budget(atoi(optarg));
+                break;
+            case 'm':
+                store_set_budget(parseSize(optarg));
+                break;
+            case 't':
+                idle_ms = atol(optarg);
+                break;
+            case 'w':
+                commit_ms = atol(optarg);
+                break;
+            case 'i':
+                if(!strcmp(optarg, "swiss")) store_select_index(INDEX_SWISS);
+                else if(!strcmp(optarg, "chained")) store_select_index(INDEX_CHAINED);
+                else {
+                    fprintf(stderr, "Unknown index '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                if(!strcmp(optarg, "mvcc")) trans_select_engine(ENGINE_MVCC);
+                else if(!strcmp(optarg, "occ")) trans_select_engine(ENGINE_OCC);
+                else if(!strcmp(optarg, "2pl")) trans_select_engine(ENGINE_2PL);
+                else if(!strcmp(optarg, "ordered")) trans_select_engine(ENGINE_ORDERED);
+                else {
+                    fprintf(stderr, "Unknown engine '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             default:
                 break;
             }
@@ -43,7 +108,9 @@ int main(int argc, char* argv[]){
      */
     client_registry = creg_init();
     trans_init();
+    trans_set_default_timeouts(idle_ms, commit_ms);
     store_init();
+    if(num_keys > 0) store_reserve(num_keys);
 
     /*  Set up the server socket and enter a loop to accept connections
      *  on this socket.  For each connection, a thread should be started to
@@ -75,10 +142,14 @@ void terminate(int status) {
     creg_wait_for_empty(client_registry);
     debug("All service threads terminated.");
 
-    //  Finalize modules.
+    /*  Report what the store did, then finalize modules.  The store goes first, as
+     *  disposing of its versions lets go of the transactions that created them.
+     */
+    store_show_stats();
+    trans_show_stats();
     creg_fini(client_registry);
-    trans_fini();
     store_fini();
+    trans_fini();
 
     debug("Xacto server terminating");
     exit(status);
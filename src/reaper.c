@@ -0,0 +1,263 @@
+#include <sched.h>
+#include <time.h>
+#include "reaper.h"
+#include "helpers.h"
+#include "epoch.h"
+#include "debug.h"
+#include "csapp.h"
+
+/*
+ * The queue of dirty entries is an intrusive multi-producer, single-consumer
+ * queue linked through dirty_next: a producer swaps itself in as the head and
+ * then links the old head to itself, while only the reaper follows the links
+ * from the tail.  It starts out, and ends up whenever it is emptied, holding
+ * just the stub.
+ */
+static struct {
+    _Atomic(MAP_ENTRY *) head; // Most recently queued entry.
+    MAP_ENTRY *tail;           // Next entry to be taken off the queue.
+    MAP_ENTRY stub;            // Placeholder that keeps the queue from ever being empty.
+    MAP_ENTRY *deferred_head;  // Entries waiting for the watermark, linked through defer_next.
+    MAP_ENTRY *deferred_tail;  // (Only touched by the reaper thread.)
+    int budget;                // Entries collected per cycle.
+    int stop;                  // Set to make the thread exit.
+    atomic_int idle;           // Set while the thread may be about to wait.
+    long reaped;               // Total entries collected.
+    long evicted;              // Total entries evicted in cache mode.
+    pthread_t tid;
+    pthread_mutex_t mutex;     // Mutex to protect stop and the waits on cond.
+    pthread_cond_t cond;       // Signalled when the queue becomes nonempty.
+} reaper = { .budget = REAPER_BUDGET, .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static void enqueue(MAP_ENTRY *mapEntry) {
+    atomic_store_explicit(&mapEntry->dirty_next, NULL, memory_order_relaxed);
+    MAP_ENTRY *prev = atomic_exchange(&reaper.head, mapEntry);
+    atomic_store_explicit(&prev->dirty_next, mapEntry, memory_order_release);
+}
+
+/*
+ * Take the next entry off the queue.  Returns NULL if the queue is empty, or
+ * if a producer is still in the middle of linking an entry in.  Only called
+ * by the reaper thread, or once it has stopped.
+ */
+static MAP_ENTRY *dequeue() {
+    MAP_ENTRY *tail = reaper.tail;
+    MAP_ENTRY *next = atomic_load_explicit(&tail->dirty_next, memory_order_acquire);
+
+    //  Step over the stub.
+    if(tail == &reaper.stub) {
+        if(next == NULL) return NULL;
+        reaper.tail = tail = next;
+        next = atomic_load_explicit(&tail->dirty_next, memory_order_acquire);
+    }
+    if(next != NULL) {
+        reaper.tail = next;
+        return tail;
+    }
+
+    //  The tail is the last entry linked in, unless a producer has yet to link its own.
+    if(tail != atomic_load(&reaper.head)) return NULL;
+
+    //  Put the stub back behind the last entry, so that it can be taken.
+    enqueue(&reaper.stub);
+    next = atomic_load_explicit(&tail->dirty_next, memory_order_acquire);
+    if(next == NULL) return NULL;
+    reaper.tail = next;
+    return tail;
+}
+
+//  Check whether the queue holds nothing at all.  Only called by the reaper thread.
+static int queueEmpty() {
+    return reaper.tail == &reaper.stub && atomic_load(&reaper.head) == &reaper.stub;
+}
+
+static void markDirty(MAP_ENTRY *mapEntry) {
+    //  Only the thread that sets the flag puts the entry on the queue.
+    if(atomic_exchange(&mapEntry->dirty, 1)) return;
+
+    //  The queue holds a reference.
+    mapEntryRef(mapEntry);
+    enqueue(mapEntry);
+
+    //  Wake the reaper only if it may be waiting; it looks at the queue after setting idle.
+    if(atomic_exchange(&reaper.idle, 0)) {
+        pthread_mutex_lock(&reaper.mutex);
+        pthread_cond_signal(&reaper.cond);
+        pthread_mutex_unlock(&reaper.mutex);
+    }
+}
+
+//  Called when a transaction commits or aborts.
+static void transDone(TRANSACTION *tp) {
+    //  Take the list, so that entries touched from now on are marked right away.
+    pthread_mutex_lock(&tp->mutex);
+    MAP_ENTRY **touched = tp->touched;
+    int num_touched = tp->num_touched;
+    tp->touched = NULL;
+    tp->num_touched = tp->max_touched = 0;
+    pthread_mutex_unlock(&tp->mutex);
+
+    for(int i = 0; i < num_touched; i++) {
+        markDirty(touched[i]);
+        mapEntryUnref(touched[i]);
+    }
+    if(touched != NULL) Free(touched);
+}
+
+void reaper_touch(MAP_ENTRY *mapEntry, TRANSACTION *tp) {
+    pthread_mutex_lock(&tp->mutex);
+
+    //  The transaction may have been aborted by another thread already.
+    if(tp->status != TRANS_PENDING) {
+        pthread_mutex_unlock(&tp->mutex);
+        markDirty(mapEntry);
+        return;
+    }
+
+    //  The transaction's list holds a reference.
+    if(tp->num_touched == tp->max_touched) {
+        tp->max_touched = tp->max_touched ? tp->max_touched * 2 : 8;
+        tp->touched = Realloc(tp->touched, tp->max_touched * sizeof(MAP_ENTRY *));
+    }
+    tp->touched[tp->num_touched++] = mapEntry;
+    mapEntryRef(mapEntry);
+    pthread_mutex_unlock(&tp->mutex);
+}
+
+//  Garbage collect an entry, and remove it if nothing is left.  Returns -1 if removal must wait.
+static int reap(MAP_ENTRY *mapEntry, uint64_t watermark) {
+    pthread_mutex_lock(&mapEntry->mutex);
+    int result = 0;
+    if(!mapEntry->dead) {
+        garbageCollect(mapEntry);
+        result = reclaimMapEntry(mapEntry, watermark);
+    }
+    pthread_mutex_unlock(&mapEntry->mutex);
+    return result;
+}
+
+//  Keep an entry (and its reference) until the watermark has passed its last version.
+static void defer(MAP_ENTRY *mapEntry) {
+    if(mapEntry->deferred) {
+        mapEntryUnref(mapEntry);
+        return;
+    }
+    mapEntry->deferred = 1;
+    mapEntry->defer_next = NULL;
+    if(reaper.deferred_tail == NULL) reaper.deferred_head = mapEntry;
+    else reaper.deferred_tail->defer_next = mapEntry;
+    reaper.deferred_tail = mapEntry;
+}
+
+//  Retry deferred entries, in order, until one still has to wait.
+static void reapDeferred(uint64_t watermark) {
+    MAP_ENTRY *mapEntry;
+    while((mapEntry = reaper.deferred_head) != NULL) {
+        if(reap(mapEntry, watermark) < 0) return;
+        reaper.deferred_head = mapEntry->defer_next;
+        if(reaper.deferred_head == NULL) reaper.deferred_tail = NULL;
+        mapEntry->deferred = 0;
+        mapEntryUnref(mapEntry);
+    }
+}
+
+static void *reaperThread(void *arg) {
+    debug("Reaper thread starting");
+
+    int evicting = 0;
+    while(1) {
+        pthread_mutex_lock(&reaper.mutex);
+        while(!reaper.stop && !evicting) {
+            //  Announce that we may wait before the last look at the queue (see markDirty()).
+            atomic_store(&reaper.idle, 1);
+            if(!queueEmpty()) break;
+            if(reaper.deferred_head == NULL && !store_over_budget()) pthread_cond_wait(&reaper.cond, &reaper.mutex);
+            else {
+                //  Look at the deferred entries, or for entries to evict, again now and then.
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += REAPER_DEFER_MS * 1000000L;
+                if(ts.tv_nsec >= 1000000000L) {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                if(pthread_cond_timedwait(&reaper.cond, &reaper.mutex, &ts)) break;
+            }
+        }
+        atomic_store(&reaper.idle, 0);
+        int stop = reaper.stop;
+        int budget = reaper.budget;
+        pthread_mutex_unlock(&reaper.mutex);
+        if(stop) break;
+
+        /*  Collect up to budget entries, then give the request threads a turn.  Collection
+         *  aborts transactions with entries locked, so decisions are held back meanwhile.
+         */
+        epoch_enter();
+        trans_defer_decisions();
+        uint64_t watermark = trans_watermark();
+        reapDeferred(watermark);
+        int n;
+        for(n = 0; n < budget; n++) {
+            MAP_ENTRY *mapEntry = dequeue();
+            if(mapEntry == NULL) break;
+
+            //  Clear the flag first, so that a later completion queues the entry again.
+            atomic_store(&mapEntry->dirty, 0);
+            if(reap(mapEntry, watermark) < 0) defer(mapEntry);
+            else mapEntryUnref(mapEntry);
+        }
+
+        //  In cache mode, evict entries until back within budget, and keep at it while that works.
+        evicting = 0;
+        if(store_over_budget()) {
+            int evicted = evictMapEntries(watermark, budget);
+            reaper.evicted += evicted;
+            evicting = evicted > 0 && store_over_budget();
+        }
+        trans_decide_deferred();
+        epoch_exit();
+
+        reaper.reaped += n;
+        sched_yield();
+    }
+
+    debug("Reaper thread exiting after collecting %ld entries and evicting %ld", reaper.reaped, reaper.evicted);
+    return NULL;
+}
+
+void reaper_init() {
+    atomic_init(&reaper.stub.dirty_next, NULL);
+    atomic_init(&reaper.head, &reaper.stub);
+    reaper.tail = &reaper.stub;
+    reaper.deferred_head = reaper.deferred_tail = NULL;
+    reaper.stop = 0;
+    atomic_init(&reaper.idle, 0);
+    reaper.reaped = 0;
+    reaper.evicted = 0;
+    trans_set_completion_hook(transDone);
+    Pthread_create(&reaper.tid, NULL, reaperThread, NULL);
+}
+
+void reaper_fini() {
+    trans_set_completion_hook(NULL);
+
+    pthread_mutex_lock(&reaper.mutex);
+    reaper.stop = 1;
+    pthread_cond_signal(&reaper.cond);
+    pthread_mutex_unlock(&reaper.mutex);
+    Pthread_join(reaper.tid, NULL);
+
+    //  Drop the references held by the queues.
+    MAP_ENTRY *mapEntry;
+    while((mapEntry = dequeue()) != NULL) mapEntryUnref(mapEntry);
+    while((mapEntry = reaper.deferred_head) != NULL) {
+        reaper.deferred_head = mapEntry->defer_next;
+        mapEntryUnref(mapEntry);
+    }
+    reaper.deferred_tail = NULL;
+}
+
+void reaper_set_budget(int budget) {
+    reaper.budget = budget > 0 ? budget : 1;
+}
@@ -10,6 +10,28 @@
 
 CLIENT_REGISTRY *client_registry;
 
+/*
+ * A commit requested without waiting is decided on whatever thread resolves it,
+ * which must not wait on this client's socket.  The decision is therefore queued
+ * for a thread of its own, started with the first such commit, which sends the
+ * reply and ends the connection.
+ */
+typedef struct commit_reply {
+    int connfd;                    // The connection to reply on.
+    TRANSACTION *tp;               // The transaction, with a reference held.
+    TRANS_STATUS status;           // Its final status.
+    struct commit_reply *next;     // Next in the queue.
+} COMMIT_REPLY;
+
+static struct {
+    COMMIT_REPLY *head;            // Queue of replies to send.
+    COMMIT_REPLY *tail;
+    pthread_t tid;
+    pthread_once_t once;           // Starts the thread.
+    pthread_mutex_t mutex;         // Mutex to protect the queue.
+    pthread_cond_t cond;           // Signalled when the queue becomes nonempty.
+} replier = { .once = PTHREAD_ONCE_INIT, .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
 void *xacto_client_service(void *arg) {
     //  Retrieve file descriptor.
     int connfd = *((int *) arg);
@@ -29,6 +51,12 @@ void *xacto_client_service(void *arg) {
     TRANSACTION *tp = trans_create();
 
     TRANS_STATUS status = TRANS_PENDING;
+    int first = 1;
+
+    /*  Set once the client sends BEGIN: the connection then outlives each transaction,
+     *  which ends with tp set to NULL, and the next request starts another.
+     */
+    int session = 0;
 
     //  Enter service loop.
     while(1) {
@@ -36,8 +64,13 @@ void *xacto_client_service(void *arg) {
         XACTO_PACKET *pkt = Calloc(sizeof(XACTO_PACKET), 1);
         void **datap = Malloc(sizeof(void**));
 
-        //  Receive reply packet.
-        proto_recv_packet(connfd, pkt, datap);
+        //  Receive reply packet, starting a transaction if none is open.
+        if(proto_recv_packet(connfd, pkt, datap) == 0 && tp == NULL) {
+            tp = trans_create();
+            status = TRANS_PENDING;
+            first = 1;
+        }
+        if(tp != NULL) trans_keepalive(tp);
 
         //  PUT command received.
         if(pkt->type == XACTO_PUT_PKT) {
@@ -58,28 +91,14 @@ void *xacto_client_service(void *arg) {
             proto_recv_packet(connfd, data_pkt2, datap2);
             debug("[%d] Received value, size %" PRIu32, connfd, data_pkt2->size);
 
-            //  Create key and value from data packets.
-            BLOB *bp1 = blob_create(*datap1, data_pkt1->size);
-            KEY *kp = key_create(bp1);
+            //  Create the value; the key is looked up straight from the received data.
             BLOB *bp2 = blob_create(*datap2, data_pkt2->size);
 
             //  Put key and value in the store.
-            status = store_put(tp, kp, bp2);
-
-            //  Prepare to send the reply packet.
-            XACTO_PACKET *reply_pkt = Calloc(sizeof(XACTO_PACKET), 1);
-            reply_pkt->type = XACTO_REPLY_PKT;
-            if(trans_get_status(tp) == TRANS_ABORTED) reply_pkt->status = 2;
-            else reply_pkt->status = 0;
-            reply_pkt->null = 0;
-            reply_pkt->size = 0;
-            struct timespec t;
-            clock_gettime(CLOCK_MONOTONIC, &t);
-            reply_pkt->timestamp_sec = t.tv_sec;
-            reply_pkt->timestamp_nsec = t.tv_nsec;
+            status = store_put_raw(tp, *datap1, data_pkt1->size, bp2);
 
             //  Send the reply packet.
-            proto_send_packet(connfd, reply_pkt, NULL);
+            xacto_reply(connfd, tp, trans_get_status(tp) == TRANS_ABORTED ? 2 : 0);
 
             //  Free packet and data pointers.
             Free(data_pkt1);
@@ -88,11 +107,12 @@ void *xacto_client_service(void *arg) {
             Free(*datap2);
             Free(datap1);
             Free(datap2);
-            Free(reply_pkt);
 
-            //  Show store contents and transactions.
+            //  Show store contents and transactions (walks the whole store, so debug builds only).
+#ifdef DEBUG
             store_show();
             trans_show_all();
+#endif
 
             /*  If store put returned an aborted status,
              *  free the packet and data pointers,
@@ -103,6 +123,8 @@ void *xacto_client_service(void *arg) {
                 Free(pkt);
                 Free(datap);
                 trans_abort(tp);
+                tp = NULL;
+                if(session) continue;
                 break;
             }
         }
@@ -118,34 +140,18 @@ void *xacto_client_service(void *arg) {
             proto_recv_packet(connfd, data_pkt1, datap1);
             debug("[%d] Received key, size %" PRIu32, connfd, data_pkt1->size);
 
-            //  Create key and value from data packet.
-            BLOB *bp = blob_create(*datap1, data_pkt1->size);
-            KEY *kp = key_create(bp);
-
             BLOB **buf = Malloc(sizeof(BLOB**));
             BLOB *bp_reply = NULL;
 
             //  Get the value associated with the key from the store.
-            status = store_get(tp, kp, buf);
+            status = store_get_raw(tp, *datap1, data_pkt1->size, buf);
 
             //  If a value was found, send a reply and data packet with the found value.
             if(buf != NULL && *buf != NULL) {
                 bp_reply = *buf;
 
-                //  Prepare to send the reply packet.
-                XACTO_PACKET *reply_pkt = Calloc(sizeof(XACTO_PACKET), 1);
-                reply_pkt->type = XACTO_REPLY_PKT;
-                if(trans_get_status(tp) == TRANS_ABORTED) reply_pkt->status = 2;
-                else reply_pkt->status = 0;
-                reply_pkt->size = 0;
-                reply_pkt->null = 0;
-                struct timespec t1;
-                clock_gettime(CLOCK_MONOTONIC, &t1);
-                reply_pkt->timestamp_sec = t1.tv_sec;
-                reply_pkt->timestamp_nsec = t1.tv_nsec;
-
                 //  Send the reply packet.
-                proto_send_packet(connfd, reply_pkt, NULL);
+                xacto_reply(connfd, tp, trans_get_status(tp) == TRANS_ABORTED ? 2 : 0);
 
                 //  Unreference the blob obtained from store_get.
                 xacto_get(connfd, bp_reply);
@@ -156,7 +162,6 @@ void *xacto_client_service(void *arg) {
                  *  service loop.
                  */
                 if(status == TRANS_ABORTED) {
-                    Free(reply_pkt);
                     Free(buf);
                     Free(data_pkt1);
                     Free(*datap1);
@@ -164,6 +169,8 @@ void *xacto_client_service(void *arg) {
                     Free(pkt);
                     Free(datap);
                     trans_abort(tp);
+                    tp = NULL;
+                    if(session) continue;
                     break;
                 }
 
@@ -186,25 +193,12 @@ void *xacto_client_service(void *arg) {
                 Free(data_pkt2);
                 Free(*datap1);
                 Free(datap1);
-                Free(reply_pkt);
                 Free(buf);
             }
             // Else send a reply and data packet with a null value
             else {
-                //  Prepare to send the reply packet.
-                XACTO_PACKET *reply_pkt = Calloc(sizeof(XACTO_PACKET), 1);
-                reply_pkt->type = XACTO_REPLY_PKT;
-                if(trans_get_status(tp) == TRANS_ABORTED) reply_pkt->status = 2;
-                else reply_pkt->status = 0;
-                reply_pkt->size = 0;
-                reply_pkt->null = 0;
-                struct timespec t1;
-                clock_gettime(CLOCK_MONOTONIC, &t1);
-                reply_pkt->timestamp_sec = t1.tv_sec;
-                reply_pkt->timestamp_nsec = t1.tv_nsec;
-
                 //  Send the reply packet.
-                proto_send_packet(connfd, reply_pkt, NULL);
+                xacto_reply(connfd, tp, trans_get_status(tp) == TRANS_ABORTED ? 2 : 0);
 
                 //  Unreference the blob obtained from store_get.
                 xacto_get(connfd, bp_reply);
@@ -215,7 +209,6 @@ void *xacto_client_service(void *arg) {
                  *  service loop.
                  */
                 if(status == TRANS_ABORTED) {
-                    Free(reply_pkt);
                     Free(buf);
                     Free(data_pkt1);
                     Free(*datap1);
@@ -223,6 +216,8 @@ void *xacto_client_service(void *arg) {
                     Free(pkt);
                     Free(datap);
                     trans_abort(tp);
+                    tp = NULL;
+                    if(session) continue;
                     break;
                 }
 
@@ -245,52 +240,188 @@ void *xacto_client_service(void *arg) {
                 Free(data_pkt2);
                 Free(*datap1);
                 Free(datap1);
-                Free(reply_pkt);
                 Free(buf);
             }
 
             //  Show the contents of the store and the transactions.
+#ifdef DEBUG
             store_show();
             trans_show_all();
+#endif
         }
-        //  COMMIT command received.
-        else if(pkt->type == XACTO_COMMIT_PKT) {
-            debug("[%d] COMMIT packet received", connfd);
+        //  RANGE command received.
+        else if(pkt->type == XACTO_RANGE_PKT) {
+            debug("[%d] RANGE packet received", connfd);
+
+            //  Obtain the limit from the payload, if any.
+            int limit = 0;
+            if(pkt->size >= sizeof(uint32_t)) {
+                uint32_t nlimit;
+                memcpy(&nlimit, *datap, sizeof(uint32_t));
+                limit = ntohl(nlimit);
+            }
+            if(pkt->size != 0) Free(*datap);
+
+            //  Allocate space for data packets.
+            XACTO_PACKET *data_pkt1 = Calloc(sizeof(XACTO_PACKET), 1);
+            XACTO_PACKET *data_pkt2 = Calloc(sizeof(XACTO_PACKET), 1);
+            void **datap1 = Calloc(sizeof(void**), 1);
+            void **datap2 = Calloc(sizeof(void**), 1);
+
+            //  Receive the bounds of the range.
+            proto_recv_packet(connfd, data_pkt1, datap1);
+            proto_recv_packet(connfd, data_pkt2, datap2);
+            debug("[%d] Received bounds, sizes %" PRIu32 " and %" PRIu32 ", limit %d", connfd, data_pkt1->size, data_pkt2->size, limit);
+
+            //  Stream the keys and values in the range, then send the reply packet.
+            status = store_range(tp, data_pkt1->null ? NULL : *datap1, data_pkt1->size,
+                                 data_pkt2->null ? NULL : *datap2, data_pkt2->size, limit, xacto_range_emit, &connfd);
+
+            xacto_reply(connfd, tp, status == TRANS_ABORTED ? 2 : 0);
+
+            //  Free packet and data pointers.
+            Free(data_pkt1);
+            Free(data_pkt2);
+            Free(*datap1);
+            Free(*datap2);
+            Free(datap1);
+            Free(datap2);
 
-            //  Commit the transaction
-            status = trans_commit(tp);
+#ifdef DEBUG
+            store_show();
+            trans_show_all();
+#endif
 
-            int statusn;
+            //  If the range aborted the transaction, abort it and break out of the service loop.
             if(status == TRANS_ABORTED) {
-                statusn = 2;
+                Free(pkt);
+                Free(datap);
+                trans_abort(tp);
+                tp = NULL;
+                if(session) continue;
+                break;
+            }
+        }
+        //  READONLY command received.
+        else if(pkt->type == XACTO_READONLY_PKT) {
+            debug("[%d] READONLY packet received", connfd);
+
+            //  Only a transaction that has done nothing yet can be swapped for a read-only one.
+            if(first) {
+                trans_abort(tp);
+                tp = trans_create_read_only();
+                debug("[%d] Transaction %lu reads snapshot %lu", connfd, tp->id, tp->snapshot);
             }
-            else if(status == TRANS_COMMITTED) {
-                statusn = 1;
+            else status = TRANS_ABORTED;
+
+            xacto_reply(connfd, tp, status == TRANS_ABORTED ? 2 : 0);
+            if(pkt->size != 0) Free(*datap);
+
+            //  If the request came too late, abort the transaction and break out of the service loop.
+            if(status == TRANS_ABORTED) {
+                Free(pkt);
+                Free(datap);
+                trans_abort(tp);
+                tp = NULL;
+                if(session) continue;
+                break;
             }
+        }
+        //  RETRY command received.
+        else if(pkt->type == XACTO_RETRY_PKT) {
+            debug("[%d] RETRY packet received", connfd);
 
-            //  Prepare to send the reply packet.
-            XACTO_PACKET *reply_pkt = Calloc(sizeof(XACTO_PACKET), 1);
-            reply_pkt->type = XACTO_REPLY_PKT;
-            reply_pkt->status = statusn;
-            reply_pkt->size = 0;
-            reply_pkt->null = 0;
-            struct timespec t1;
-            clock_gettime(CLOCK_MONOTONIC, &t1);
-            reply_pkt->timestamp_sec = t1.tv_sec;
-            reply_pkt->timestamp_nsec = t1.tv_nsec;
+            //  Only a transaction that has done nothing yet can take over the priority of an earlier one.
+            if(!first || !trans_redeem_token(tp, pkt->size != 0 ? *datap : NULL, pkt->size)) status = TRANS_ABORTED;
 
-            //  Send the reply packet.
-            proto_send_packet(connfd, reply_pkt, NULL);
+            xacto_reply(connfd, tp, status == TRANS_ABORTED ? 2 : 0);
+            if(pkt->size != 0) Free(*datap);
+
+            //  If the request came too late or the token is not genuine, abort the transaction and break out of the service loop.
+            if(status == TRANS_ABORTED) {
+                Free(pkt);
+                Free(datap);
+                trans_abort(tp);
+                tp = NULL;
+                if(session) continue;
+                break;
+            }
+        }
+        //  BEGIN command received.
+        else if(pkt->type == XACTO_BEGIN_PKT) {
+            debug("[%d] BEGIN packet received", connfd);
+
+            /*  The session starts either way, but a transaction that has done something already
+             *  is aborted, and the abort reported, as READONLY or RETRY would.
+             */
+            session = 1;
+            xacto_reply(connfd, tp, first ? 0 : 2);
+
+            //  Free packet and data pointers; the next request is still the first of the transaction.
+            if(pkt->size != 0) Free(*datap);
+            Free(pkt);
+            Free(datap);
+            if(!first) {
+                status = TRANS_ABORTED;
+                trans_abort(tp);
+                tp = NULL;
+            }
+            first = 1;
+            continue;
+        }
+        //  ABORT command received.
+        else if(pkt->type == XACTO_ABORT_PKT) {
+            debug("[%d] ABORT packet received", connfd);
+
+            //  Reply first, while the transaction is still there to make the retry token from.
+            status = TRANS_ABORTED;
+            xacto_reply(connfd, tp, 2);
+            if(pkt->size != 0) Free(*datap);
+            Free(pkt);
+            Free(datap);
+            trans_abort(tp);
+            tp = NULL;
+            if(session) continue;
+            break;
+        }
+        //  COMMIT command received.
+        else if(pkt->type == XACTO_COMMIT_PKT) {
+            debug("[%d] COMMIT packet received", connfd);
 
             //  Free packet and data pointers.
-            Free(reply_pkt);
             Free(pkt);
             Free(datap);
 
-            //  Show the contents of the store and the transactions, then break out of the service loop.
+            //  Show the contents of the store and the transactions.
+#ifdef DEBUG
             store_show();
             trans_show_all();
-            break;
+#endif
+
+            /*  In a session the connection has more to do, and the next request must not
+             *  start before this transaction is decided, so this thread waits for the commit,
+             *  blocking as trans_commit() does, and replies here.  The extra reference keeps
+             *  the transaction for the retry token.
+             */
+            if(session) {
+                trans_ref(tp, "for replying to commit");
+                status = trans_commit(tp);
+                xacto_reply(connfd, tp, status == TRANS_COMMITTED ? 1 : 2);
+                trans_unref(tp, "for replying to commit");
+                tp = NULL;
+                continue;
+            }
+
+            /*  Request the commit, and leave the reply and the end of the connection to
+             *  the replier (see xacto_commit_done()), so that this thread does not wait
+             *  for the dependencies.
+             *  The connection may be gone as soon as the commit is requested.
+             */
+            int *connfdp = Malloc(sizeof(int));
+            *connfdp = connfd;
+            debug("[%d] Ending client service, commit requested", connfd);
+            trans_commit_async(tp, xacto_commit_done, connfdp);
+            return NULL;
         }
         else {
             //  Free packet and data pointers and break out of the service loop if an unknown command was receieved.
@@ -301,12 +432,13 @@ void *xacto_client_service(void *arg) {
         //  Free packet and data pointers and continue the service loop.
         Free(pkt);
         Free(datap);
+        first = 0;
     }
 
     debug("[%d] Ending client service", connfd);
 
-    //  If the transaction is still pending, abort it.
-    if(status == TRANS_PENDING) trans_abort(tp);
+    //  If a transaction is still open, abort it.
+    if(tp != NULL) trans_abort(tp);
 
     //  Unregister the client file descriptor.
     creg_unregister(client_registry, connfd);
@@ -316,6 +448,104 @@ void *xacto_client_service(void *arg) {
     return NULL;
 }
 
+/*  Send a reply packet with a status (0 pending, 1 committed, 2 aborted).  The reply
+ *  to a request that aborted the transaction carries the retry token as its payload.
+ */
+void xacto_reply(int connfd, TRANSACTION *tp, int status) {
+    unsigned char token[TRANS_TOKEN_SIZE];
+    XACTO_PACKET *reply_pkt = Calloc(sizeof(XACTO_PACKET), 1);
+    reply_pkt->type = XACTO_REPLY_PKT;
+    reply_pkt->status = status;
+    reply_pkt->null = 0;
+    if(status == 2) {
+        trans_retry_token(tp, token);
+        reply_pkt->size = TRANS_TOKEN_SIZE;
+    }
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    reply_pkt->timestamp_sec = t.tv_sec;
+    reply_pkt->timestamp_nsec = t.tv_nsec;
+    proto_send_packet(connfd, reply_pkt, status == 2 ? token : NULL);
+    Free(reply_pkt);
+}
+
+//  Send the replies to commits as they are decided, and end the connections.
+static void *replierThread(void *arg) {
+    Pthread_detach(pthread_self());
+    while(1) {
+        pthread_mutex_lock(&replier.mutex);
+        while(replier.head == NULL) pthread_cond_wait(&replier.cond, &replier.mutex);
+        COMMIT_REPLY *rp = replier.head;
+        replier.head = rp->next;
+        if(replier.head == NULL) replier.tail = NULL;
+        pthread_mutex_unlock(&replier.mutex);
+
+        //  Send the reply packet.
+        xacto_reply(rp->connfd, rp->tp, rp->status == TRANS_COMMITTED ? 1 : 2);
+
+        debug("[%d] Transaction %lu decided, ending connection", rp->connfd, rp->tp->id);
+
+        //  Unregister the client file descriptor, and close the client connection.
+        creg_unregister(client_registry, rp->connfd);
+        Close(rp->connfd);
+        trans_unref(rp->tp, "for replying to commit");
+        Free(rp);
+    }
+    return NULL;
+}
+
+static void startReplier() {
+    Pthread_create(&replier.tid, NULL, replierThread, NULL);
+}
+
+//  Queue the reply to a COMMIT once the commit is decided (see replierThread()).
+void xacto_commit_done(TRANSACTION *tp, TRANS_STATUS status, void *arg) {
+    COMMIT_REPLY *rp = Malloc(sizeof(COMMIT_REPLY));
+    rp->connfd = *((int *) arg);
+    Free(arg);
+
+    //  Keep the transaction for the retry token.
+    trans_ref(tp, "for replying to commit");
+    rp->tp = tp;
+    rp->status = status;
+    rp->next = NULL;
+
+    pthread_once(&replier.once, startReplier);
+    pthread_mutex_lock(&replier.mutex);
+    if(replier.tail == NULL) {
+        replier.head = rp;
+        pthread_cond_signal(&replier.cond);
+    }
+    else replier.tail->next = rp;
+    replier.tail = rp;
+    pthread_mutex_unlock(&replier.mutex);
+}
+
+//  Send one key found by a range, and its value, as a pair of data packets.
+void xacto_range_emit(KEY *key, BLOB *value, void *arg) {
+    int connfd = *((int *) arg);
+    struct timespec t;
+
+    XACTO_PACKET *data_pkt = Calloc(sizeof(XACTO_PACKET), 1);
+    data_pkt->type = XACTO_DATA_PKT;
+    data_pkt->size = key->blob->size;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    data_pkt->timestamp_sec = t.tv_sec;
+    data_pkt->timestamp_nsec = t.tv_nsec;
+    proto_send_packet(connfd, data_pkt, key->blob->content);
+
+    memset(data_pkt, 0, sizeof(XACTO_PACKET));
+    data_pkt->type = XACTO_DATA_PKT;
+    data_pkt->null = value == NULL;
+    data_pkt->size = value != NULL ? value->size : 0;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    data_pkt->timestamp_sec = t.tv_sec;
+    data_pkt->timestamp_nsec = t.tv_nsec;
+    proto_send_packet(connfd, data_pkt, value != NULL ? value->content : NULL);
+
+    Free(data_pkt);
+}
+
 void xacto_get(int connfd, BLOB *bp) {
     if(bp == NULL) debug("[%d] Value is NULL", connfd);
     else debug("[%d] Value is %s", connfd, bp->prefix);
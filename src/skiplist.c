@@ -0,0 +1,248 @@
+#include <string.h>
+#include <sched.h>
+#include "skiplist.h"
+#include "helpers.h"
+#include "epoch.h"
+#include "debug.h"
+#include "csapp.h"
+
+typedef struct skipnode {
+    MAP_ENTRY *entry;                // The entry, or NULL in the head.
+    _Atomic uint64_t gap_rts;        // Read timestamp of the gap up to the next node.
+    pthread_mutex_t mutex;           // Held to change the links out of the node, or to cover its gap.
+    int removed;                     // Set, under the mutex, once the node is unlinked.
+    int height;                      // Number of levels the node is linked into.
+    _Atomic(struct skipnode *) next[];  // Next node at each level.
+} SKIPNODE;
+
+struct skiplist {
+    SKIPNODE *head;                  // Head, linked into every level.
+    atomic_int level;                // Number of levels that may be in use.
+};
+
+static SKIPNODE *newNode(MAP_ENTRY *mapEntry, int height) {
+    SKIPNODE *node = Calloc(sizeof(SKIPNODE) + height * sizeof(SKIPNODE *), 1);
+    node->entry = mapEntry;
+    atomic_init(&node->gap_rts, 0);
+    pthread_mutex_init(&node->mutex, 0);
+    node->removed = 0;
+    node->height = height;
+    for(int i = 0; i < height; i++) atomic_init(&node->next[i], NULL);
+    return node;
+}
+
+static void freeNode(void *arg) {
+    SKIPNODE *node = arg;
+    pthread_mutex_destroy(&node->mutex);
+    Free(node);
+}
+
+//  Order keys as byte strings.
+static int keyOrder(BLOB *bp1, BLOB *bp2) {
+    size_t size = bp1->size < bp2->size ? bp1->size : bp2->size;
+    int cmp = memcmp(bp1->content, bp2->content, size);
+    if(cmp != 0) return cmp;
+    return bp1->size < bp2->size ? -1 : bp1->size > bp2->size;
+}
+
+//  Raise a read timestamp to an ID, unless it is already at least as great.
+static void raiseRts(_Atomic uint64_t *rts, uint64_t id) {
+    uint64_t cur = atomic_load(rts);
+    while(cur < id && !atomic_compare_exchange_weak(rts, &cur, id));
+}
+
+//  Pick the height of a new node: each level above the first with probability 1/4.
+static int randomHeight() {
+    static __thread unsigned int seed;
+    if(seed == 0) seed = (unsigned int) (uintptr_t) &seed | 1;
+    int height = 1;
+    while(height < SKIPLIST_MAX_LEVEL && (rand_r(&seed) & 3) == 0) height++;
+    return height;
+}
+
+/*
+ * Find, at each level below height, the last node whose key is less than the given
+ * one, and the node after it, without locking.  Levels not in use yet have the head
+ * and NULL.
+ */
+static void findPreds(SKIPLIST *slp, BLOB *key, int height, SKIPNODE **preds, SKIPNODE **succs) {
+    int level = atomic_load(&slp->level);
+    for(int i = level; i < height; i++) {
+        preds[i] = slp->head;
+        succs[i] = atomic_load(&slp->head->next[i]);
+    }
+
+    SKIPNODE *cur = slp->head;
+    for(int i = level - 1; i >= 0; i--) {
+        SKIPNODE *next = atomic_load(&cur->next[i]);
+        while(next != NULL && keyOrder(next->entry->key->blob, key) < 0) {
+            cur = next;
+            next = atomic_load(&cur->next[i]);
+        }
+        if(i < height) {
+            preds[i] = cur;
+            succs[i] = next;
+        }
+    }
+}
+
+//  Unlock the predecessors locked by lockPreds(), from level height - 1 down.
+static void unlockPreds(SKIPNODE **preds, int height) {
+    for(int i = height - 1; i >= 0; i--)
+        if(i == height - 1 || preds[i] != preds[i + 1]) pthread_mutex_unlock(&preds[i]->mutex);
+}
+
+/*
+ * Lock the predecessors found by findPreds(), each once, in order of key (which is
+ * from the top level down), and check that each is still in the index and still
+ * links to the node found after it.  Returns zero, with nothing locked, if not.
+ */
+static int lockPreds(SKIPNODE **preds, SKIPNODE **succs, int height) {
+    for(int i = height - 1; i >= 0; i--) {
+        if(i == height - 1 || preds[i] != preds[i + 1]) pthread_mutex_lock(&preds[i]->mutex);
+        if(preds[i]->removed || atomic_load(&preds[i]->next[i]) != succs[i]) {
+            unlockPreds(preds + i, height - i);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+SKIPLIST *skiplist_init() {
+    SKIPLIST *slp = Malloc(sizeof(SKIPLIST));
+    slp->head = newNode(NULL, SKIPLIST_MAX_LEVEL);
+    atomic_init(&slp->level, 1);
+    debug("Initialize ordered index");
+    return slp;
+}
+
+void skiplist_fini(SKIPLIST *slp) {
+    SKIPNODE *cur = slp->head;
+    while(cur != NULL) {
+        SKIPNODE *next = atomic_load(&cur->next[0]);
+        if(cur->entry != NULL) cur->entry->node = NULL;
+        freeNode(cur);
+        cur = next;
+    }
+    Free(slp);
+}
+
+void skiplist_insert(SKIPLIST *slp, MAP_ENTRY *mapEntry) {
+    SKIPNODE *preds[SKIPLIST_MAX_LEVEL], *succs[SKIPLIST_MAX_LEVEL];
+    BLOB *key = mapEntry->key->blob;
+    int height = randomHeight();
+
+    /*  Search until the predecessors can be locked unchanged.  A node for the same key
+     *  belongs to a removed entry, whose remover is about to unlink it.
+     */
+    while(1) {
+        findPreds(slp, key, height, preds, succs);
+        if(succs[0] != NULL && keyOrder(succs[0]->entry->key->blob, key) == 0) {
+            sched_yield();
+            continue;
+        }
+        if(lockPreds(preds, succs, height)) break;
+    }
+
+    //  The new node splits a gap, so both halves, and the entry itself, keep its timestamp.
+    SKIPNODE *node = newNode(mapEntry, height);
+    uint64_t rts = atomic_load(&preds[0]->gap_rts);
+    atomic_init(&node->gap_rts, rts);
+    raiseRts(&mapEntry->rts, rts);
+
+    //  Link from the bottom up, so the node is in the index once it is at level 0.
+    for(int i = 0; i < height; i++) atomic_init(&node->next[i], succs[i]);
+    for(int i = 0; i < height; i++) atomic_store(&preds[i]->next[i], node);
+    mapEntry->node = node;
+    unlockPreds(preds, height);
+
+    int level = atomic_load(&slp->level);
+    while(level < height && !atomic_compare_exchange_weak(&slp->level, &level, height));
+}
+
+void skiplist_remove(SKIPLIST *slp, MAP_ENTRY *mapEntry) {
+    SKIPNODE *node = mapEntry->node;
+    if(node == NULL) return;
+
+    //  Only we remove the node, so once the predecessors are locked unchanged it cannot go anywhere.
+    SKIPNODE *preds[SKIPLIST_MAX_LEVEL], *succs[SKIPLIST_MAX_LEVEL];
+    while(1) {
+        findPreds(slp, mapEntry->key->blob, node->height, preds, succs);
+        int found = 1;
+        for(int i = 0; i < node->height; i++) if(succs[i] != node) found = 0;
+        if(found && lockPreds(preds, succs, node->height)) break;
+        sched_yield();
+    }
+    pthread_mutex_lock(&node->mutex);
+
+    //  Unlink from the top down, so the node stays in the index until it is out of level 0.
+    for(int i = node->height - 1; i >= 0; i--) atomic_store(&preds[i]->next[i], atomic_load(&node->next[i]));
+    node->removed = 1;
+
+    //  The gap now runs past the removed key, which nobody older may write either.
+    raiseRts(&preds[0]->gap_rts, atomic_load(&node->gap_rts));
+    raiseRts(&preds[0]->gap_rts, atomic_load(&mapEntry->rts));
+
+    pthread_mutex_unlock(&node->mutex);
+    unlockPreds(preds, node->height);
+
+    //  Searches may still be passing through the node.
+    mapEntry->node = NULL;
+    epoch_retire(node, freeNode);
+}
+
+MAP_ENTRY **skiplist_scan(SKIPLIST *slp, BLOB *lo, BLOB *hi, int limit, uint64_t id, int *countp) {
+    int count = 0, size = limit > 0 && limit < 64 ? limit : 64;
+    MAP_ENTRY **entries = Malloc(size * sizeof(MAP_ENTRY *));
+
+    /*  Find and lock the node before the range, whose gap covers the start of it.  It may
+     *  have been removed before we had it locked, or a node inserted after it.
+     */
+    SKIPNODE *cur;
+    while(1) {
+        cur = slp->head;
+        if(lo != NULL) {
+            for(int i = atomic_load(&slp->level) - 1; i >= 0; i--) {
+                SKIPNODE *next;
+                while((next = atomic_load(&cur->next[i])) != NULL && keyOrder(next->entry->key->blob, lo) < 0) cur = next;
+            }
+        }
+        pthread_mutex_lock(&cur->mutex);
+        if(!cur->removed) break;
+        pthread_mutex_unlock(&cur->mutex);
+    }
+
+    /*  Move on node by node, taking the next node's mutex before letting go of the last one,
+     *  so that nothing can be inserted into or removed from a gap while it is covered.
+     */
+    SKIPNODE *next;
+    while((next = atomic_load(&cur->next[0])) != NULL && lo != NULL && keyOrder(next->entry->key->blob, lo) < 0) {
+        pthread_mutex_lock(&next->mutex);
+        pthread_mutex_unlock(&cur->mutex);
+        cur = next;
+    }
+    raiseRts(&cur->gap_rts, id);
+
+    //  Collect entries, covering each gap passed over.
+    while((next = atomic_load(&cur->next[0])) != NULL) {
+        if(hi != NULL && keyOrder(next->entry->key->blob, hi) >= 0) break;
+        pthread_mutex_lock(&next->mutex);
+        pthread_mutex_unlock(&cur->mutex);
+        cur = next;
+
+        if(count == size) {
+            size *= 2;
+            entries = Realloc(entries, size * sizeof(MAP_ENTRY *));
+        }
+        raiseRts(&cur->entry->rts, id);
+        mapEntryRef(cur->entry);
+        entries[count++] = cur->entry;
+        if(count == limit) break;
+        raiseRts(&cur->gap_rts, id);
+    }
+    pthread_mutex_unlock(&cur->mutex);
+
+    debug("Scan of ordered index for transaction %lu collected %d entries", id, count);
+    *countp = count;
+    return entries;
+}
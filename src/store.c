@@ -1,86 +1,445 @@
+#include <assert.h>
+#include <time.h>
+#include <sys/random.h>
 #include "store.h"
 #include "helpers.h"
+#include "swiss.h"
+#include "skiplist.h"
+#include "reaper.h"
+#include "epoch.h"
 #include "debug.h"
 #include "csapp.h"
 
 struct map store;
 
+//  Stripe mutex protecting the bucket(s) a hash maps to.
+#define STRIPE(hash) (&store.stripes[(hash) & (NUM_STRIPES - 1)])
+
+//  Head of the bucket a hash maps to in a table.
+#define BUCKET(tbl, hash) (&(tbl)->bucket[(hash) & ((tbl)->num_buckets - 1)])
+
+static void startResize(int num_buckets);
+static void rehashStep(int steps);
+static void checkLoad(void);
+static MAP_ENTRY *findInBucket(_Atomic(MAP_ENTRY *) *bucket, KEY *key);
+static MAP_ENTRY *lockMapEntry(KEY *key, int *owned);
+static MAP_ENTRY *lookupMapEntry(KEY *key);
+static TRANS_STATUS prepareWrites(TRANSACTION *tp);
+static TRANS_STATUS prepareOptimistic(TRANSACTION *tp);
+static TRANS_STATUS prepareLocked(TRANSACTION *tp);
+static void releaseLocks(TRANSACTION *tp);
+static int wound(MAP_ENTRY *mapEntry, TRANSACTION *tp);
+
+static BUCKETS *newBuckets(int num_buckets) {
+    BUCKETS *tbl = Calloc(sizeof(BUCKETS) + sizeof(MAP_ENTRY *) * num_buckets, 1);
+    tbl->num_buckets = num_buckets;
+    return tbl;
+}
+
+void store_select_index(int index) {
+    store.index = index;
+}
+
+void store_set_budget(long bytes) {
+    store.budget = bytes > 0 ? bytes : 0;
+}
+
+//  Approximate memory used by an entry and its key.
+static long entryBytes(MAP_ENTRY *mapEntry) {
+    return sizeof(MAP_ENTRY) + sizeof(KEY) + sizeof(BLOB) + 2 * mapEntry->key->blob->size + 1;
+}
+
+//  Approximate memory used by a version and its blob, which may be shared with other versions.
+static long versionBytes(VERSION *vp) {
+    return sizeof(VERSION) + (vp->blob != NULL ? sizeof(BLOB) + 2 * vp->blob->size + 1 : 0);
+}
+
+//  Count memory coming into or going out of use, in cache mode.
+static void account(long bytes) {
+    if(store.budget) atomic_fetch_add_explicit(&store.bytes, bytes, memory_order_relaxed);
+}
+
+int store_over_budget() {
+    return store.budget && atomic_load_explicit(&store.bytes, memory_order_relaxed) > store.budget;
+}
+
+//  Put a new entry on the CLOCK ring, just behind the hand.  Caller holds mapEntry->mutex.
+static void clockInsert(MAP_ENTRY *mapEntry) {
+    pthread_mutex_lock(&store.clock_mutex);
+    MAP_ENTRY *hand = store.clock_hand;
+    if(hand == NULL) {
+        mapEntry->clock_next = mapEntry->clock_prev = mapEntry;
+        store.clock_hand = mapEntry;
+    }
+    else {
+        mapEntry->clock_next = hand;
+        mapEntry->clock_prev = hand->clock_prev;
+        hand->clock_prev->clock_next = mapEntry;
+        hand->clock_prev = mapEntry;
+    }
+    pthread_mutex_unlock(&store.clock_mutex);
+}
+
+//  Caller holds mapEntry->mutex and store.clock_mutex.
+static void clockRemove(MAP_ENTRY *mapEntry) {
+    if(mapEntry->clock_next == mapEntry) store.clock_hand = NULL;
+    else {
+        mapEntry->clock_prev->clock_next = mapEntry->clock_next;
+        mapEntry->clock_next->clock_prev = mapEntry->clock_prev;
+        if(store.clock_hand == mapEntry) store.clock_hand = mapEntry->clock_next;
+    }
+    mapEntry->clock_next = mapEntry->clock_prev = NULL;
+}
+
 void store_init() {
+    //  Pick a random hash seed, so that clients cannot predict which keys collide.
+    uint64_t seed;
+    if(getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) seed = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+    blob_hash_seed(seed);
+
     //  Initialize the store.
-    store.table = Calloc(sizeof(MAP_ENTRY*) * NUM_BUCKETS, 1);
-    store.num_buckets = NUM_BUCKETS;
+    if(store.index == INDEX_SWISS) store.swiss = swiss_init(0);
+    store.ordered = skiplist_init();
+    atomic_init(&store.table, newBuckets(NUM_BUCKETS));
+    atomic_init(&store.old_table, NULL);
+    store.rehash_idx = 0;
+    atomic_init(&store.num_entries, 0);
+    atomic_init(&store.removed, 0);
+    atomic_init(&store.removed_bytes, 0);
+    atomic_init(&store.bytes, 0);
+    atomic_init(&store.evicted, 0);
+    atomic_init(&store.evicted_bytes, 0);
+    store.clock_hand = NULL;
+    pthread_mutex_init(&store.clock_mutex, 0);
+    store.min_buckets = NUM_BUCKETS;
 
-    //  Initialize store mutex.
+    //  Initialize store mutex and bucket stripes.
     pthread_mutex_init(&store.mutex, 0);
+    for(int i = 0; i < NUM_STRIPES; i++) pthread_mutex_init(&store.stripes[i], 0);
+
+    store.engine = trans_engine();
+    if(store.engine == ENGINE_MVCC) trans_set_prepare_hook(prepareWrites);
+    else if(store.engine == ENGINE_OCC) trans_set_prepare_hook(prepareOptimistic);
+    else if(store.engine == ENGINE_2PL) {
+        trans_set_prepare_hook(prepareLocked);
+        trans_set_release_hook(releaseLocks);
+    }
+
+    //  Start collecting garbage in the background.
+    reaper_init();
 
     debug("Initialize object store");
 }
 
+void store_reserve(size_t num_keys) {
+    //  Round the bucket count needed for num_keys up to a power of two.
+    size_t size = NUM_BUCKETS;
+    while(size * MAX_LOAD_FACTOR < num_keys) size <<= 1;
+
+    debug("Reserve %lu buckets for %lu keys", size, num_keys);
+
+    if(store.index == INDEX_SWISS) {
+        swiss_reserve(store.swiss, num_keys);
+        return;
+    }
+
+    //  Never shrink below the reserved size, and grow right away if needed.
+    pthread_mutex_lock(&store.mutex);
+    store.min_buckets = size;
+    if(size > (size_t) atomic_load(&store.table)->num_buckets && atomic_load(&store.old_table) == NULL) startResize(size);
+    pthread_mutex_unlock(&store.mutex);
+
+    //  Migrate everything now rather than during the first requests.
+    while(atomic_load(&store.old_table) != NULL) rehashStep(size);
+}
+
+static void disposeMapEntry(MAP_ENTRY *mapEntry) {
+    key_dispose(mapEntry->key);
+    VERSION *curVersion = mapEntry->versions;
+
+    while(curVersion != NULL) {
+        VERSION *nextVersion = curVersion->next;
+        version_dispose(curVersion);
+        curVersion = nextVersion;
+    }
+
+    if(mapEntry->lock != NULL) {
+        pthread_cond_destroy(&mapEntry->lock->cond);
+        if(mapEntry->lock->holders != NULL) Free(mapEntry->lock->holders);
+        Free(mapEntry->lock);
+    }
+    pthread_mutex_destroy(&mapEntry->mutex);
+    Free(mapEntry);
+}
+
+static void freeMapEntry(void *arg) {
+    disposeMapEntry(arg);
+}
+
+void mapEntryRef(MAP_ENTRY *mapEntry) {
+    atomic_fetch_add(&mapEntry->refcnt, 1);
+}
+
+void mapEntryUnref(MAP_ENTRY *mapEntry) {
+    //  The last reference is dropped after removal; lookups may still be holding the entry.
+    if(atomic_fetch_sub(&mapEntry->refcnt, 1) == 1) epoch_retire(mapEntry, freeMapEntry);
+}
+
+static void disposeChain(MAP_ENTRY *curMapEntry) {
+    while(curMapEntry != NULL) {
+        MAP_ENTRY *nextMapEntry = curMapEntry->next;
+        disposeMapEntry(curMapEntry);
+        curMapEntry = nextMapEntry;
+    }
+}
+
 void store_fini() {
     debug("Finalize object store");
 
     int i;
 
-    /*  Traverse the store and dispose of the keys, versions,
-     *  and map entries. Finally, free the store itself.
+    //  Stop the reaper before the entries it may be working on go away.
+    reaper_fini();
+
+    skiplist_fini(store.ordered);
+    store.ordered = NULL;
+
+    if(store.index == INDEX_SWISS) {
+        swiss_fini(store.swiss, disposeMapEntry);
+        store.swiss = NULL;
+    }
+
+    /*  Traverse both tables and dispose of the keys, versions,
+     *  and map entries. Finally, free the tables themselves.
      */
-    for(i = 0; i < NUM_BUCKETS; i++) {
-        if(store.table[i] != NULL) {
-            MAP_ENTRY *curMapEntry = store.table[i];
-
-            while(curMapEntry != NULL) {
-                MAP_ENTRY *nextMapEntry = curMapEntry->next;
-                key_dispose(curMapEntry->key);
-                VERSION *curVersion = curMapEntry->versions;
-
-                while(curVersion != NULL) {
-                    VERSION *nextVersion = curVersion->next;
-                    version_dispose(curVersion);
-                    curVersion = nextVersion;
-                }
+    BUCKETS *tbl = atomic_load(&store.table);
+    for(i = 0; i < tbl->num_buckets; i++) disposeChain(tbl->bucket[i]);
+    Free(tbl);
 
-                Free(curMapEntry);
-                curMapEntry = nextMapEntry;
-            }
-        }
+    BUCKETS *old = atomic_load(&store.old_table);
+    if(old != NULL) {
+        for(i = store.rehash_idx; i < old->num_buckets; i++) disposeChain(old->bucket[i]);
+        Free(old);
     }
-    Free(store.table);
+
+    //  Nobody is left to be reading, so free everything that was retired.
+    epoch_fini();
 }
 
-TRANS_STATUS store_put(TRANSACTION *tp, KEY *key, BLOB *value) {
-    debug("Put mapping (key=%p [%s] -> value=%p [%s]) in store for transaction %d", key, key->blob->prefix, value, value->prefix, tp->id);
+/*
+ * Make a key over the caller's buffer, in a blob supplied by the caller, for looking up.
+ * Only the content and size of the blob are ever used, so nothing needs to be allocated
+ * unless a new map entry has to be created, which copies the key (see entryKey()).
+ */
+static void makeLookupKey(KEY *key, BLOB *blob, char *content, size_t size) {
+    *blob = (BLOB){ .size = size, .content = content };
+    *key = (KEY){ .hash = content_hash(content, size), .blob = blob };
+}
+
+//  A read-only transaction that tries to write is aborted, and the value dropped.
+static TRANS_STATUS putReadOnly(TRANSACTION *tp, BLOB *value) {
+    debug("Transaction %lu is read-only -- aborting", tp->id);
+    trans_ref(tp, "for aborting read-only transaction that writes");
+    trans_abort(tp);
+    blob_unref(value, "for aborting read-only transaction that writes");
+    return TRANS_ABORTED;
+}
 
-    //  Find or create the map entry.
-    MAP_ENTRY *mapEntry = findMapEntry(key);
+//  Caller is in an epoch critical section, and holds mapEntry->mutex.
+static void putVersion(MAP_ENTRY *mapEntry, TRANSACTION *tp, BLOB *value) {
+    //  Garbage collect the version list, unless there is nothing to collect.
+    if(atomic_load(&mapEntry->dirty)) garbageCollect(mapEntry);
 
-    //  Garbage collect the version list.
-    garbageCollect(mapEntry);
+    //  Wound any younger transactions that have gone ahead, before the version is added after theirs.
+    if(mapEntry->tail != NULL && mapEntry->tail->creator->id > tp->id) wound(mapEntry, tp);
 
     //  Attempt to add a new version.
     addVersion(mapEntry, tp, value, mapEntry->key);
 
+    //  Unlock.
+    pthread_mutex_unlock(&mapEntry->mutex);
+}
+
+/*
+ * Buffer a write until commit, under ENGINE_MVCC or ENGINE_OCC.  Writes are only ever appended,
+ * the last of several to the same entry being the one that counts, so that no
+ * search is needed however many there are.  Caller is in an epoch critical section,
+ * and holds mapEntry->mutex, which is released.
+ */
+static void bufferWrite(MAP_ENTRY *mapEntry, TRANSACTION *tp, BLOB *value) {
+    mapEntryRef(mapEntry);
+    pthread_mutex_unlock(&mapEntry->mutex);
+
+    if(tp->num_writes == tp->max_writes) {
+        tp->max_writes = tp->max_writes ? tp->max_writes * 2 : 8;
+        tp->writes = Realloc(tp->writes, tp->max_writes * sizeof(WRITE));
+    }
+    tp->writes[tp->num_writes] = (WRITE){ .entry = mapEntry, .value = value, .seq = tp->num_writes };
+    tp->num_writes++;
+}
+
+/*
+ * Note a lock taken by a transaction under ENGINE_2PL, unless it has been aborted,
+ * in which case its locks may already have been let go of.  Returns nonzero if the
+ * transaction holds the lock.  Caller holds mapEntry->mutex.
+ */
+static int addLock(MAP_ENTRY *mapEntry, TRANSACTION *tp) {
+    pthread_mutex_lock(&tp->mutex);
+    if(tp->status != TRANS_PENDING) {
+        pthread_mutex_unlock(&tp->mutex);
+        return 0;
+    }
+    if(tp->num_locks == tp->max_locks) {
+        tp->max_locks = tp->max_locks ? tp->max_locks * 2 : 8;
+        tp->locks = Realloc(tp->locks, tp->max_locks * sizeof(MAP_ENTRY *));
+    }
+    tp->locks[tp->num_locks++] = mapEntry;
+    mapEntryRef(mapEntry);
+    pthread_mutex_unlock(&tp->mutex);
+
+    ENTRY_LOCK *lp = mapEntry->lock;
+    if(lp->num_holders == lp->max_holders) {
+        lp->max_holders = lp->max_holders ? lp->max_holders * 2 : 4;
+        lp->holders = Realloc(lp->holders, lp->max_holders * sizeof(TRANSACTION *));
+    }
+    lp->holders[lp->num_holders++] = tp;
+    return 1;
+}
+
+/*
+ * Wait for the lock on an entry to be let go of, unless the transaction has been
+ * aborted.  The epoch critical section is left meanwhile, so that a long wait does
+ * not hold up reclamation; an entry with waiters is not removed, and our reference
+ * keeps it for releaseLocks() to wake us.  Returns zero if the transaction has been
+ * aborted.  Caller holds mapEntry->mutex, which is held again on return.
+ */
+static int waitLock(MAP_ENTRY *mapEntry, TRANSACTION *tp) {
+    pthread_mutex_lock(&tp->mutex);
+    int pending = tp->status == TRANS_PENDING;
+    if(pending) tp->waiting = mapEntry;
+    pthread_mutex_unlock(&tp->mutex);
+    if(!pending) return 0;
+
+    mapEntryRef(mapEntry);
+    mapEntry->lock->waiters++;
+    epoch_exit();
+    pthread_cond_wait(&mapEntry->lock->cond, &mapEntry->mutex);
+    epoch_enter();
+    mapEntry->lock->waiters--;
+
+    pthread_mutex_lock(&tp->mutex);
+    tp->waiting = NULL;
+    pthread_mutex_unlock(&tp->mutex);
+    mapEntryUnref(mapEntry);
+    return 1;
+}
+
+/*
+ * Lock an entry for a transaction under ENGINE_2PL, shared or exclusively.  While
+ * the lock is held in a conflicting mode, the transaction waits if it is older than
+ * every other holder, and otherwise dies (wait-die).  Returns nonzero if the lock is
+ * held; zero if the transaction must abort, which the caller does once it has let go
+ * of the entry's mutex, as aborting lets go of the transaction's locks.  Caller is in
+ * an epoch critical section, and holds mapEntry->mutex.
+ */
+static int lockEntry(MAP_ENTRY *mapEntry, TRANSACTION *tp, int exclusive) {
+    ENTRY_LOCK *lp = mapEntry->lock;
+    if(lp == NULL) {
+        lp = mapEntry->lock = Calloc(sizeof(ENTRY_LOCK), 1);
+        pthread_cond_init(&lp->cond, 0);
+    }
+
+    while(1) {
+        //  See whether we hold the lock already, and find the oldest holder in our way.
+        int held = 0;
+        uint64_t oldest = UINT64_MAX;
+        for(int i = 0; i < lp->num_holders; i++) {
+            TRANSACTION *holder = lp->holders[i];
+            if(holder == tp) held = 1;
+            else if((exclusive || lp->exclusive) && holder->priority < oldest) oldest = holder->priority;
+        }
+        if(held && (lp->exclusive || !exclusive)) return 1;
+
+        if(oldest == UINT64_MAX) {
+            if(!held && !addLock(mapEntry, tp)) return 0;
+            lp->exclusive = exclusive;
+            return 1;
+        }
+
+        //  Only ever wait for younger transactions, so that no cycle of waits can form.
+        if(tp->priority >= oldest) {
+            debug("Transaction %lu dies for a lock held by an older transaction -- aborting", tp->id);
+            return 0;
+        }
+        if(!waitLock(mapEntry, tp)) return 0;
+    }
+}
+
+//  Give up on a lock that could not be taken: let go of the entry, and abort.
+static void lockFailed(MAP_ENTRY *mapEntry, TRANSACTION *tp) {
+    pthread_mutex_unlock(&mapEntry->mutex);
+    trans_ref(tp, "for aborting transaction that could not lock");
+    trans_abort(tp);
+}
+
+//  Lock an entry exclusively and buffer a write to it, under ENGINE_2PL.
+static void putLocked(MAP_ENTRY *mapEntry, TRANSACTION *tp, BLOB *value) {
+    if(lockEntry(mapEntry, tp, 1)) bufferWrite(mapEntry, tp, value);
+    else {
+        lockFailed(mapEntry, tp);
+        blob_unref(value, "for aborting transaction that could not lock");
+    }
+}
+
+TRANS_STATUS store_put(TRANSACTION *tp, KEY *key, BLOB *value) {
+    debug("Put mapping (key=%p [%s] -> value=%p [%s]) in store for transaction %lu", key, key->blob->prefix, value, value->prefix, tp->id);
+    TRANS_STATUS status = store_put_raw(tp, key->blob->content, key->blob->size, value);
+    key_dispose(key);
+    return status;
+}
+
+TRANS_STATUS store_put_raw(TRANSACTION *tp, char *key, size_t size, BLOB *value) {
+    debug("Put mapping (key of size %lu -> value=%p) in store for transaction %lu", size, value, tp->id);
+
+    //  A transaction aborted already, as when one it depended on aborted, fails without touching the store.
+    if(trans_get_status(tp) == TRANS_ABORTED) {
+        blob_unref(value, "for transaction aborted already");
+        return TRANS_ABORTED;
+    }
+    if(tp->read_only) return putReadOnly(tp, value);
+
+    /*  Keep anything we look at from being freed under us, and any transaction we finish
+     *  from being decided before its entry is unlocked.
+     */
+    epoch_enter();
+    trans_defer_decisions();
+
+    //  Find or create the map entry (which comes locked), and add the version.
+    MAP_ENTRY *mapEntry = findRawMapEntry(key, size);
+    if(store.engine == ENGINE_2PL) putLocked(mapEntry, tp, value);
+    else if(store.engine != ENGINE_ORDERED) bufferWrite(mapEntry, tp, value);
+    else putVersion(mapEntry, tp, value);
+    trans_decide_deferred();
+    epoch_exit();
+
     //  Return pending or aborted status.
     return trans_get_status(tp);
 }
 
-TRANS_STATUS store_get(TRANSACTION *tp, KEY *key, BLOB **valuep) {
-    debug("Get mapping of key=%p [%s] in store for transaction %d", key, key->blob->prefix, tp->id);
-
-    //  Find or create the map entry.
-    MAP_ENTRY *mapEntry = findMapEntry(key);
+//  Caller is in an epoch critical section, and holds mapEntry->mutex.
+static void getVersion(MAP_ENTRY *mapEntry, TRANSACTION *tp, BLOB **valuep) {
+    //  Garbage collect the version list, unless there is nothing to collect.
+    if(atomic_load(&mapEntry->dirty)) garbageCollect(mapEntry);
 
-    //  Garbage collect the version list.
-    garbageCollect(mapEntry);
+    //  Wound any younger transactions that have gone ahead, before their value is read.
+    if(mapEntry->tail != NULL && mapEntry->tail->creator->id > tp->id) wound(mapEntry, tp);
 
-    VERSION *cur = mapEntry->versions;
+    VERSION *cur = mapEntry->tail;
 
     //  If there is no version, use a null value when adding the version.
     if(cur == NULL) *valuep = NULL;
     //  Else retrieve the latest version's value.
     else {
-        while(cur->next != NULL) {
-            cur = cur->next;
-        }
         *valuep = cur->blob;
         blob_ref(*valuep, NULL);
     }
@@ -89,16 +448,262 @@ TRANS_STATUS store_get(TRANSACTION *tp, KEY *key, BLOB **valuep) {
     addVersion(mapEntry, tp, *valuep, NULL);
     if(*valuep != NULL) blob_ref(*valuep, NULL);
 
+    //  Unlock.
+    pthread_mutex_unlock(&mapEntry->mutex);
+}
+
+/*
+ * Read a key as of the snapshot of a read-only transaction: the value of the last
+ * committed version whose creator's ID is below the snapshot.  Everything below it
+ * has finished, so nothing is added to the list and nothing needs waiting for.
+ * Garbage collection keeps that version (see trans_watermark()), so if none is
+ * left, none was ever committed before the snapshot.  The entry may be NULL, for a key
+ * with no entry; otherwise the caller holds its mutex, which is released.
+ */
+static void getSnapshot(MAP_ENTRY *mapEntry, TRANSACTION *tp, BLOB **valuep) {
+    *valuep = NULL;
+    if(mapEntry == NULL) return;
+
+    VERSION *visible = NULL;
+    for(VERSION *vp = mapEntry->versions; vp != NULL && vp->ts < tp->snapshot; vp = vp->next)
+        if(trans_get_status(vp->creator) == TRANS_COMMITTED) visible = vp;
+
+    assert(visible != NULL || mapEntry->collected >= tp->snapshot);
+    if(visible != NULL && visible->blob != NULL) {
+        *valuep = visible->blob;
+        blob_ref(*valuep, NULL);
+    }
+    pthread_mutex_unlock(&mapEntry->mutex);
+}
+
+/*
+ * Read a key from the writes a transaction has buffered, the last first.  Returns
+ * nonzero, with a reference to the value, if the key was written.
+ */
+static int getBuffered(TRANSACTION *tp, KEY *key, BLOB **valuep) {
+    for(int i = tp->num_writes - 1; i >= 0; i--) {
+        if(key_compare(key, tp->writes[i].entry->key)) continue;
+        *valuep = tp->writes[i].value;
+        if(*valuep != NULL) blob_ref(*valuep, NULL);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Read a key under ENGINE_OCC: the value of the last committed version, noting the
+ * entry and the version's stamp for the commit to check.  A version being installed
+ * by a commit not yet decided is passed over; if that commit goes through, ours
+ * will not.  Caller is in an epoch critical section, and holds mapEntry->mutex,
+ * which is released.
+ */
+static void getOptimistic(MAP_ENTRY *mapEntry, TRANSACTION *tp, BLOB **valuep) {
+    VERSION *vp = mapEntry->tail;
+    while(vp != NULL && trans_get_status(vp->creator) != TRANS_COMMITTED) vp = vp->prev;
+    *valuep = vp != NULL ? vp->blob : NULL;
+    if(*valuep != NULL) blob_ref(*valuep, NULL);
+    mapEntryRef(mapEntry);
+    pthread_mutex_unlock(&mapEntry->mutex);
+
+    if(tp->num_reads == tp->max_reads) {
+        tp->max_reads = tp->max_reads ? tp->max_reads * 2 : 8;
+        tp->reads = Realloc(tp->reads, tp->max_reads * sizeof(READ));
+    }
+    tp->reads[tp->num_reads++] = (READ){ .entry = mapEntry, .ts = vp != NULL ? vp->ts : 0 };
+}
+
+/*
+ * Read a key under ENGINE_2PL: the value of the last committed version, once the
+ * entry is locked shared.  Caller is in an epoch critical section, and holds
+ * mapEntry->mutex, which is released.
+ */
+static void getLocked(MAP_ENTRY *mapEntry, TRANSACTION *tp, BLOB **valuep) {
+    *valuep = NULL;
+    if(!lockEntry(mapEntry, tp, 0)) {
+        lockFailed(mapEntry, tp);
+        return;
+    }
+    VERSION *vp = mapEntry->tail;
+    while(vp != NULL && trans_get_status(vp->creator) != TRANS_COMMITTED) vp = vp->prev;
+    if(vp != NULL && vp->blob != NULL) {
+        *valuep = vp->blob;
+        blob_ref(*valuep, NULL);
+    }
+    pthread_mutex_unlock(&mapEntry->mutex);
+}
+
+//  Note a range scanned under ENGINE_OCC or ENGINE_2PL, copying its bounds.
+static void noteScan(TRANSACTION *tp, BLOB *lo, BLOB *hi, int limit) {
+    if(tp->num_scans == tp->max_scans) {
+        tp->max_scans = tp->max_scans ? tp->max_scans * 2 : 4;
+        tp->scans = Realloc(tp->scans, tp->max_scans * sizeof(SCAN));
+    }
+    SCAN *sp = &tp->scans[tp->num_scans++];
+    sp->lo = lo != NULL ? blob_create(lo->content, lo->size) : NULL;
+    sp->hi = hi != NULL ? blob_create(hi->content, hi->size) : NULL;
+    sp->limit = limit;
+}
+
+/*
+ * Find the existing entry for a key and lock it, for a read-only transaction, which
+ * has no reason to create one.  An entry created while we look can hold nothing in
+ * the snapshot, but one being moved by a resize can be missed without the stripe.
+ * Caller is in an epoch critical section.  Returns NULL if there is no entry.
+ */
+static MAP_ENTRY *lockExistingMapEntry(KEY *key) {
+    while(1) {
+        MAP_ENTRY *mapEntry;
+        if(store.index == INDEX_SWISS) mapEntry = swiss_lookup(store.swiss, key);
+        else if((mapEntry = lookupMapEntry(key)) == NULL) {
+            pthread_mutex_t *stripe = STRIPE(key->hash);
+            pthread_mutex_lock(stripe);
+            mapEntry = lookupMapEntry(key);
+            pthread_mutex_unlock(stripe);
+        }
+        if(mapEntry == NULL) return NULL;
+
+        pthread_mutex_lock(&mapEntry->mutex);
+        if(!mapEntry->dead) return mapEntry;
+        pthread_mutex_unlock(&mapEntry->mutex);
+    }
+}
+
+TRANS_STATUS store_get(TRANSACTION *tp, KEY *key, BLOB **valuep) {
+    debug("Get mapping of key=%p [%s] in store for transaction %lu", key, key->blob->prefix, tp->id);
+    TRANS_STATUS status = store_get_raw(tp, key->blob->content, key->blob->size, valuep);
+    key_dispose(key);
+    return status;
+}
+
+TRANS_STATUS store_get_raw(TRANSACTION *tp, char *key, size_t size, BLOB **valuep) {
+    debug("Get mapping of key of size %lu in store for transaction %lu", size, tp->id);
+
+    //  A transaction aborted already fails without touching the store.
+    if(trans_get_status(tp) == TRANS_ABORTED) {
+        *valuep = NULL;
+        return TRANS_ABORTED;
+    }
+
+    BLOB blob;
+    KEY lookup;
+    makeLookupKey(&lookup, &blob, key, size);
+
+    //  Keep anything we look at from being freed under us, and hold back decisions, as for PUT.
+    epoch_enter();
+    trans_defer_decisions();
+
+    /*  A key the transaction has written is read back from its own writes.  Otherwise find
+     *  the map entry (which comes locked), creating it unless only a snapshot is read.
+     */
+    if(!getBuffered(tp, &lookup, valuep)) {
+        int owned = 0;
+        if(tp->read_only || store.engine == ENGINE_MVCC) getSnapshot(lockExistingMapEntry(&lookup), tp, valuep);
+        else if(store.engine == ENGINE_OCC) getOptimistic(lockMapEntry(&lookup, &owned), tp, valuep);
+        else if(store.engine == ENGINE_2PL) getLocked(lockMapEntry(&lookup, &owned), tp, valuep);
+        else getVersion(lockMapEntry(&lookup, &owned), tp, valuep);
+    }
+    trans_decide_deferred();
+    epoch_exit();
+
     //  Return pending or aborted status.
     return trans_get_status(tp);
 }
 
-void store_show() {
-    //  Show the contents of the store.
-    fprintf(stderr, "CONTENTS OF STORE:\n");
-    for (int i = 0; i < NUM_BUCKETS; i++) {
-        fprintf(stderr, "%d:", i);
-        MAP_ENTRY* cur = store.table[i];
+TRANS_STATUS store_range(TRANSACTION *tp, char *lo, size_t lo_size, char *hi, size_t hi_size, int limit,
+                         void (*emit)(KEY *key, BLOB *value, void *arg), void *arg) {
+    debug("Range of keys (sizes %lu to %lu, limit %d) in store for transaction %lu", lo_size, hi_size, limit, tp->id);
+    if(trans_get_status(tp) == TRANS_ABORTED) return TRANS_ABORTED;
+
+    //  Bounds are only compared against, so they are made over the caller's buffers.
+    BLOB lo_blob = { .size = lo_size, .content = lo };
+    BLOB hi_blob = { .size = hi_size, .content = hi };
+
+    epoch_enter();
+    trans_defer_decisions();
+
+    /*  Collect the entries in the range, leaving our read timestamp on them and the gaps between,
+     *  unless we only read a snapshot, which nobody can write into, or the range is checked
+     *  again at commit.
+     */
+    int snapshot = tp->read_only || store.engine == ENGINE_MVCC;
+    int checked = !tp->read_only && (store.engine == ENGINE_OCC || store.engine == ENGINE_2PL);
+    int count;
+    MAP_ENTRY **entries = skiplist_scan(store.ordered, lo != NULL ? &lo_blob : NULL, hi != NULL ? &hi_blob : NULL,
+                                        limit, snapshot || checked ? 0 : tp->id, &count);
+    if(checked) noteScan(tp, lo != NULL ? &lo_blob : NULL, hi != NULL ? &hi_blob : NULL, limit);
+
+    //  Read each one in turn, as GET would, keeping the values until nothing is held.
+    BLOB **values = Malloc((count > 0 ? count : 1) * sizeof(BLOB *));
+    int i;
+    for(i = 0; i < count && trans_get_status(tp) == TRANS_PENDING; i++) {
+        MAP_ENTRY *mapEntry = entries[i];
+        pthread_mutex_lock(&mapEntry->mutex);
+
+        //  An entry removed since the scan has handed its timestamp on, but the key still has to be read.
+        if(mapEntry->dead) {
+            pthread_mutex_unlock(&mapEntry->mutex);
+            int owned = 0;
+            if(snapshot) mapEntry = lockExistingMapEntry(mapEntry->key);
+            else mapEntry = lockMapEntry(mapEntry->key, &owned);
+        }
+
+        BLOB *value;
+        if(checked) {
+            if(getBuffered(tp, entries[i]->key, &value)) pthread_mutex_unlock(&mapEntry->mutex);
+            else if(store.engine == ENGINE_2PL) getLocked(mapEntry, tp, &value);
+            else getOptimistic(mapEntry, tp, &value);
+        }
+        else if(!snapshot) getVersion(mapEntry, tp, &value);
+        else if(!getBuffered(tp, entries[i]->key, &value)) getSnapshot(mapEntry, tp, &value);
+        else if(mapEntry != NULL) pthread_mutex_unlock(&mapEntry->mutex);
+        if(trans_get_status(tp) != TRANS_PENDING) {
+            blob_unref(value, "obtained from range");
+            break;
+        }
+        values[i] = value;
+    }
+    int num_read = i;
+    trans_decide_deferred();
+    epoch_exit();
+
+    //  Only now emit what was read, since emit may block; the references keep the keys.
+    for(i = 0; i < num_read; i++) {
+        emit(entries[i]->key, values[i], arg);
+        blob_unref(values[i], "obtained from range");
+    }
+    for(i = 0; i < count; i++) mapEntryUnref(entries[i]);
+    Free(values);
+    Free(entries);
+
+    return trans_get_status(tp);
+}
+
+void store_stats(STORE_STATS *sp) {
+    sp->entries = atomic_load(&store.num_entries);
+    sp->removed = atomic_load(&store.removed);
+    sp->removed_bytes = atomic_load(&store.removed_bytes);
+    sp->budget = store.budget;
+    sp->bytes = atomic_load(&store.bytes);
+    sp->evicted = atomic_load(&store.evicted);
+    sp->evicted_bytes = atomic_load(&store.evicted_bytes);
+}
+
+void store_show_stats() {
+    STORE_STATS stats;
+    store_stats(&stats);
+    fprintf(stderr, "STORE STATISTICS:\n");
+    fprintf(stderr, "\tentries: %ld\n", stats.entries);
+    fprintf(stderr, "\tentries removed holding no value: %ld (%ld bytes)\n", stats.removed, stats.removed_bytes);
+    if(stats.budget) {
+        fprintf(stderr, "\tbytes in use: %ld of %ld\n", stats.bytes, stats.budget);
+        fprintf(stderr, "\tentries evicted: %ld (%ld bytes)\n", stats.evicted, stats.evicted_bytes);
+    }
+}
+
+static void showBuckets(BUCKETS *tbl, int from, char *label) {
+    for (int i = from; i < tbl->num_buckets; i++) {
+        fprintf(stderr, "%s%d:", label, i);
+        MAP_ENTRY* cur = tbl->bucket[i];
 
         while (cur != NULL) {
             itemShow(cur, cur->key);
@@ -107,193 +712,960 @@ void store_show() {
 
         fprintf(stderr, "\n" );
     }
+}
+
+static void entryShow(MAP_ENTRY *mapEntry) {
+    itemShow(mapEntry, mapEntry->key);
+}
+
+void store_show() {
+    //  Show the contents of the store.
+    if(store.index == INDEX_SWISS) {
+        fprintf(stderr, "CONTENTS OF STORE (%d entries):\n", atomic_load(&store.num_entries));
+        swiss_show(store.swiss, entryShow);
+        return;
+    }
 
+    BUCKETS *tbl = atomic_load(&store.table);
+    fprintf(stderr, "CONTENTS OF STORE (%d entries, %d buckets):\n", atomic_load(&store.num_entries), tbl->num_buckets);
+    showBuckets(tbl, 0, "");
+
+    //  Show entries not yet migrated out of the old table.
+    BUCKETS *old = atomic_load(&store.old_table);
+    if(old != NULL) showBuckets(old, store.rehash_idx, "old ");
 }
 
 void itemShow(MAP_ENTRY* mapEntry, KEY *kp) {
-    if(mapEntry->versions->blob == NULL) fprintf(stderr, "\t{key: %p [%s], versions: {creator=%d (%d), (NULL blob)}", kp, kp->blob->prefix, mapEntry->versions->creator->id, mapEntry->versions->creator->status);
-    else fprintf(stderr, "\t{key: %p [%s], versions: {creator=%d (%d), blob=%p [%s]}", kp, kp->blob->prefix, mapEntry->versions->creator->id, mapEntry->versions->creator->status, mapEntry->versions->blob, mapEntry->versions->blob->prefix);
-    VERSION* cur = mapEntry->versions->next;
+    fprintf(stderr, "\t{key: %p [%s], versions: {", kp, kp->blob->prefix);
+    VERSION* cur = mapEntry->versions;
     while(cur != NULL) {
-        if(mapEntry->key->blob == NULL) fprintf(stderr, "{creator=%d (%d), (NULL blob)}", mapEntry->versions->creator->id, mapEntry->versions->creator->status);
-        else fprintf(stderr, "{creator=%d (%d), blob=%p [%s]}", cur->creator->id, cur->creator->status, cur->blob, cur->blob->prefix);
+        if(cur->blob == NULL) fprintf(stderr, "{creator=%lu (%d), (NULL blob)}", cur->creator->id, cur->creator->status);
+        else fprintf(stderr, "{creator=%lu (%d), blob=%p [%s]}", cur->creator->id, cur->creator->status, cur->blob, cur->blob->prefix);
         cur = cur->next;
     }
     fprintf(stderr, "}\n");
 }
 
-MAP_ENTRY *findMapEntry(KEY *key) {
-    int i;
-    //  Find an existing map entry. If map entry found, dispose the new key.
-    for(i = 0; i < NUM_BUCKETS; i++) {
-        if(store.table[i] != NULL) {
-            MAP_ENTRY *curMapEntry = store.table[i];
-
-            while(curMapEntry != NULL) {
-                MAP_ENTRY *nextMapEntry = curMapEntry->next;
-                if(!key_compare(key, curMapEntry->key)) {
-                    debug("Matching entry exists, disposing of redundant key %p [%s]", key, key->blob->prefix);
-                    key_dispose(key);
-
-                    //  Return the found map entry.
-                    return curMapEntry;
-                }
-                curMapEntry = nextMapEntry;
+/*
+ * Search a bucket chain.  This takes no lock: entries are published with release
+ * stores, and may be moved to another chain by a resize while we walk, in which
+ * case we can miss the key but will still reach the end of some chain.
+ */
+static MAP_ENTRY *findInBucket(_Atomic(MAP_ENTRY *) *bucket, KEY *key) {
+    MAP_ENTRY *cur = atomic_load_explicit(bucket, memory_order_acquire);
+    while(cur != NULL) {
+        if(!key_compare(key, cur->key)) return cur;
+        cur = atomic_load_explicit(&cur->next, memory_order_acquire);
+    }
+    return NULL;
+}
+
+//  Look for an existing entry in both tables.  Caller is in an epoch critical section.
+static MAP_ENTRY *lookupMapEntry(KEY *key) {
+    uint64_t hash = key->hash;
+    MAP_ENTRY *mapEntry = findInBucket(BUCKET(atomic_load_explicit(&store.table, memory_order_acquire), hash), key);
+
+    if(mapEntry == NULL) {
+        BUCKETS *old = atomic_load_explicit(&store.old_table, memory_order_acquire);
+        if(old != NULL) mapEntry = findInBucket(BUCKET(old, hash), key);
+    }
+    return mapEntry;
+}
+
+static void lockAllStripes() {
+    for(int i = 0; i < NUM_STRIPES; i++) pthread_mutex_lock(&store.stripes[i]);
+}
+
+static void unlockAllStripes() {
+    for(int i = NUM_STRIPES - 1; i >= 0; i--) pthread_mutex_unlock(&store.stripes[i]);
+}
+
+//  Caller holds store.mutex and no stripe.
+static void startResize(int num_buckets) {
+    debug("Resize store from %d to %d buckets (%d entries)", atomic_load(&store.table)->num_buckets, num_buckets, atomic_load(&store.num_entries));
+
+    BUCKETS *tbl = newBuckets(num_buckets);
+
+    lockAllStripes();
+    atomic_store(&store.old_table, atomic_load(&store.table));
+    store.rehash_idx = 0;
+    atomic_store(&store.table, tbl);
+    unlockAllStripes();
+}
+
+//  Caller holds no stripe.
+static void rehashStep(int steps) {
+    if(atomic_load_explicit(&store.old_table, memory_order_relaxed) == NULL) return;
+
+    //  Only one thread migrates at a time; the others just carry on.
+    if(pthread_mutex_trylock(&store.mutex)) return;
+    BUCKETS *old = atomic_load(&store.old_table);
+    BUCKETS *tbl = atomic_load(&store.table);
+    if(old == NULL) {
+        pthread_mutex_unlock(&store.mutex);
+        return;
+    }
+
+    /*  Move up to steps buckets from the old table to the new one.  Every entry
+     *  of an old bucket lands in a new bucket covered by the same stripe.
+     *  Entries are pushed onto the new chains before the old bucket is cleared,
+     *  so a lock-free reader following an entry's next pointer never loops.
+     */
+    while(steps-- > 0 && store.rehash_idx < old->num_buckets) {
+        pthread_mutex_t *stripe = STRIPE(store.rehash_idx);
+        pthread_mutex_lock(stripe);
+        MAP_ENTRY *curMapEntry = old->bucket[store.rehash_idx];
+
+        while(curMapEntry != NULL) {
+            MAP_ENTRY *nextMapEntry = curMapEntry->next;
+            _Atomic(MAP_ENTRY *) *bucket = BUCKET(tbl, curMapEntry->key->hash);
+            atomic_store_explicit(&curMapEntry->next, atomic_load(bucket), memory_order_release);
+            atomic_store_explicit(bucket, curMapEntry, memory_order_release);
+            curMapEntry = nextMapEntry;
+        }
+        atomic_store_explicit(&old->bucket[store.rehash_idx++], NULL, memory_order_release);
+        pthread_mutex_unlock(stripe);
+    }
+
+    //  Once every bucket has been moved, the old table can go once no reader can be using it.
+    if(store.rehash_idx == old->num_buckets) {
+        debug("Resize to %d buckets complete", tbl->num_buckets);
+        lockAllStripes();
+        atomic_store(&store.old_table, NULL);
+        store.rehash_idx = 0;
+        unlockAllStripes();
+        epoch_retire(old, free);
+    }
+
+    pthread_mutex_unlock(&store.mutex);
+}
+
+//  Caller holds no stripe.
+static void checkLoad() {
+    //  Only one resize at a time; the next check happens after it completes.
+    if(atomic_load_explicit(&store.old_table, memory_order_relaxed) != NULL) return;
+    if(pthread_mutex_trylock(&store.mutex)) return;
+
+    int num_entries = atomic_load(&store.num_entries);
+    int num_buckets = atomic_load(&store.table)->num_buckets;
+    if(atomic_load(&store.old_table) == NULL) {
+        if(num_entries > num_buckets * MAX_LOAD_FACTOR)
+            startResize(num_buckets * 2);
+        else if(num_buckets > store.min_buckets && num_entries < num_buckets / MIN_LOAD_FACTOR)
+            startResize(num_buckets / 2);
+    }
+
+    pthread_mutex_unlock(&store.mutex);
+}
+
+static MAP_ENTRY *newMapEntry(KEY *key) {
+    MAP_ENTRY *mapEntry = Calloc(sizeof(MAP_ENTRY), 1);
+    mapEntry->key = key;
+    mapEntry->versions = NULL;
+    mapEntry->tail = NULL;
+    mapEntry->committed = NULL;
+    pthread_mutex_init(&mapEntry->mutex, 0);
+    atomic_init(&mapEntry->dirty, 0);
+    mapEntry->deferred = 0;
+    mapEntry->dead = 0;
+    atomic_init(&mapEntry->refcnt, 1);
+    atomic_init(&mapEntry->referenced, 1);
+    mapEntry->clock_next = mapEntry->clock_prev = NULL;
+    mapEntry->node = NULL;
+    atomic_init(&mapEntry->rts, 0);
+    mapEntry->collected = UINT64_MAX;
+    mapEntry->lock = NULL;
+    return mapEntry;
+}
+
+/*
+ * Make the key for a new map entry.  A key that the caller owns is used as is;
+ * a lookup key built on the caller's buffer is copied.
+ */
+static KEY *entryKey(KEY *key, int owned) {
+    if(owned) return key;
+    KEY *kp = key_create(blob_create(key->blob->content, key->blob->size));
+    debug("Materialize key %p [%s] for new map entry", kp, kp->blob->prefix);
+    return kp;
+}
+
+//  Find or create the entry for a key in the chained map.
+static MAP_ENTRY *findChained(KEY *key, int owned) {
+    //  Do a little of any resize in progress.
+    rehashStep(REHASH_STEP);
+
+    //  The common case: the entry exists, and is found without locking.
+    MAP_ENTRY *mapEntry = lookupMapEntry(key);
+    if(mapEntry != NULL) return mapEntry;
+
+    //  Lock the stripe covering the key's bucket, and look again.
+    uint64_t hash = key->hash;
+    pthread_mutex_t *stripe = STRIPE(hash);
+    pthread_mutex_lock(stripe);
+
+    mapEntry = lookupMapEntry(key);
+    if(mapEntry == NULL) {
+        //  Map entry not found, so create a new one.
+        mapEntry = newMapEntry(entryKey(key, owned));
+
+        //  Publish the map entry at the head of its bucket in the current table.
+        _Atomic(MAP_ENTRY *) *bucket = BUCKET(atomic_load(&store.table), hash);
+        atomic_init(&mapEntry->next, atomic_load(bucket));
+        atomic_store_explicit(bucket, mapEntry, memory_order_release);
+        atomic_fetch_add(&store.num_entries, 1);
+        pthread_mutex_unlock(stripe);
+        account(entryBytes(mapEntry));
+
+        //  Grow the table once the load factor gets too high.
+        checkLoad();
+        return mapEntry;
+    }
+
+    pthread_mutex_unlock(stripe);
+    return mapEntry;
+}
+
+//  Find or create the entry for a key in the open-addressing index.
+static MAP_ENTRY *findSwiss(KEY *key, int owned) {
+    //  The common case: the entry exists, and is found without locking.
+    MAP_ENTRY *mapEntry = swiss_lookup(store.swiss, key);
+    if(mapEntry != NULL) return mapEntry;
+
+    //  Otherwise try to insert a new entry, unless somebody else got there first.
+    MAP_ENTRY *newEntry = newMapEntry(entryKey(key, owned));
+    mapEntry = swiss_insert(store.swiss, newEntry);
+    if(mapEntry == newEntry) {
+        atomic_fetch_add(&store.num_entries, 1);
+        account(entryBytes(mapEntry));
+    }
+    else {
+        if(!owned) key_dispose(newEntry->key);
+        pthread_mutex_destroy(&newEntry->mutex);
+        Free(newEntry);
+    }
+    return mapEntry;
+}
+
+/*
+ * Find or create the entry for a key, and lock it.  The entry found may have
+ * been removed from the map while we were waiting for its mutex, in which case
+ * look again.  If the key is owned and a new entry takes it over, *owned is
+ * cleared.
+ */
+static MAP_ENTRY *lockMapEntry(KEY *key, int *owned) {
+    while(1) {
+        MAP_ENTRY *mapEntry;
+        if(store.index == INDEX_SWISS) mapEntry = findSwiss(key, *owned);
+        else mapEntry = findChained(key, *owned);
+
+        if(mapEntry->key == key) {
+            debug("Create new map entry for key %p [%s]", key, key->blob->prefix);
+            *owned = 0;
+        }
+
+        pthread_mutex_lock(&mapEntry->mutex);
+        if(!mapEntry->dead) {
+            /*  A new entry goes into the ordered index when first locked, before any
+             *  version can be added, so that it takes the read timestamp of its gap.
+             */
+            if(mapEntry->node == NULL) skiplist_insert(store.ordered, mapEntry);
+
+            /*  Mark the entry used, for the CLOCK hand, without writing to it needlessly.
+             *  A new entry goes on the ring when first locked, since the reaper may not
+             *  remove it before then.
+             */
+            if(store.budget) {
+                if(mapEntry->clock_next == NULL) clockInsert(mapEntry);
+                else if(!atomic_load_explicit(&mapEntry->referenced, memory_order_relaxed))
+                    atomic_store_explicit(&mapEntry->referenced, 1, memory_order_relaxed);
             }
+            return mapEntry;
         }
+        pthread_mutex_unlock(&mapEntry->mutex);
+
+        /*  If the dead entry had taken over our key, the key stays valid until we
+         *  leave the epoch critical section, but a new entry needs a copy.
+         */
+        debug("Map entry %p was removed, looking again", mapEntry);
     }
+}
+
+/*
+ * Find or create the entry for a key, returning it locked.  Caller is in an
+ * epoch critical section, which must last as long as the entry is used.
+ */
+MAP_ENTRY *findMapEntry(KEY *key) {
+    int owned = 1;
+    MAP_ENTRY *mapEntry = lockMapEntry(key, &owned);
+
+    //  Map entry found, so dispose the new key.
+    if(owned) {
+        debug("Matching entry exists, disposing of redundant key %p [%s]", key, key->blob->prefix);
+        key_dispose(key);
+    }
+
+    //  Return the found map entry.
+    return mapEntry;
+}
+
+/*
+ * Find or create the entry for a key given as raw content, returning it locked.
+ * Caller is in an epoch critical section, which must last as long as the entry is used.
+ */
+MAP_ENTRY *findRawMapEntry(char *content, size_t size) {
+    BLOB blob;
+    KEY key;
+    makeLookupKey(&key, &blob, content, size);
+    int owned = 0;
+
+    return lockMapEntry(&key, &owned);
+}
 
-    //  Map entry not found, so create a new one.
-    MAP_ENTRY *newMapEntry = Calloc(sizeof(MAP_ENTRY), 1);
-    newMapEntry->key = key;
-    newMapEntry->versions = NULL;
-    unsigned long bucket = key->hash;
-    bucket %= 8;
+//  Unlink an entry from whichever bucket chain it is on.  Caller holds the entry's stripe.
+static int unlinkChained(MAP_ENTRY *mapEntry) {
+    BUCKETS *tables[2] = { atomic_load(&store.table), atomic_load(&store.old_table) };
 
-    fprintf(stderr, "HASH\n%lu\n", bucket);
+    for(int i = 0; i < 2; i++) {
+        if(tables[i] == NULL) continue;
+        _Atomic(MAP_ENTRY *) *link = BUCKET(tables[i], mapEntry->key->hash);
 
-    //  Store map entry in the store.
-    if(store.table[bucket] == NULL) store.table[bucket] = newMapEntry;
+        //  Lock-free readers standing on the entry can still follow its next pointer.
+        for(MAP_ENTRY *cur = atomic_load(link); cur != NULL; cur = atomic_load(link)) {
+            if(cur == mapEntry) {
+                atomic_store_explicit(link, atomic_load(&mapEntry->next), memory_order_release);
+                return 1;
+            }
+            link = &cur->next;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Check whether an entry can be removed: its list must be empty, or hold a
+ * single committed version, NULL unless any_value is set.  Returns -1 if the
+ * committed version is too recent for the watermark, or if older committed
+ * versions are still kept for snapshots, so that the entry is looked at again
+ * once the watermark has moved on.
+ */
+static int removable(MAP_ENTRY *mapEntry, uint64_t watermark, int any_value) {
+    VERSION *vp = mapEntry->versions;
+    if(mapEntry->dead) return 0;
+    if(mapEntry->lock != NULL && (mapEntry->lock->num_holders || mapEntry->lock->waiters)) return 0;
+    if(vp == NULL) return 1;
+    if(trans_get_status(vp->creator) != TRANS_COMMITTED) return 0;
+    if(vp->next != NULL) return trans_get_status(vp->next->creator) == TRANS_COMMITTED ? -1 : 0;
+    if(vp->blob != NULL && !any_value) return 0;
+    return vp->ts < watermark ? 1 : -1;
+}
+
+/*
+ * Take an entry out of the map, mark it dead and drop the map's reference.
+ * Returns the memory released, or 0 if the entry was not in the map.
+ * Caller holds mapEntry->mutex, and store.clock_mutex in cache mode.
+ */
+static long removeMapEntry(MAP_ENTRY *mapEntry) {
+    /*  Take the entry out of the ordered index right after the map, since a new entry
+     *  for the key waits for it to be gone from the index before going in.
+     */
+    int removed;
+    if(store.index == INDEX_SWISS) removed = swiss_remove(store.swiss, mapEntry);
     else {
-        MAP_ENTRY *curMapEntry = store.table[bucket];
+        pthread_mutex_t *stripe = STRIPE(mapEntry->key->hash);
+        pthread_mutex_lock(stripe);
+        removed = unlinkChained(mapEntry);
+        pthread_mutex_unlock(stripe);
+    }
+    if(removed) skiplist_remove(store.ordered, mapEntry);
+    if(!removed) return 0;
 
-        while(curMapEntry->next != NULL) {
-            curMapEntry = curMapEntry->next;
+    mapEntry->dead = 1;
+    atomic_fetch_sub(&store.num_entries, 1);
+    if(mapEntry->clock_next != NULL) clockRemove(mapEntry);
+
+    long bytes = entryBytes(mapEntry);
+    for(VERSION *vp = mapEntry->versions; vp != NULL; vp = vp->next) bytes += versionBytes(vp);
+    account(-bytes);
+
+    //  Drop the map's reference.
+    mapEntryUnref(mapEntry);
+    return bytes;
+}
+
+//  Caller holds mapEntry->mutex.
+int reclaimMapEntry(MAP_ENTRY *mapEntry, uint64_t watermark) {
+    //  Only an empty list, or a single committed NULL version, can go.
+    int result = removable(mapEntry, watermark, 0);
+    if(result <= 0) return result;
+
+    if(store.budget) pthread_mutex_lock(&store.clock_mutex);
+    long bytes = removeMapEntry(mapEntry);
+    if(store.budget) pthread_mutex_unlock(&store.clock_mutex);
+    if(bytes == 0) return 0;
+
+    debug("Removed map entry %p, which holds no value", mapEntry);
+    atomic_fetch_add(&store.removed, 1);
+    atomic_fetch_add(&store.removed_bytes, bytes);
+    return 1;
+}
+
+//  Caller is in an epoch critical section, and holds no entry's mutex.
+int evictMapEntries(uint64_t watermark, int max) {
+    int evicted = 0;
+
+    /*  Passing over a recently used entry is cheap, so it does not count towards
+     *  max, but the hand goes round the ring at most once.
+     */
+    pthread_mutex_lock(&store.clock_mutex);
+    long steps = atomic_load(&store.num_entries);
+    while(max > 0 && steps-- > 0 && store.clock_hand != NULL && store_over_budget()) {
+        MAP_ENTRY *mapEntry = store.clock_hand;
+        store.clock_hand = mapEntry->clock_next;
+
+        //  Give an entry used since the last sweep another turn.
+        if(atomic_load_explicit(&mapEntry->referenced, memory_order_relaxed)) {
+            atomic_store_explicit(&mapEntry->referenced, 0, memory_order_relaxed);
+            continue;
+        }
+        max--;
+
+        //  Skip an entry in use, rather than wait for it while holding the ring.
+        if(pthread_mutex_trylock(&mapEntry->mutex)) continue;
+        if(atomic_load(&mapEntry->dirty)) garbageCollect(mapEntry);
+
+        long bytes = 0;
+        if(removable(mapEntry, watermark, 1) > 0) bytes = removeMapEntry(mapEntry);
+        pthread_mutex_unlock(&mapEntry->mutex);
+
+        if(bytes > 0) {
+            debug("Evicted map entry %p (%ld bytes)", mapEntry, bytes);
+            atomic_fetch_add(&store.evicted, 1);
+            atomic_fetch_add(&store.evicted_bytes, bytes);
+            evicted++;
         }
-        curMapEntry->next = newMapEntry;
     }
+    pthread_mutex_unlock(&store.clock_mutex);
 
-    debug("Create new map entry for key %p [%s] at table index %lu", key, key->blob->prefix, bucket);
+    return evicted;
+}
+
+/*
+ * Garbage collect a version list under ENGINE_MVCC or ENGINE_OCC, where it holds
+ * only versions installed by commits.  An aborted version is just dropped, and the
+ * committed ones are kept back to the last below the watermark.  Snapshots are
+ * taken all the time here, so the watermark is used rather than the horizon alone,
+ * which a snapshot being taken meanwhile could go below.
+ */
+static void collectInstalled(MAP_ENTRY *mapEntry) {
+    uint64_t horizon = trans_watermark();
+    VERSION *latestCommit = NULL, *oldestKept = NULL;
+    VERSION *curVersion = mapEntry->versions;
+    while(curVersion != NULL) {
+        VERSION *nextVersion = curVersion->next;
+        TRANS_STATUS status = trans_get_status(curVersion->creator);
+        if(status == TRANS_ABORTED) {
+            if(curVersion->prev == NULL) mapEntry->versions = nextVersion;
+            else curVersion->prev->next = nextVersion;
+            if(nextVersion == NULL) mapEntry->tail = curVersion->prev;
+            else nextVersion->prev = curVersion->prev;
+            account(-versionBytes(curVersion));
+            version_dispose(curVersion);
+        }
+        else if(status == TRANS_COMMITTED) {
+            latestCommit = curVersion;
+            if(curVersion->ts < horizon) oldestKept = curVersion;
+        }
+        curVersion = nextVersion;
+    }
+    mapEntry->committed = latestCommit;
+    if(oldestKept == NULL) return;
 
-    //  Return the new map entry.
-    return newMapEntry;
+    while(mapEntry->versions != oldestKept) {
+        VERSION *oldVersion = mapEntry->versions;
+        mapEntry->versions = oldVersion->next;
+        if(mapEntry->collected == UINT64_MAX) mapEntry->collected = oldVersion->ts;
+        account(-versionBytes(oldVersion));
+        version_dispose(oldVersion);
+    }
+    oldestKept->prev = NULL;
 }
 
+//  Caller holds mapEntry->mutex.
 void garbageCollect(MAP_ENTRY *mapEntry) {
     //  If there are no versions, there is no garbage collection; return.
     if(mapEntry->versions == NULL) return;
+    if(store.engine != ENGINE_ORDERED) {
+        collectInstalled(mapEntry);
+        return;
+    }
 
+    /*  Committed versions always come first (a version depends on every earlier
+     *  version not committed when it was added), so find the last of them, and
+     *  the last one that a snapshot, in use or yet to be taken, may still read.
+     */
+    uint64_t horizon = trans_watermark();
     VERSION *curVersion = mapEntry->versions;
-    VERSION *latestCommit, *earliestAbort;
-    int flag = 1;
+    VERSION *latestCommit = NULL, *oldestKept = NULL;
+    while(curVersion != NULL && trans_get_status(curVersion->creator) == TRANS_COMMITTED) {
+        latestCommit = curVersion;
+        if(curVersion->ts < horizon) oldestKept = curVersion;
+        curVersion = curVersion->next;
+    }
 
-    //  Traverse version list and get the most recent commit and the earliest abort.
-    while(curVersion != NULL) {
-        TRANS_STATUS status = trans_get_status(curVersion->creator);
-        if(status == TRANS_COMMITTED) latestCommit = curVersion;
-        else if(status == TRANS_ABORTED && flag) {
-            earliestAbort = curVersion;
-            flag = 0;
+    //  Dispose of every committed version before it, noting where a snapshot could miss one.
+    if(latestCommit != NULL) {
+        if(oldestKept == NULL) oldestKept = mapEntry->versions;
+        while(mapEntry->versions != oldestKept) {
+            VERSION *oldVersion = mapEntry->versions;
+            mapEntry->versions = oldVersion->next;
+            if(mapEntry->collected == UINT64_MAX) mapEntry->collected = oldVersion->ts;
+            account(-versionBytes(oldVersion));
+            version_dispose(oldVersion);
         }
+        oldestKept->prev = NULL;
+        mapEntry->committed = latestCommit;
+    }
+
+    //  Find the earliest aborted version.
+    VERSION *prev = latestCommit;
+    while(curVersion != NULL && trans_get_status(curVersion->creator) != TRANS_ABORTED) {
+        prev = curVersion;
         curVersion = curVersion->next;
     }
+    if(curVersion == NULL) return;
 
-    VERSION *prev = mapEntry->versions;
-    VERSION *cur = mapEntry->versions->next;
-    flag = 1;
+    //  Cut the list there, then dispose of that version and all later ones, aborting their creators.
+    if(prev == NULL) mapEntry->versions = NULL;
+    else prev->next = NULL;
+    mapEntry->tail = prev;
 
-    //  Traverse version list and dispose of any earlier commits.
-    while(prev != NULL) {
-        TRANS_STATUS status = trans_get_status(prev->creator);
-        if(cur == NULL && status == TRANS_COMMITTED && flag) flag = 0;
-        else if(status == TRANS_COMMITTED && !memcmp(prev, latestCommit, sizeof(VERSION))) version_dispose(prev);
-        else if(status == TRANS_COMMITTED && memcmp(cur, latestCommit, sizeof(VERSION))) {
-            flag = 0;
-            break;
-        }
-        prev = cur;
-        if(cur != NULL) cur = cur->next;
-    }
-    if(!flag) {
-        while(cur != NULL) {
-            TRANS_STATUS status = trans_get_status(cur->creator);
-            if(status == TRANS_COMMITTED && !memcmp(cur, latestCommit, sizeof(VERSION))) {
-                prev->next = cur->next;
-                version_dispose(cur);
-            }
-            else if(status == TRANS_COMMITTED && memcmp(cur, latestCommit, sizeof(VERSION))) break;
-            prev = prev->next;
-            cur = prev->next;
+    while(curVersion != NULL) {
+        VERSION *nextVersion = curVersion->next;
+        if(trans_get_status(curVersion->creator) == TRANS_PENDING) {
+            debug("Abort transaction %lu, which follows an aborted version", curVersion->creator->id);
+            trans_ref(curVersion->creator, "for aborting creator of later version");
+            trans_abort(curVersion->creator);
         }
+        account(-versionBytes(curVersion));
+        version_dispose(curVersion);
+        curVersion = nextVersion;
     }
+}
 
-    /*  Traverse version list and dispose any versions and
-     *  abort their creator transactions starting from
-     *  the earliest abort.
-     */
-    prev = mapEntry->versions;
-    cur = mapEntry->versions->next;
-    while(prev != NULL) {
-        TRANS_STATUS status = trans_get_status(prev->creator);
-        if(status == TRANS_ABORTED && memcmp(prev, earliestAbort, sizeof(VERSION))) {
-            while(prev != NULL) {
-                trans_abort(prev->creator);
-                debug("test3");
-                version_dispose(prev);
-                prev = cur;
-                if(cur != NULL) cur = cur->next;
-            }
-            break;
-        }
-        prev = cur;
-        if(cur != NULL) cur = cur->next;
+/*
+ * Wound-wait: abort the creators of the versions at the end of the list that are
+ * later in the serial order than a transaction, if none of them has committed and
+ * the transaction is older than each, then collect their versions.  Returns nonzero
+ * if any were wounded.  Caller holds mapEntry->mutex.
+ */
+static int wound(MAP_ENTRY *mapEntry, TRANSACTION *tp) {
+    VERSION *vp;
+    for(vp = mapEntry->tail; vp != NULL && vp->creator->id > tp->id; vp = vp->prev) {
+        TRANS_STATUS status = trans_get_status(vp->creator);
+        if(status == TRANS_COMMITTED) return 0;
+        if(status == TRANS_PENDING && vp->creator->priority <= tp->priority) return 0;
+    }
+    for(vp = mapEntry->tail; vp != NULL && vp->creator->id > tp->id; vp = vp->prev) {
+        debug("Transaction %lu (priority %lu) wounds transaction %lu (priority %lu)",
+              tp->id, tp->priority, vp->creator->id, vp->creator->priority);
+        if(trans_wound(vp->creator) == TRANS_COMMITTED) return 0;
     }
+    garbageCollect(mapEntry);
+    return 1;
 }
 
+//  Caller holds mapEntry->mutex.
 void addVersion(MAP_ENTRY *mapEntry, TRANSACTION *tp, BLOB *bp, KEY *kp) {
-    VERSION *curVersion = mapEntry->versions;
+    VERSION *tail = mapEntry->tail;
 
-    /*  Traverse the version list and if a creator ID is less
-     *  than the transaction passed in, abort the transaction and return.
-     */
-    while(curVersion != NULL) {
-        if(curVersion->creator->id > tp->id) {
-            debug("Current transaction ID (%d) is less than version creator (%d) -- aborting", tp->id, curVersion->creator->id);
-            trans_ref(tp, "for reference to current transaction for aborting");
-            trans_abort(tp);
-            blob_unref(bp, "for aborting due to anachronistic dependency");
-            return;
-        }
-        curVersion = curVersion->next;
+    //  If the last (greatest) creator ID is greater than the transaction's, abort the transaction and return.
+    if(tail != NULL && tail->creator->id > tp->id) {
+        debug("Current transaction ID (%lu) is less than version creator (%lu) -- aborting", tp->id, tail->creator->id);
+        trans_ref(tp, "for reference to current transaction for aborting");
+        trans_abort(tp);
+        blob_unref(bp, "for aborting due to anachronistic dependency");
+        return;
+    }
+
+    //  Likewise if a newer transaction has scanned the key.
+    if(atomic_load(&mapEntry->rts) > tp->id) {
+        debug("Current transaction ID (%lu) is less than read timestamp (%lu) -- aborting", tp->id, atomic_load(&mapEntry->rts));
+        trans_ref(tp, "for reference to current transaction for aborting");
+        trans_abort(tp);
+        blob_unref(bp, "for aborting due to anachronistic dependency");
+        return;
     }
 
     //  Create a new version
     VERSION *version = version_create(tp, bp);
+    account(versionBytes(version));
 
     /*  If there are no versions in the map entry,
      *  make this the head of the list and return.
      */
-    curVersion = mapEntry->versions;
-    if(curVersion == NULL) {
+    if(tail == NULL) {
         debug("No previous version");
-        mapEntry->versions = version;
+        mapEntry->versions = mapEntry->tail = version;
+        reaper_touch(mapEntry, tp);
+        return;
+    }
+
+    //  Replace our own version, on which nothing can depend as it is the last.
+    if(tail->creator == tp) {
+        debug("Replace previous version %p of transaction %lu", tail, tp->id);
+        version->prev = tail->prev;
+        if(tail->prev == NULL) mapEntry->versions = version;
+        else tail->prev->next = version;
+        mapEntry->tail = version;
+        account(-versionBytes(tail));
+        version_dispose(tail);
         return;
     }
 
+    /*  Depend on the creators of earlier versions that have not committed.  An
+     *  aborted version may not have been collected yet, and depending on its
+     *  creator makes sure we cannot commit having seen it.  Only versions after
+     *  the known committed one need to be looked at.
+     */
+    VERSION *curVersion = mapEntry->committed != NULL ? mapEntry->committed->next : mapEntry->versions;
+    while(curVersion != NULL) {
+        if(trans_get_status(curVersion->creator) != TRANS_COMMITTED) trans_add_dependency(tp, curVersion->creator);
+        curVersion = curVersion->next;
+    }
+
+    //  Add the version to the end of the list.
+    version->prev = tail;
+    tail->next = version;
+    mapEntry->tail = version;
+    reaper_touch(mapEntry, tp);
+}
 
-    VERSION *temp = mapEntry->versions;
-    VERSION *prev;
+//  Order writes by entry, and those to the same entry in the order they were made.
+static int compareWrites(const void *a, const void *b) {
+    const WRITE *wa = a, *wb = b;
+    if(wa->entry != wb->entry) return wa->entry < wb->entry ? -1 : 1;
+    return wa->seq - wb->seq;
+}
 
-    if (temp != NULL && temp->creator->id == tp->id) {
-        mapEntry->versions = version;
-        version_dispose(temp);
-        return;
+//  Sort the writes of a transaction by entry, keeping only the last write to each.
+static void sortWrites(TRANSACTION *tp) {
+    qsort(tp->writes, tp->num_writes, sizeof(WRITE), compareWrites);
+    int n = 0;
+    for(int i = 0; i < tp->num_writes; i++) {
+        if(i + 1 < tp->num_writes && tp->writes[i + 1].entry == tp->writes[i].entry) {
+            blob_unref(tp->writes[i].value, "as value of overwritten write");
+            mapEntryUnref(tp->writes[i].entry);
+        }
+        else tp->writes[n++] = tp->writes[i];
+    }
+    tp->num_writes = n;
+}
+
+/*
+ * Look up the entry that has taken over the key of a dead one, and return it with a
+ * reference, unlocked.  Caller is in an epoch critical section.
+ */
+static MAP_ENTRY *liveMapEntry(MAP_ENTRY *dead) {
+    int owned = 0;
+    MAP_ENTRY *mapEntry = lockMapEntry(dead->key, &owned);
+    mapEntryRef(mapEntry);
+    pthread_mutex_unlock(&mapEntry->mutex);
+    return mapEntry;
+}
+
+/*
+ * Install the writes of a transaction, sorted by sortWrites(), as versions stamped
+ * with a new commit timestamp.  Caller holds the mutexes of the entries written.
+ */
+static void installWrites(TRANSACTION *tp) {
+    uint64_t ts = trans_take_commit_ts(tp);
+    debug("Install %d writes of transaction %lu at commit timestamp %lu", tp->num_writes, tp->id, ts);
+    for(int i = 0; i < tp->num_writes; i++) {
+        MAP_ENTRY *mapEntry = tp->writes[i].entry;
+        VERSION *version = version_create(tp, tp->writes[i].value);
+        version->ts = ts;
+        tp->writes[i].value = NULL;
+        account(versionBytes(version));
+
+        version->prev = mapEntry->tail;
+        if(mapEntry->tail == NULL) mapEntry->versions = version;
+        else mapEntry->tail->next = version;
+        mapEntry->tail = version;
+        reaper_touch(mapEntry, tp);
+    }
+}
+
+/*
+ * Drop the writes of a transaction being decided, installed or not.  A transaction
+ * that commits lives on as the creator of its versions, so it must not keep the
+ * entries from being freed.
+ */
+static void releaseWrites(TRANSACTION *tp) {
+    for(int i = 0; i < tp->num_writes; i++) {
+        blob_unref(tp->writes[i].value, "as value of buffered write");
+        mapEntryUnref(tp->writes[i].entry);
+    }
+    tp->num_writes = 0;
+}
+
+/*
+ * Prepare the commit of a transaction under ENGINE_MVCC (see trans_set_prepare_hook()).
+ * The entries written are locked, in order of address so that two commits cannot
+ * deadlock, and checked for a version stamped after the transaction's snapshot that
+ * has not aborted: that is a concurrent write which committed first, or is about to.
+ * If there is none, a commit timestamp is taken, still under the locks so that the
+ * versions of each entry stay in order of it, and the writes are installed.
+ */
+static TRANS_STATUS prepareWrites(TRANSACTION *tp) {
+    if(tp->num_writes == 0) return TRANS_COMMITTED;
+    epoch_enter();
+
+    //  An entry removed from the map since it was written is looked up again, and we start over.
+    int n;
+    while(1) {
+        sortWrites(tp);
+        for(n = 0; n < tp->num_writes; n++) {
+            pthread_mutex_lock(&tp->writes[n].entry->mutex);
+            if(tp->writes[n].entry->dead) break;
+        }
+        if(n == tp->num_writes) break;
+
+        MAP_ENTRY *dead = tp->writes[n].entry;
+        for(int i = n; i >= 0; i--) pthread_mutex_unlock(&tp->writes[i].entry->mutex);
+        tp->writes[n].entry = liveMapEntry(dead);
+        mapEntryUnref(dead);
     }
 
-    while(temp != NULL && temp->creator->id != tp->id) {
-        TRANS_STATUS status = trans_get_status(temp->creator);
-        if(status == TRANS_PENDING) trans_add_dependency(tp, temp->creator);
-        prev = temp;
-        temp = temp->next;
+    TRANS_STATUS status = TRANS_COMMITTED;
+    for(int i = 0; i < n && status == TRANS_COMMITTED; i++) {
+        for(VERSION *vp = tp->writes[i].entry->tail; vp != NULL && vp->ts >= tp->snapshot; vp = vp->prev) {
+            if(trans_get_status(vp->creator) != TRANS_ABORTED) {
+                debug("Transaction %lu loses a write conflict to transaction %lu -- aborting", tp->id, vp->creator->id);
+                status = TRANS_ABORTED;
+                break;
+            }
+        }
     }
+    if(status == TRANS_COMMITTED) installWrites(tp);
 
-    // Add version to end of version list
-    if(temp == NULL) {
-        prev->next = version;
-        debug("Previous version is %p [%s]", prev, prev->blob->prefix);
+    for(int i = n - 1; i >= 0; i--) pthread_mutex_unlock(&tp->writes[i].entry->mutex);
+    releaseWrites(tp);
+    epoch_exit();
+    return status;
+}
+
+//  Order entries, and reads, by address.
+static int compareEntries(const void *a, const void *b) {
+    MAP_ENTRY *ea = *(MAP_ENTRY * const *) a, *eb = *(MAP_ENTRY * const *) b;
+    return ea == eb ? 0 : ea < eb ? -1 : 1;
+}
+
+//  Stamp of the last version of an entry that has not aborted, or 0 if none.  Caller holds mapEntry->mutex.
+static uint64_t lastStamp(MAP_ENTRY *mapEntry) {
+    for(VERSION *vp = mapEntry->tail; vp != NULL; vp = vp->prev)
+        if(trans_get_status(vp->creator) != TRANS_ABORTED) return vp->ts;
+    return 0;
+}
+
+/*
+ * Check the ranges a transaction scanned under ENGINE_OCC for keys that have come
+ * into them since: entries it did not read that now have a version which has not
+ * aborted.  An entry it did not lock is only tried, and one that is busy counts as
+ * a conflict, since waiting for it could deadlock.  A key put after the check is
+ * put after the transaction, whose entries stay locked until it is decided.  The
+ * reads and the entries locked are sorted.
+ */
+static int checkScans(TRANSACTION *tp, MAP_ENTRY **locked, int num_locked) {
+    int ok = 1;
+    for(int s = 0; s < tp->num_scans && ok; s++) {
+        SCAN *sp = &tp->scans[s];
+        int count;
+        MAP_ENTRY **entries = skiplist_scan(store.ordered, sp->lo, sp->hi, sp->limit, 0, &count);
+        for(int i = 0; i < count; i++) {
+            MAP_ENTRY *mapEntry = entries[i];
+            if(ok && !bsearch(&mapEntry, tp->reads, tp->num_reads, sizeof(READ), compareEntries)) {
+                if(bsearch(&mapEntry, locked, num_locked, sizeof(MAP_ENTRY *), compareEntries)) {
+                    if(lastStamp(mapEntry) != 0) ok = 0;
+                }
+                else if(pthread_mutex_trylock(&mapEntry->mutex)) ok = 0;
+                else {
+                    if(!mapEntry->dead && lastStamp(mapEntry) != 0) ok = 0;
+                    pthread_mutex_unlock(&mapEntry->mutex);
+                }
+                if(!ok) debug("Transaction %lu finds key put in range it scanned -- aborting", tp->id);
+            }
+            mapEntryUnref(mapEntry);
+        }
+        Free(entries);
     }
-    else{
-        prev->next = temp->next;
-        version_dispose(prev);
+    return ok;
+}
+
+/*
+ * Prepare the commit of a transaction under ENGINE_OCC (see trans_set_prepare_hook()).
+ * The entries read and written are locked, in order of address as under ENGINE_MVCC,
+ * and each read is checked against the last version of its entry that has not
+ * aborted: if that is not the version read, a commit that conflicts has gone first.
+ * The ranges scanned are checked for new keys.  If all is well, the writes are
+ * installed before the locks are let go of, so that the checks and the writes take
+ * effect together.
+ */
+static TRANS_STATUS prepareOptimistic(TRANSACTION *tp) {
+    if(tp->num_reads == 0 && tp->num_writes == 0) return TRANS_COMMITTED;
+    epoch_enter();
+
+    //  The entries to lock, with an entry removed from the map replaced by its successor everywhere.
+    MAP_ENTRY **locked = Malloc((tp->num_writes + tp->num_reads) * sizeof(MAP_ENTRY *));
+    int n, num_locked;
+    while(1) {
+        sortWrites(tp);
+        qsort(tp->reads, tp->num_reads, sizeof(READ), compareEntries);
+        num_locked = 0;
+        for(int i = 0; i < tp->num_writes; i++) locked[num_locked++] = tp->writes[i].entry;
+        for(int i = 0; i < tp->num_reads; i++) locked[num_locked++] = tp->reads[i].entry;
+        qsort(locked, num_locked, sizeof(MAP_ENTRY *), compareEntries);
+        n = 0;
+        for(int i = 0; i < num_locked; i++)
+            if(n == 0 || locked[i] != locked[n - 1]) locked[n++] = locked[i];
+        num_locked = n;
+
+        for(n = 0; n < num_locked; n++) {
+            pthread_mutex_lock(&locked[n]->mutex);
+            if(locked[n]->dead) break;
+        }
+        if(n == num_locked) break;
+
+        MAP_ENTRY *dead = locked[n];
+        for(int i = n; i >= 0; i--) pthread_mutex_unlock(&locked[i]->mutex);
+        MAP_ENTRY *mapEntry = liveMapEntry(dead);
+        for(int i = 0; i < tp->num_writes; i++) {
+            if(tp->writes[i].entry != dead) continue;
+            tp->writes[i].entry = mapEntry;
+            mapEntryRef(mapEntry);
+            mapEntryUnref(dead);
+        }
+        for(int i = 0; i < tp->num_reads; i++) {
+            if(tp->reads[i].entry != dead) continue;
+            tp->reads[i].entry = mapEntry;
+            mapEntryRef(mapEntry);
+            mapEntryUnref(dead);
+        }
+        mapEntryUnref(mapEntry);
     }
-}
\ No newline at end of file
+
+    TRANS_STATUS status = TRANS_COMMITTED;
+    for(int i = 0; i < tp->num_reads; i++) {
+        if(lastStamp(tp->reads[i].entry) != tp->reads[i].ts) {
+            debug("Transaction %lu finds key it read written since -- aborting", tp->id);
+            status = TRANS_ABORTED;
+            break;
+        }
+    }
+    if(status == TRANS_COMMITTED && !checkScans(tp, locked, num_locked)) status = TRANS_ABORTED;
+    if(status == TRANS_COMMITTED) installWrites(tp);
+
+    for(int i = num_locked - 1; i >= 0; i--) pthread_mutex_unlock(&locked[i]->mutex);
+    Free(locked);
+    releaseWrites(tp);
+    trans_release_reads(tp);
+    epoch_exit();
+    return status;
+}
+
+//  Nonzero if a transaction holds the lock on an entry.  Caller holds mapEntry->mutex.
+static int holdsLock(MAP_ENTRY *mapEntry, TRANSACTION *tp) {
+    if(mapEntry->lock == NULL) return 0;
+    for(int i = 0; i < mapEntry->lock->num_holders; i++)
+        if(mapEntry->lock->holders[i] == tp) return 1;
+    return 0;
+}
+
+/*
+ * Check the ranges a transaction scanned under ENGINE_2PL for keys that have come
+ * into them since: entries it does not hold a lock on that now have a version which
+ * has not aborted.  A key put by a transaction still holding the lock on it is put
+ * after ours, since that transaction cannot commit until it has its timestamp.
+ */
+static int checkLockedScans(TRANSACTION *tp) {
+    int ok = 1;
+    for(int s = 0; s < tp->num_scans && ok; s++) {
+        SCAN *sp = &tp->scans[s];
+        int count;
+        MAP_ENTRY **entries = skiplist_scan(store.ordered, sp->lo, sp->hi, sp->limit, 0, &count);
+        for(int i = 0; i < count; i++) {
+            MAP_ENTRY *mapEntry = entries[i];
+            if(ok) {
+                pthread_mutex_lock(&mapEntry->mutex);
+                if(!mapEntry->dead && !holdsLock(mapEntry, tp) && lastStamp(mapEntry) != 0) {
+                    debug("Transaction %lu finds key put in range it scanned -- aborting", tp->id);
+                    ok = 0;
+                }
+                pthread_mutex_unlock(&mapEntry->mutex);
+            }
+            mapEntryUnref(mapEntry);
+        }
+        Free(entries);
+    }
+    return ok;
+}
+
+/*
+ * Prepare the commit of a transaction under ENGINE_2PL (see trans_set_prepare_hook()).
+ * Holding its locks, the transaction conflicts with nobody over the keys it read
+ * and wrote, and the entries it locked cannot have been removed, so only the ranges
+ * it scanned are checked for new keys.  Its writes are then installed as under
+ * ENGINE_MVCC.  The locks are let go of by releaseLocks() once it has its final status.
+ */
+static TRANS_STATUS prepareLocked(TRANSACTION *tp) {
+    epoch_enter();
+    TRANS_STATUS status = checkLockedScans(tp) ? TRANS_COMMITTED : TRANS_ABORTED;
+    if(status == TRANS_COMMITTED && tp->num_writes > 0) {
+        sortWrites(tp);
+        for(int i = 0; i < tp->num_writes; i++) pthread_mutex_lock(&tp->writes[i].entry->mutex);
+        installWrites(tp);
+        for(int i = tp->num_writes - 1; i >= 0; i--) pthread_mutex_unlock(&tp->writes[i].entry->mutex);
+    }
+    releaseWrites(tp);
+    trans_release_reads(tp);
+    epoch_exit();
+    return status;
+}
+
+/*
+ * Let go of the locks of a transaction that has committed or aborted under ENGINE_2PL
+ * (see trans_set_release_hook()), waking whoever waits for them, and wake the
+ * transaction itself if it is waiting, so that it finds it has been aborted.
+ */
+static void releaseLocks(TRANSACTION *tp) {
+    pthread_mutex_lock(&tp->mutex);
+    MAP_ENTRY **locks = tp->locks;
+    int num_locks = tp->num_locks;
+    tp->locks = NULL;
+    tp->num_locks = tp->max_locks = 0;
+    MAP_ENTRY *waiting = tp->waiting;
+    if(waiting != NULL) mapEntryRef(waiting);
+    pthread_mutex_unlock(&tp->mutex);
+
+    for(int i = 0; i < num_locks; i++) {
+        MAP_ENTRY *mapEntry = locks[i];
+        ENTRY_LOCK *lp = mapEntry->lock;
+        pthread_mutex_lock(&mapEntry->mutex);
+        for(int j = 0; j < lp->num_holders; j++) {
+            if(lp->holders[j] != tp) continue;
+            lp->holders[j] = lp->holders[--lp->num_holders];
+            break;
+        }
+        if(lp->num_holders == 0) lp->exclusive = 0;
+        if(lp->waiters) pthread_cond_broadcast(&lp->cond);
+        pthread_mutex_unlock(&mapEntry->mutex);
+        mapEntryUnref(mapEntry);
+    }
+    if(locks != NULL) Free(locks);
+
+    if(waiting != NULL) {
+        pthread_mutex_lock(&waiting->mutex);
+        pthread_cond_broadcast(&waiting->lock->cond);
+        pthread_mutex_unlock(&waiting->mutex);
+        mapEntryUnref(waiting);
+    }
+}
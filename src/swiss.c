@@ -0,0 +1,316 @@
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "swiss.h"
+#include "epoch.h"
+#include "debug.h"
+#include "csapp.h"
+
+//  Control byte values.  Full slots hold a fingerprint in 0..127.
+#define CTRL_EMPTY ((int8_t) 0x80)
+#define CTRL_DELETED ((int8_t) 0xFE)
+
+//  A shard is resized once full plus deleted slots exceed 7/8 of its capacity.
+#define MAX_LOAD_NUM 7
+#define MAX_LOAD_DEN 8
+
+/*
+ * Group probing.  groupMatch() returns a bit mask with bit i set if control
+ * byte i of the group equals the given value; groupFree() returns a mask of
+ * slots that are EMPTY or DELETED (the only control values with the sign bit set).
+ * The vector versions load the group's control bytes in one go, each byte once,
+ * which is all that relaxed loads of them one at a time would give.
+ */
+#if defined(__AVX2__)
+#define GROUP_WIDTH 32
+
+static inline uint32_t groupMatch(const _Atomic(int8_t) *ctrl, int8_t value) {
+    __m256i group = _mm256_load_si256((const __m256i *) ctrl);
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(group, _mm256_set1_epi8(value)));
+}
+
+static inline uint32_t groupFree(const _Atomic(int8_t) *ctrl) {
+    return _mm256_movemask_epi8(_mm256_load_si256((const __m256i *) ctrl));
+}
+#elif defined(__SSE2__)
+#define GROUP_WIDTH 16
+
+static inline uint32_t groupMatch(const _Atomic(int8_t) *ctrl, int8_t value) {
+    __m128i group = _mm_load_si128((const __m128i *) ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(value)));
+}
+
+static inline uint32_t groupFree(const _Atomic(int8_t) *ctrl) {
+    return _mm_movemask_epi8(_mm_load_si128((const __m128i *) ctrl));
+}
+#else
+#define GROUP_WIDTH 16
+
+static inline uint32_t groupMatch(const _Atomic(int8_t) *ctrl, int8_t value) {
+    uint32_t mask = 0;
+    for(int i = 0; i < GROUP_WIDTH; i++)
+        if(atomic_load_explicit(&ctrl[i], memory_order_relaxed) == value) mask |= 1u << i;
+    return mask;
+}
+
+static inline uint32_t groupFree(const _Atomic(int8_t) *ctrl) {
+    uint32_t mask = 0;
+    for(int i = 0; i < GROUP_WIDTH; i++)
+        if(atomic_load_explicit(&ctrl[i], memory_order_relaxed) < 0) mask |= 1u << i;
+    return mask;
+}
+#endif
+
+//  Slot and control arrays of one shard.  Replaced as a whole when the shard is resized.
+typedef struct swiss_table {
+    size_t num_groups;               // Number of groups (a power of two).
+    _Atomic(int8_t) *ctrl;           // num_groups * GROUP_WIDTH control bytes.
+    _Atomic(MAP_ENTRY *) *slots;     // num_groups * GROUP_WIDTH entry pointers.
+} SWISS_TABLE;
+
+typedef struct swiss_shard {
+    _Atomic(SWISS_TABLE *) table;
+    size_t count;                    // Number of full slots.
+    size_t deleted;                  // Number of DELETED slots.
+    pthread_mutex_t mutex;           // Mutex to protect inserts and resizes.
+} __attribute__((aligned(64))) SWISS_SHARD;
+
+struct swiss {
+    SWISS_SHARD shards[SWISS_SHARDS];
+};
+
+/*
+ * Split a key hash into the shard number (low bits), the fingerprint (top
+ * seven bits), and the bits used to choose the first group to probe.
+ */
+static inline unsigned int hashShard(KEY *key) {
+    return key->hash & (SWISS_SHARDS - 1);
+}
+
+static inline int8_t hashFingerprint(KEY *key) {
+    return key->hash >> 57;
+}
+
+static inline size_t hashGroup(KEY *key) {
+    return key->hash >> 6;
+}
+
+static void resizeShard(SWISS_SHARD *shard, size_t num_groups);
+
+//  Control bytes are read by lookups without the mutex, so they are only accessed atomically.
+static inline int8_t ctrlGet(SWISS_TABLE *tbl, size_t slot) {
+    return atomic_load_explicit(&tbl->ctrl[slot], memory_order_relaxed);
+}
+
+static inline void ctrlSet(SWISS_TABLE *tbl, size_t slot, int8_t value) {
+    atomic_store_explicit(&tbl->ctrl[slot], value, memory_order_relaxed);
+}
+
+static SWISS_TABLE *newTable(size_t num_groups) {
+    SWISS_TABLE *tbl = Malloc(sizeof(SWISS_TABLE));
+    tbl->num_groups = num_groups;
+
+    //  Control bytes are loaded a group at a time, so align them to the group width.
+    tbl->ctrl = aligned_alloc(GROUP_WIDTH, num_groups * GROUP_WIDTH);
+    if(tbl->ctrl == NULL) unix_error("aligned_alloc error");
+    for(size_t s = 0; s < num_groups * GROUP_WIDTH; s++) atomic_init(&tbl->ctrl[s], CTRL_EMPTY);
+    tbl->slots = Calloc(num_groups * GROUP_WIDTH, sizeof(MAP_ENTRY *));
+    return tbl;
+}
+
+static void tableFree(void *arg) {
+    SWISS_TABLE *tbl = arg;
+    free(tbl->ctrl);
+    Free(tbl->slots);
+    Free(tbl);
+}
+
+SWISS *swiss_init(size_t num_keys) {
+    SWISS *sp = Malloc(sizeof(SWISS));
+
+    //  Give each shard enough groups for its share of the keys at the maximum load.
+    size_t per_shard = num_keys / SWISS_SHARDS * MAX_LOAD_DEN / MAX_LOAD_NUM + 1;
+    size_t num_groups = 1;
+    while(num_groups * GROUP_WIDTH < per_shard) num_groups <<= 1;
+
+    for(int i = 0; i < SWISS_SHARDS; i++) {
+        atomic_init(&sp->shards[i].table, newTable(num_groups));
+        sp->shards[i].count = 0;
+        sp->shards[i].deleted = 0;
+        pthread_mutex_init(&sp->shards[i].mutex, 0);
+    }
+
+    debug("Initialize swiss index with %lu slots per shard (group width %d)", num_groups * GROUP_WIDTH, GROUP_WIDTH);
+    return sp;
+}
+
+void swiss_reserve(SWISS *sp, size_t num_keys) {
+    size_t per_shard = num_keys / SWISS_SHARDS * MAX_LOAD_DEN / MAX_LOAD_NUM + 1;
+
+    for(int i = 0; i < SWISS_SHARDS; i++) {
+        SWISS_SHARD *shard = &sp->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        size_t num_groups = atomic_load(&shard->table)->num_groups;
+        while(num_groups * GROUP_WIDTH < per_shard) num_groups <<= 1;
+        if(num_groups > atomic_load(&shard->table)->num_groups) resizeShard(shard, num_groups);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+void swiss_fini(SWISS *sp, void (*dispose)(MAP_ENTRY *)) {
+    for(int i = 0; i < SWISS_SHARDS; i++) {
+        SWISS_TABLE *tbl = atomic_load(&sp->shards[i].table);
+        for(size_t s = 0; s < tbl->num_groups * GROUP_WIDTH; s++)
+            if(ctrlGet(tbl, s) >= 0) dispose(tbl->slots[s]);
+        tableFree(tbl);
+    }
+    Free(sp);
+}
+
+/*
+ * Probe a table for a key.  Without the shard mutex, the control bytes may be
+ * changing under us: a stale byte can only make us miss an entry still being
+ * inserted, and the slot pointer behind a matching byte is checked before use.
+ */
+static MAP_ENTRY *probe(SWISS_TABLE *tbl, KEY *key) {
+    int8_t fingerprint = hashFingerprint(key);
+    size_t mask = tbl->num_groups - 1;
+    size_t group = hashGroup(key) & mask;
+
+    //  Triangular probing visits every group once when the number of groups is a power of two.
+    for(size_t step = 1; step <= tbl->num_groups; step++) {
+        const _Atomic(int8_t) *ctrl = tbl->ctrl + group * GROUP_WIDTH;
+        uint32_t match = groupMatch(ctrl, fingerprint);
+
+        //  Only compare keys for slots whose fingerprint matches.
+        while(match != 0) {
+            size_t slot = group * GROUP_WIDTH + __builtin_ctz(match);
+            MAP_ENTRY *mapEntry = atomic_load_explicit(&tbl->slots[slot], memory_order_acquire);
+            if(mapEntry != NULL && !key_compare(key, mapEntry->key)) return mapEntry;
+            match &= match - 1;
+        }
+
+        //  An EMPTY slot in the group means the key would have been placed no further on.
+        if(groupMatch(ctrl, CTRL_EMPTY)) return NULL;
+        group = (group + step) & mask;
+    }
+    return NULL;
+}
+
+MAP_ENTRY *swiss_lookup(SWISS *sp, KEY *key) {
+    SWISS_SHARD *shard = &sp->shards[hashShard(key)];
+    return probe(atomic_load_explicit(&shard->table, memory_order_acquire), key);
+}
+
+//  Find the first EMPTY or DELETED slot on the key's probe sequence.
+static size_t findFree(SWISS_TABLE *tbl, KEY *key) {
+    size_t mask = tbl->num_groups - 1;
+    size_t group = hashGroup(key) & mask;
+
+    for(size_t step = 1; ; step++) {
+        uint32_t free = groupFree(tbl->ctrl + group * GROUP_WIDTH);
+        if(free != 0) return group * GROUP_WIDTH + __builtin_ctz(free);
+        group = (group + step) & mask;
+    }
+}
+
+//  Caller holds shard->mutex.
+static void resizeShard(SWISS_SHARD *shard, size_t num_groups) {
+    SWISS_TABLE *old = atomic_load(&shard->table);
+    SWISS_TABLE *tbl = newTable(num_groups);
+
+    debug("Resize swiss shard %p from %lu to %lu slots (%lu entries)", shard, old->num_groups * GROUP_WIDTH, num_groups * GROUP_WIDTH, shard->count);
+
+    //  Rehash every full slot; the keys are known to be distinct, so no comparisons are needed.
+    for(size_t s = 0; s < old->num_groups * GROUP_WIDTH; s++) {
+        if(ctrlGet(old, s) < 0) continue;
+        MAP_ENTRY *mapEntry = old->slots[s];
+        size_t slot = findFree(tbl, mapEntry->key);
+        ctrlSet(tbl, slot, ctrlGet(old, s));
+        atomic_init(&tbl->slots[slot], mapEntry);
+    }
+    shard->deleted = 0;
+
+    //  Lookups may still be probing the old arrays.
+    atomic_store_explicit(&shard->table, tbl, memory_order_release);
+    epoch_retire(old, tableFree);
+}
+
+MAP_ENTRY *swiss_insert(SWISS *sp, MAP_ENTRY *mapEntry) {
+    KEY *key = mapEntry->key;
+    SWISS_SHARD *shard = &sp->shards[hashShard(key)];
+    pthread_mutex_lock(&shard->mutex);
+
+    //  Somebody else may have inserted the key since the lock-free lookup.
+    SWISS_TABLE *tbl = atomic_load(&shard->table);
+    MAP_ENTRY *existing = probe(tbl, key);
+    if(existing != NULL) {
+        pthread_mutex_unlock(&shard->mutex);
+        return existing;
+    }
+
+    //  Grow if the shard is too full; just clean out DELETED slots if that is enough.
+    size_t capacity = tbl->num_groups * GROUP_WIDTH;
+    if((shard->count + shard->deleted + 1) * MAX_LOAD_DEN > capacity * MAX_LOAD_NUM) {
+        if((shard->count + 1) * MAX_LOAD_DEN * 2 > capacity * MAX_LOAD_NUM) resizeShard(shard, tbl->num_groups * 2);
+        else resizeShard(shard, tbl->num_groups);
+        tbl = atomic_load(&shard->table);
+    }
+
+    //  Publish the entry before its fingerprint, so a matching lookup finds it.
+    size_t slot = findFree(tbl, key);
+    if(ctrlGet(tbl, slot) == CTRL_DELETED) shard->deleted--;
+    atomic_store_explicit(&tbl->slots[slot], mapEntry, memory_order_release);
+    ctrlSet(tbl, slot, hashFingerprint(key));
+    shard->count++;
+
+    pthread_mutex_unlock(&shard->mutex);
+    return mapEntry;
+}
+
+int swiss_remove(SWISS *sp, MAP_ENTRY *mapEntry) {
+    KEY *key = mapEntry->key;
+    SWISS_SHARD *shard = &sp->shards[hashShard(key)];
+    pthread_mutex_lock(&shard->mutex);
+
+    SWISS_TABLE *tbl = atomic_load(&shard->table);
+    int8_t fingerprint = hashFingerprint(key);
+    size_t mask = tbl->num_groups - 1;
+    size_t group = hashGroup(key) & mask;
+    int found = 0;
+
+    for(size_t step = 1; step <= tbl->num_groups && !found; step++) {
+        const _Atomic(int8_t) *ctrl = tbl->ctrl + group * GROUP_WIDTH;
+        uint32_t match = groupMatch(ctrl, fingerprint);
+
+        while(match != 0) {
+            size_t slot = group * GROUP_WIDTH + __builtin_ctz(match);
+            if(atomic_load(&tbl->slots[slot]) == mapEntry) {
+                //  Hide the fingerprint first, so lookups stop finding the slot.
+                ctrlSet(tbl, slot, CTRL_DELETED);
+                atomic_store_explicit(&tbl->slots[slot], NULL, memory_order_release);
+                shard->count--;
+                shard->deleted++;
+                found = 1;
+                break;
+            }
+            match &= match - 1;
+        }
+
+        if(groupMatch(ctrl, CTRL_EMPTY)) break;
+        group = (group + step) & mask;
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+    return found;
+}
+
+void swiss_show(SWISS *sp, void (*show)(MAP_ENTRY *)) {
+    for(int i = 0; i < SWISS_SHARDS; i++) {
+        SWISS_TABLE *tbl = atomic_load(&sp->shards[i].table);
+        fprintf(stderr, "shard %d (%lu entries, %lu slots):\n", i, sp->shards[i].count, tbl->num_groups * GROUP_WIDTH);
+        for(size_t s = 0; s < tbl->num_groups * GROUP_WIDTH; s++)
+            if(ctrlGet(tbl, s) >= 0) show(tbl->slots[s]);
+    }
+}
@@ -0,0 +1,166 @@
+#include <time.h>
+#include <pthread.h>
+#include "timer.h"
+#include "debug.h"
+#include "csapp.h"
+
+//  A timer that has fired, with its function, which is called after the wheel is unlocked.
+typedef struct fired {
+    void (*fire)(void *arg);
+    void *arg;
+} FIRED;
+
+static struct {
+    TIMER slots[TIMER_SLOTS];  // Sentinels of the slots.
+    uint64_t tick;             // Last tick whose slot has been looked at.
+    int armed;                 // Number of timers on the wheel.
+    int stop;                  // Set to make the thread exit.
+    struct timespec start;     // When the wheel was started.
+    pthread_t tid;
+    pthread_mutex_t mutex;     // Mutex to protect the wheel.
+    pthread_cond_t cond;       // Signalled when the first timer is armed, or to stop.
+} wheel = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+uint64_t timer_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec - wheel.start.tv_sec) * 1000 + (ts.tv_nsec - wheel.start.tv_nsec) / 1000000;
+}
+
+static void timerUnlink(TIMER *tmp) {
+    tmp->prev->next = tmp->next;
+    tmp->next->prev = tmp->prev;
+    tmp->armed = 0;
+    wheel.armed--;
+}
+
+static void *timerThread(void *arg) {
+    FIRED *fired = NULL;
+    int max_fired = 0;
+    debug("Timer thread starting");
+
+    pthread_mutex_lock(&wheel.mutex);
+    while(!wheel.stop) {
+        if(wheel.armed == 0) {
+            pthread_cond_wait(&wheel.cond, &wheel.mutex);
+            continue;
+        }
+
+        //  Sleep until the next tick is due.
+        uint64_t due = (wheel.tick + 1) * TIMER_TICK_MS;
+        struct timespec ts = wheel.start;
+        ts.tv_sec += due / 1000;
+        ts.tv_nsec += (due % 1000) * 1000000L;
+        if(ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wheel.cond, &wheel.mutex, &ts);
+
+        /*  Look at the slot of every tick that has gone by, each slot only once however
+         *  late we are, and take the timers that are due off the wheel.
+         */
+        uint64_t now = timer_now() / TIMER_TICK_MS;
+        uint64_t tick = now - wheel.tick > TIMER_SLOTS ? now - TIMER_SLOTS : wheel.tick;
+        int num_fired = 0;
+        while(tick < now) {
+            tick++;
+            TIMER *head = &wheel.slots[tick & (TIMER_SLOTS - 1)];
+            TIMER *cur = head->next;
+            while(cur != head) {
+                TIMER *next = cur->next;
+                if(cur->expires <= now) {
+                    timerUnlink(cur);
+                    if(num_fired == max_fired) {
+                        max_fired = max_fired ? max_fired * 2 : 64;
+                        fired = Realloc(fired, max_fired * sizeof(FIRED));
+                    }
+                    fired[num_fired++] = (FIRED){ cur->fire, cur->arg };
+                }
+                cur = next;
+            }
+        }
+        wheel.tick = now;
+
+        //  Call the functions without the lock, so that they can arm timers again.
+        if(num_fired > 0) {
+            pthread_mutex_unlock(&wheel.mutex);
+            for(int i = 0; i < num_fired; i++) fired[i].fire(fired[i].arg);
+            pthread_mutex_lock(&wheel.mutex);
+        }
+    }
+    pthread_mutex_unlock(&wheel.mutex);
+
+    if(fired != NULL) Free(fired);
+    debug("Timer thread exiting");
+    return NULL;
+}
+
+void timer_init() {
+    for(int i = 0; i < TIMER_SLOTS; i++) {
+        wheel.slots[i].next = &wheel.slots[i];
+        wheel.slots[i].prev = &wheel.slots[i];
+    }
+    wheel.tick = 0;
+    wheel.armed = 0;
+    wheel.stop = 0;
+    clock_gettime(CLOCK_MONOTONIC, &wheel.start);
+
+    //  Deadlines are on the monotonic clock, like the ticks.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wheel.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    Pthread_create(&wheel.tid, NULL, timerThread, NULL);
+    debug("Initialize timer wheel");
+}
+
+void timer_fini() {
+    pthread_mutex_lock(&wheel.mutex);
+    wheel.stop = 1;
+    pthread_cond_signal(&wheel.cond);
+    pthread_mutex_unlock(&wheel.mutex);
+    Pthread_join(wheel.tid, NULL);
+
+    pthread_cond_destroy(&wheel.cond);
+    debug("Finalize timer wheel");
+}
+
+int timer_arm(TIMER *tmp, long ms, void (*fire)(void *arg), void *arg) {
+    uint64_t expires = (timer_now() + ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    pthread_mutex_lock(&wheel.mutex);
+    int was_armed = tmp->armed;
+    if(was_armed) timerUnlink(tmp);
+
+    //  An idle wheel has nothing to catch up on, so its ticks start again from now.
+    if(wheel.armed == 0) {
+        wheel.tick = timer_now() / TIMER_TICK_MS;
+        pthread_cond_signal(&wheel.cond);
+    }
+    if(expires <= wheel.tick) expires = wheel.tick + 1;
+
+    tmp->expires = expires;
+    tmp->fire = fire;
+    tmp->arg = arg;
+    TIMER *head = &wheel.slots[expires & (TIMER_SLOTS - 1)];
+    tmp->next = head;
+    tmp->prev = head->prev;
+    head->prev->next = tmp;
+    head->prev = tmp;
+    tmp->armed = 1;
+    wheel.armed++;
+    pthread_mutex_unlock(&wheel.mutex);
+
+    return was_armed;
+}
+
+int timer_cancel(TIMER *tmp) {
+    pthread_mutex_lock(&wheel.mutex);
+    int was_armed = tmp->armed;
+    if(was_armed) timerUnlink(tmp);
+    pthread_mutex_unlock(&wheel.mutex);
+    return was_armed;
+}
@@ -1,52 +1,428 @@
+#include <sched.h>
+#include <time.h>
+#include <sys/random.h>
 #include "transaction.h"
+#include "store.h"
+#include "helpers.h"
 #include "debug.h"
 #include "csapp.h"
 
-int trans_ID = 0;
+/*  Next transaction ID.  IDs are 64 bits wide, so that they never wrap, and the
+ *  counter can be read without locking.
+ */
+static _Atomic uint64_t trans_ID = 0;
+
+#ifndef NO_TRANS_REGISTRY
+//  A list of the registry, and the mutex protecting it.
+static struct {
+    TRANSACTION head;
+    pthread_mutex_t mutex;
+} __attribute__((aligned(64))) registry[TRANS_SHARDS];
+
+//  List of the registry used by the calling thread, and the next to be handed out.
+static __thread int my_shard = -1;
+static atomic_int next_shard;
+#endif
+
+/*  Pending transactions, in order of ID, and the mutex protecting the list.  IDs are
+ *  taken from the counter under the same mutex, so a new transaction always goes on
+ *  the end, and no ID below the head of the list can still be handed out.
+ */
+static TRANSACTION pending_list = { .pending_next = &pending_list, .pending_prev = &pending_list };
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*  Transactions reading a snapshot, in order of snapshot, also under pending_mutex, and
+ *  the smallest snapshot on the list, stored whenever the head of the list changes.
+ */
+static TRANSACTION snapshot_list = { .pending_next = &snapshot_list, .pending_prev = &snapshot_list };
+static _Atomic uint64_t snapshot_horizon = UINT64_MAX;
+
+//  ID of the oldest transaction on the pending list, or at most the next ID if there is none.
+static _Atomic uint64_t oldest_pending;
+
+//  The calling thread's free list, linked through next, and its length.
+static __thread TRANSACTION *local_pool;
+static __thread int local_count;
+static __thread int local_registered;
+
+//  The shared free list, and the mutex protecting it.
+static TRANSACTION *shared_pool;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//  Key whose destructor hands the free list of an exiting thread to the shared list.
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+//  The concurrency-control engine.
+static int engine = ENGINE_ORDERED;
+
+/*  The last commit timestamp taken, and the last published: every commit with a timestamp
+ *  up to that one has its final status.
+ */
+static _Atomic uint64_t commit_clock;
+static _Atomic uint64_t published_ts;
+
+//  Function called when a transaction commits or aborts.
+static void (*completion_hook)(TRANSACTION *tp);
+
+//  Function called after the completion hook, to release what the engine holds.
+static void (*release_hook)(TRANSACTION *tp);
+
+//  Function called to prepare a transaction that can commit.
+static TRANS_STATUS (*prepare_hook)(TRANSACTION *tp);
+
+//  Timeouts given to new transactions, and the number of transactions aborted by each.
+static long default_idle_ms;
+static long default_commit_ms;
+static atomic_long idle_aborts;
+static atomic_long wounds;
+static atomic_long retries;
+static atomic_long cascades;
+
+//  Secret key of the MAC that authenticates retry tokens.
+static uint64_t token_key[2];
+
+//  The ID (plus one, so that 0 marks a free slot) and issue time of a redeemed retry token.
+typedef struct redeemed {
+    uint64_t id;
+    uint64_t issued;
+} REDEEMED;
+
+/*  Retry tokens redeemed, in a hash table on the ID of the transaction that aborted, which is
+ *  rebuilt without those that have expired when it gets half full.
+ */
+static struct {
+    REDEEMED *table;
+    int capacity;
+    int count;
+    pthread_mutex_t mutex;
+} redeemed = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+static atomic_long commit_aborts;
+
+/*  Transactions whose last dependency the calling thread has resolved, linked through
+ *  ready_next, to be decided one after another rather than by recursion, since deciding
+ *  one can resolve the last dependency of others in turn.
+ */
+static __thread TRANSACTION *ready_head;
+static __thread TRANSACTION *ready_tail;
+static __thread int deciding;
+
+//  Committing transactions the calling thread has aborted early, linked through doomed_next.
+static __thread TRANSACTION *doomed_head;
+
+//  Depth of trans_defer_decisions() calls in the calling thread, during which the ready ones wait.
+static __thread int deferring;
+
+//  Move up to count objects from the front of the calling thread's free list to the shared list.
+static void releaseLocal(int count) {
+    if(local_pool == NULL) return;
+    TRANSACTION *first = local_pool, *last = local_pool;
+    int n = 1;
+    while(n < count && last->next != NULL) {
+        last = last->next;
+        n++;
+    }
+    local_pool = last->next;
+    local_count -= n;
+
+    pthread_mutex_lock(&pool_mutex);
+    last->next = shared_pool;
+    shared_pool = first;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+static void poolDestructor(void *arg) {
+    releaseLocal(local_count);
+}
+
+static void poolKeyInit() {
+    pthread_key_create(&pool_key, poolDestructor);
+}
+
+//  Take up to count objects from the shared list for the calling thread's free list.
+static void refillLocal(int count) {
+    pthread_mutex_lock(&pool_mutex);
+    while(count-- > 0 && shared_pool != NULL) {
+        TRANSACTION *tp = shared_pool;
+        shared_pool = tp->next;
+        tp->next = local_pool;
+        local_pool = tp;
+        local_count++;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+//  Get a transaction object, recycled if possible, with its mutex initialized.
+static TRANSACTION *allocTrans() {
+    if(local_pool == NULL) refillLocal(TRANS_POOL_LOCAL / 2);
+
+    TRANSACTION *tp = local_pool;
+    if(tp != NULL) {
+        local_pool = tp->next;
+        local_count--;
+        return tp;
+    }
+
+    tp = Malloc(sizeof(TRANSACTION));
+    tp->generation = 0;
+    tp->touched = NULL;
+    tp->locks = NULL;
+    tp->writes = NULL;
+    tp->reads = NULL;
+    tp->scans = NULL;
+    tp->dependents = NULL;
+    tp->timer.armed = 0;
+
+    // Initialize mutex
+    pthread_mutex_init(&tp->mutex, 0);
+    return tp;
+}
+
+//  Put an object whose last reference has gone on the calling thread's free list.
+static void freeTrans(TRANSACTION *tp) {
+    tp->generation++;
+    if(!local_registered) {
+        pthread_once(&pool_once, poolKeyInit);
+        pthread_setspecific(pool_key, &local_pool);
+        local_registered = 1;
+    }
+
+    tp->next = local_pool;
+    local_pool = tp;
+    if(++local_count > TRANS_POOL_LOCAL) releaseLocal(TRANS_POOL_LOCAL / 2);
+}
+
+//  Really free the objects on a free list.
+static void disposePool(TRANSACTION *tp) {
+    while(tp != NULL) {
+        TRANSACTION *next = tp->next;
+        pthread_mutex_destroy(&tp->mutex);
+        Free(tp);
+        tp = next;
+    }
+}
 
 void trans_init() {
-    // Initialize sentinel to point to itself
-    trans_list.next = &trans_list;
-    trans_list.prev = &trans_list;
+#ifndef NO_TRANS_REGISTRY
+    // Initialize sentinels to point to themselves
+    for(int i = 0; i < TRANS_SHARDS; i++) {
+        registry[i].head.next = &registry[i].head;
+        registry[i].head.prev = &registry[i].head;
+        pthread_mutex_init(&registry[i].mutex, 0);
+    }
+#endif
+    if(getrandom(token_key, sizeof(token_key), 0) != sizeof(token_key)) {
+        token_key[0] = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+        token_key[1] = (uint64_t) clock() ^ (uintptr_t) &token_key;
+    }
+    timer_init();
     debug("Initialize transaction manager");
 }
 
 void trans_fini() {
-    // Finalize sentinel to point to itself
-    trans_list.next = &trans_list;
-    trans_list.prev = &trans_list;
+    timer_fini();
+
+#ifndef NO_TRANS_REGISTRY
+    // Finalize sentinels to point to themselves
+    for(int i = 0; i < TRANS_SHARDS; i++) {
+        registry[i].head.next = &registry[i].head;
+        registry[i].head.prev = &registry[i].head;
+    }
+#endif
+
+    // Free the pooled objects of the calling thread, and those of threads that have exited
+    disposePool(local_pool);
+    local_pool = NULL;
+    local_count = 0;
+    pthread_mutex_lock(&pool_mutex);
+    disposePool(shared_pool);
+    shared_pool = NULL;
+    pthread_mutex_unlock(&pool_mutex);
+
+    if(redeemed.table != NULL) Free(redeemed.table);
+    redeemed.table = NULL;
+    redeemed.capacity = redeemed.count = 0;
     debug("Finalize transaction manager");
 }
 
-TRANSACTION *trans_create() {
-    TRANSACTION *tp = Malloc(sizeof(TRANSACTION));
-    tp->id = trans_ID++;
-    tp->refcnt = 0;
-    tp->status = TRANS_PENDING;
-    tp->depends = NULL;
-    tp->waitcnt = 0;
+//  Put a new transaction on the calling thread's list of the registry.
+static void registerTrans(TRANSACTION *tp) {
+#ifndef NO_TRANS_REGISTRY
+    if(my_shard < 0) my_shard = atomic_fetch_add(&next_shard, 1) % TRANS_SHARDS;
+    tp->shard = my_shard;
 
-    // Initalize semaphore
-    Sem_init(&tp->sem, 0, 0);
+    pthread_mutex_lock(&registry[tp->shard].mutex);
+    TRANSACTION *head = &registry[tp->shard].head;
+    tp->next = head;
+    tp->prev = head->prev;
+    head->prev->next = tp;
+    head->prev = tp;
+    pthread_mutex_unlock(&registry[tp->shard].mutex);
+#endif
+}
 
-    // Initialize mutex
-    pthread_mutex_init(&tp->mutex, 0);
+//  Take a transaction being freed off its list of the registry, whichever thread frees it.
+static void unregisterTrans(TRANSACTION *tp) {
+#ifndef NO_TRANS_REGISTRY
+    pthread_mutex_lock(&registry[tp->shard].mutex);
+    tp->prev->next = tp->next;
+    tp->next->prev = tp->prev;
+    pthread_mutex_unlock(&registry[tp->shard].mutex);
+#endif
+}
+
+//  The slots of a dependency set, some of which may be empty in a table.
+static DEPENDENCY *depEntries(DEPENDENCY_SET *ds, int *sizep) {
+    *sizep = ds->capacity ? ds->capacity : ds->count;
+    return ds->capacity ? ds->table : ds->array;
+}
+
+//  Slot in a table that holds a transaction, or the empty slot where it would go.
+static DEPENDENCY *depSlot(DEPENDENCY_SET *ds, TRANSACTION *dtp) {
+    //  Transactions are pooled objects of one size, so mix the address bits.
+    unsigned int mask = ds->capacity - 1;
+    unsigned int i = ((uintptr_t) dtp >> 4) * 0x9E3779B97F4A7C15ULL >> 32 & mask;
+    while(ds->table[i].trans != NULL && ds->table[i].trans != dtp) i = (i + 1) & mask;
+    return &ds->table[i];
+}
+
+static DEPENDENCY *depFind(DEPENDENCY_SET *ds, TRANSACTION *dtp) {
+    if(ds->capacity) {
+        DEPENDENCY *dp = depSlot(ds, dtp);
+        return dp->trans != NULL ? dp : NULL;
+    }
+    for(int i = 0; i < ds->count; i++) {
+        if(ds->array[i].trans == dtp) return &ds->array[i];
+    }
+    return NULL;
+}
+
+//  Move the dependencies of a set into a new table.
+static void depResize(DEPENDENCY_SET *ds, int capacity) {
+    int size;
+    DEPENDENCY *deps = depEntries(ds, &size);
+    DEPENDENCY *old = ds->table;
+
+    ds->table = Calloc(capacity, sizeof(DEPENDENCY));
+    ds->capacity = capacity;
+    for(int i = 0; i < size; i++) {
+        if(deps[i].trans != NULL) *depSlot(ds, deps[i].trans) = deps[i];
+    }
+    if(old != NULL) Free(old);
+}
+
+//  Drop the committed dependencies of a set, and return the number left.
+static int depPrune(DEPENDENCY_SET *ds) {
+    int size, live = 0, count = ds->count;
+    DEPENDENCY *deps = depEntries(ds, &size);
+    for(int i = 0; i < size; i++) {
+        if(deps[i].trans == NULL) continue;
+        if(trans_get_status(deps[i].trans) != TRANS_COMMITTED) {
+            live++;
+            continue;
+        }
+        trans_check(deps[i].trans, deps[i].generation);
+        trans_unref(deps[i].trans, "as committed transaction in dependency");
+        deps[i].trans = NULL;
+    }
+    ds->count = live;
+
+    //  Close up the array, or rehash the table so that no probe runs across a hole.
+    if(ds->capacity == 0) {
+        int j = 0;
+        for(int i = 0; i < size; i++) {
+            if(deps[i].trans != NULL) deps[j++] = deps[i];
+        }
+    } else if(live < count) {
+        depResize(ds, ds->capacity);
+    }
+    return live;
+}
+
+static void transExpired(void *arg);
+static void abortDependent(TRANSACTION *tp);
+
+//  Arm the timer of a transaction, which holds a reference while it is armed.
+static void armTimer(TRANSACTION *tp, long ms) {
+    trans_ref(tp, "for armed timer");
+    if(timer_arm(&tp->timer, ms, transExpired, tp)) trans_unref(tp, "for timer armed already");
+}
+
+static TRANSACTION *createTrans(int read_only) {
+    TRANSACTION *tp = allocTrans();
+    tp->refcnt = 0;
+    tp->read_only = read_only;
+    tp->snapshot = 0;
+    tp->commit_ts = 0;
+    tp->num_writes = 0;
+    tp->max_writes = 0;
+    tp->num_reads = 0;
+    tp->max_reads = 0;
+    tp->num_scans = 0;
+    tp->max_scans = 0;
+    atomic_init(&tp->status, TRANS_PENDING);
+    tp->depends.count = 0;
+    tp->depends.capacity = 0;
+    tp->depends.table = NULL;
+    atomic_init(&tp->unresolved, 0);
+    tp->num_dependents = 0;
+    tp->max_dependents = 0;
+    tp->on_commit = NULL;
+    tp->commit_arg = NULL;
+    atomic_init(&tp->reported, 0);
+    tp->idle_ms = default_idle_ms;
+    tp->commit_ms = default_commit_ms;
+    atomic_init(&tp->last_active, tp->idle_ms ? timer_now() : 0);
+    tp->commit_due = 0;
+    tp->num_touched = 0;
+    tp->max_touched = 0;
+    tp->num_locks = 0;
+    tp->max_locks = 0;
+    tp->waiting = NULL;
+
+    /*  Assign the ID and insert new transaction at the end of the pending list, or of
+     *  the snapshot list, whose order is kept as snapshots never go backwards.
+     */
+    pthread_mutex_lock(&pending_mutex);
+    tp->id = atomic_fetch_add(&trans_ID, 1);
+    tp->priority = tp->id;
+    TRANSACTION *list = &pending_list;
+    if(engine == ENGINE_MVCC || (engine != ENGINE_ORDERED && read_only)) {
+        tp->snapshot = atomic_load(&published_ts) + 1;
+        list = &snapshot_list;
+        if(snapshot_list.pending_next == &snapshot_list) atomic_store(&snapshot_horizon, tp->snapshot);
+    }
+    else if(read_only) {
+        tp->snapshot = pending_list.pending_next != &pending_list ? pending_list.pending_next->id : tp->id;
+        list = &snapshot_list;
+        if(snapshot_list.pending_next == &snapshot_list) atomic_store(&snapshot_horizon, tp->snapshot);
+    }
+    else if(pending_list.pending_next == &pending_list) atomic_store(&oldest_pending, tp->id);
+    tp->pending_next = list;
+    tp->pending_prev = list->pending_prev;
+    list->pending_prev->pending_next = tp;
+    list->pending_prev = tp;
+    pthread_mutex_unlock(&pending_mutex);
 
-    // Traverse transaction list and insert new transaction
-    TRANSACTION *last = trans_list.prev;
-    tp->next = &trans_list;
-    trans_list.prev = tp;
-    tp->prev = last;
-    last->next = tp;
+    registerTrans(tp);
 
-    debug("Create new transaction %d", tp->id);
+    debug("Create new transaction %lu", tp->id);
 
     //  Increment ref count by 1.
     trans_ref(tp, "for newly created transaction");
 
+    if(tp->idle_ms) armTimer(tp, tp->idle_ms);
     return tp;
 }
 
+TRANSACTION *trans_create() {
+    return createTrans(0);
+}
+
+TRANSACTION *trans_create_read_only() {
+    return createTrans(1);
+}
+
 TRANSACTION *trans_ref(TRANSACTION *tp, char *why) {
     if(tp == NULL) return NULL;
     // Lock
@@ -58,7 +434,7 @@ TRANSACTION *trans_ref(TRANSACTION *tp, char *why) {
     // Unlock
     pthread_mutex_unlock(&tp->mutex);
 
-    debug("Increase ref count on transaction %d (%d -> %d) %s", tp->id, tp->refcnt - 1, tp->refcnt, why);
+    debug("Increase ref count on transaction %lu (%d -> %d) %s", tp->id, tp->refcnt - 1, tp->refcnt, why);
 
     return tp;
 }
@@ -68,19 +444,11 @@ void trans_unref(TRANSACTION *tp, char *why) {
     // Lock
     pthread_mutex_lock(&tp->mutex);
 
-    // Decrease ref count
-    tp->refcnt--;
-
-    // Unlock
-    pthread_mutex_unlock(&tp->mutex);
+    // Decrease ref count and obtain the new value, so only one thread sees it reach zero.
+    int val = --tp->refcnt;
 
-    debug("Decrease ref count on transaction %d (%d -> %d) %s", tp->id, tp->refcnt + 1, tp->refcnt, why);
-
-    int val;
-    pthread_mutex_lock(&tp->mutex);
-
-    // Obtain ref count.
-    val = tp->refcnt;
+    //  Once the mutex is released, the object may be recycled by the thread that freed it.
+    debug("Decrease ref count on transaction %lu (%d -> %d) %s", tp->id, val + 1, val, why);
 
     // Unlock
     pthread_mutex_unlock(&tp->mutex);
@@ -90,196 +458,617 @@ void trans_unref(TRANSACTION *tp, char *why) {
      *  transaction.
      */
     if(val == 0) {
-        debug("Free transaction %d", tp->id);
-        DEPENDENCY *dcur = tp->depends;
-        while(dcur != NULL) {
-            DEPENDENCY *next = dcur->next;
-            trans_unref(dcur->trans, "as transaction in dependency");
-            Free(dcur);
-            dcur = next;
+        debug("Free transaction %lu", tp->id);
+        int size;
+        DEPENDENCY *deps = depEntries(&tp->depends, &size);
+        for(int i = 0; i < size; i++) {
+            if(deps[i].trans == NULL) continue;
+            trans_check(deps[i].trans, deps[i].generation);
+            trans_unref(deps[i].trans, "as transaction in dependency");
         }
+        if(tp->depends.table != NULL) Free(tp->depends.table);
 
-        TRANSACTION *cur = trans_list.next;
-        while(cur != &trans_list) {
-            if(cur == tp) {
-                TRANSACTION *next = cur->next;
-                TRANSACTION *prev = cur->prev;
-                prev->next = next;
-                next->prev = prev;
-                break;
-            }
-            cur = cur->next;
+        //  Drop the writes that were buffered and never installed.
+        for(int i = 0; i < tp->num_writes; i++) {
+            blob_unref(tp->writes[i].value, "as value of buffered write");
+            mapEntryUnref(tp->writes[i].entry);
         }
+        if(tp->writes != NULL) Free(tp->writes);
+        tp->writes = NULL;
+        trans_release_reads(tp);
+        if(tp->reads != NULL) Free(tp->reads);
+        tp->reads = NULL;
+        if(tp->scans != NULL) Free(tp->scans);
+        tp->scans = NULL;
 
-        Free(tp);
+        unregisterTrans(tp);
+
+        if(tp->touched != NULL) Free(tp->touched);
+        tp->touched = NULL;
+        if(tp->locks != NULL) Free(tp->locks);
+        tp->locks = NULL;
+        if(tp->dependents != NULL) Free(tp->dependents);
+        tp->dependents = NULL;
+        freeTrans(tp);
     }
 }
 
 void trans_add_dependency(TRANSACTION *tp, TRANSACTION *dtp) {
-    //  If the transaction doesn't have a dependency, create a head.
-    if(tp->depends == NULL) {
-        DEPENDENCY *head = Malloc(sizeof(DEPENDENCY));
-        head->trans = dtp;
-        head->next = NULL;
+    DEPENDENCY_SET *ds = &tp->depends;
 
-        tp->depends = head;
+    //  Nothing to do if the dependency is already in the set, or has committed.
+    if(depFind(ds, dtp) != NULL) return;
+    if(trans_get_status(dtp) == TRANS_COMMITTED) return;
 
-        debug("Make transaction %d dependent on transaction %d", tp->id, dtp->id);
-        trans_ref(dtp, "for transaction in dependency");
+    //  Make room, by dropping committed dependencies and growing if that is not enough.
+    if(ds->capacity == 0 ? ds->count == DEPS_INLINE : (ds->count + 1) * 2 > ds->capacity) {
+        int live = depPrune(ds);
+        if(ds->capacity == 0 ? live == DEPS_INLINE : (live + 1) * 2 > ds->capacity)
+            depResize(ds, ds->capacity ? ds->capacity * 2 : DEPS_INLINE * 4);
     }
-    //  Else, append the dependency to the end of the dependency list.
-    else {
-        DEPENDENCY *newHead = Malloc(sizeof(DEPENDENCY));
-        newHead->trans = dtp;
-        newHead->next = tp->depends;
-        tp->depends = newHead;
 
-        debug("Make transaction %d dependent on transaction %d", tp->id, dtp->id);
-        trans_ref(dtp, "for transaction in dependency");
+    DEPENDENCY *dp = ds->capacity ? depSlot(ds, dtp) : &ds->array[ds->count];
+    dp->trans = dtp;
+    dp->generation = dtp->generation;
+    dp->edge = -1;
+    ds->count++;
+
+    debug("Make transaction %lu dependent on transaction %lu", tp->id, dtp->id);
+    trans_ref(dtp, "for transaction in dependency");
+
+    /*  Leave an edge back on the dependency, so that its abort aborts us at once, and which a
+     *  commit later makes count.  The status check and the edge are made under the same lock;
+     *  if it has aborted already, so are we.  The edge's reference is taken before the lock,
+     *  so that only one mutex is held at a time.
+     */
+    trans_ref(tp, "as dependent of pending transaction");
+    pthread_mutex_lock(&dtp->mutex);
+    TRANS_STATUS status = atomic_load_explicit(&dtp->status, memory_order_relaxed);
+    if(status == TRANS_PENDING) {
+        if(dtp->num_dependents == dtp->max_dependents) {
+            dtp->max_dependents = dtp->max_dependents ? dtp->max_dependents * 2 : 4;
+            dtp->dependents = Realloc(dtp->dependents, dtp->max_dependents * sizeof(DEPENDENT));
+        }
+        dp->edge = dtp->num_dependents++;
+        dtp->dependents[dp->edge] = (DEPENDENT){ .trans = tp, .counted = 0 };
     }
+    pthread_mutex_unlock(&dtp->mutex);
+    if(status == TRANS_PENDING) return;
+
+    if(status == TRANS_ABORTED) abortDependent(tp);
+    trans_unref(tp, "as dependent of finished transaction");
 }
 
-TRANS_STATUS trans_commit(TRANSACTION *tp) {
-    debug("Transaction %d trying to commit", tp->id);
+//  Take a transaction that has just left the pending state off the pending or snapshot list.
+static void removePending(TRANSACTION *tp) {
+    pthread_mutex_lock(&pending_mutex);
+    tp->pending_prev->pending_next = tp->pending_next;
+    tp->pending_next->pending_prev = tp->pending_prev;
+    if((tp->read_only || engine == ENGINE_MVCC) && tp->pending_prev == &snapshot_list)
+        atomic_store(&snapshot_horizon, tp->pending_next != &snapshot_list ? tp->pending_next->snapshot : UINT64_MAX);
+    else if(tp->pending_prev == &pending_list)
+        atomic_store(&oldest_pending, tp->pending_next != &pending_list ? tp->pending_next->id : atomic_load(&trans_ID));
+    pthread_mutex_unlock(&pending_mutex);
+}
 
-    DEPENDENCY *cur = tp->depends;
+static void decide(TRANSACTION *tp);
 
-    /*  Increment the wait count of all transactions in the dependency set,
-     *  and call P on each transactions semaphore to wait for those transactions
-     *  to complete.
-     */
-    while(cur != NULL) {
-        if(trans_get_status(cur->trans) != TRANS_PENDING) {
-            cur = cur->next;
+//  Count a committing transaction down, and put it on the ready list if nothing is left.
+static void resolve(TRANSACTION *tp) {
+    if(atomic_fetch_sub(&tp->unresolved, 1) != 1) return;
+    tp->ready_next = NULL;
+    if(ready_head == NULL) ready_head = tp;
+    else ready_tail->ready_next = tp;
+    ready_tail = tp;
+}
+
+static void report(TRANSACTION *tp, TRANS_STATUS status);
+static void publish(uint64_t ts);
+
+/*  Report the commits aborted with a dependency, then decide the ready transactions, unless an
+ *  outer call is doing so already, or they are held back.
+ */
+static void decideReady() {
+    if(deciding || deferring) return;
+    deciding = 1;
+    while(doomed_head != NULL || ready_head != NULL) {
+        if(doomed_head != NULL) {
+            TRANSACTION *tp = doomed_head;
+            doomed_head = tp->doomed_next;
+            report(tp, TRANS_ABORTED);
+            trans_unref(tp, "for report of aborted commit");
             continue;
         }
-        pthread_mutex_lock(&cur->trans->mutex);
-        cur->trans->waitcnt++;
-        pthread_mutex_unlock(&cur->trans->mutex);
-        P(&cur->trans->sem);
-        cur = cur->next;
-    }
-
-    //  If any transaction in the dependency set aborted, abort the transaction and return.
-    cur = tp->depends;
-    while(cur != NULL) {
-        if(trans_get_status(cur->trans) == TRANS_ABORTED) {
-            return trans_abort(tp);
-        }
-        cur = cur->next;
+        TRANSACTION *tp = ready_head;
+        ready_head = tp->ready_next;
+        decide(tp);
     }
+    deciding = 0;
+}
 
-    //  Lock.
+/*  Give a pending transaction the final status pointed to and let go of the transactions
+ *  waiting for it.  If it was not pending, the status it had already is stored instead.
+ *  A nonzero ts is the commit timestamp the transaction took, published as soon as the
+ *  status is set.  Return nonzero if the status was changed.
+ */
+static int finish(TRANSACTION *tp, TRANS_STATUS *statusp, uint64_t ts) {
+    TRANS_STATUS status = *statusp;
     pthread_mutex_lock(&tp->mutex);
 
-    //  Change transaction status to committed.
-    tp->status = TRANS_COMMITTED;
+    TRANS_STATUS old = atomic_load_explicit(&tp->status, memory_order_relaxed);
+    if(old != TRANS_PENDING) {
+        pthread_mutex_unlock(&tp->mutex);
+        *statusp = old;
+        return 0;
+    }
+
+    //  Publish the status, for lock-free readers, and take the edges from the dependents.
+    atomic_store_explicit(&tp->status, status, memory_order_release);
+    DEPENDENT *dependents = tp->dependents;
+    int num_dependents = tp->num_dependents;
+    tp->dependents = NULL;
+    tp->num_dependents = tp->max_dependents = 0;
 
-    //  Unlock.
     pthread_mutex_unlock(&tp->mutex);
 
-    int i;
+    //  Let snapshots see the versions installed with the timestamp before anything else is done.
+    if(ts) publish(ts);
 
-    //  Lock.
-    pthread_mutex_lock(&tp->mutex);
+    debug("Transaction %lu %s", tp->id, status == TRANS_COMMITTED ? "commits" : "has aborted");
+    removePending(tp);
 
-    //  Obtain transaction's wait count.
-    int cnt = tp->waitcnt;
+    /*  Abort the transactions that depend on this one, if it aborted, and theirs in turn, and
+     *  count down those that are waiting for it.  This comes before the entries are handed to
+     *  the reaper, which would otherwise abort the dependents itself, as plain aborts.
+     */
+    for(int i = 0; i < num_dependents; i++) {
+        if(status == TRANS_ABORTED) abortDependent(dependents[i].trans);
+        if(dependents[i].counted) resolve(dependents[i].trans);
+        trans_unref(dependents[i].trans, "as dependent of finished transaction");
+    }
+    if(dependents != NULL) Free(dependents);
+
+    if(completion_hook != NULL) completion_hook(tp);
+    if(release_hook != NULL) release_hook(tp);
+    if((tp->idle_ms || tp->commit_ms) && timer_cancel(&tp->timer)) trans_unref(tp, "for cancelled timer");
+    decideReady();
+    return 1;
+}
 
-    //  Unlock.
+/*  Report a transaction that has just been aborted, if its commit has been requested, right
+ *  away rather than once its dependencies have finished, though as a decision would be, when
+ *  no entry is locked.
+ */
+static void doom(TRANSACTION *tp) {
+    pthread_mutex_lock(&tp->mutex);
+    int committing = tp->on_commit != NULL;
     pthread_mutex_unlock(&tp->mutex);
+    if(committing) {
+        trans_ref(tp, "for report of aborted commit");
+        tp->doomed_next = doomed_head;
+        doomed_head = tp;
+        decideReady();
+    }
+}
+
+//  Abort a transaction because one it depends on has aborted, without consuming a reference.
+static void abortDependent(TRANSACTION *tp) {
+    TRANS_STATUS status = TRANS_ABORTED;
+    if(!finish(tp, &status, 0)) return;
+    debug("Transaction %lu aborted with a dependency", tp->id);
+    atomic_fetch_add(&cascades, 1);
+    doom(tp);
+}
+
+//  Call the function given when the commit of a transaction was requested, only once.
+static void report(TRANSACTION *tp, TRANS_STATUS status) {
+    if(atomic_exchange(&tp->reported, 1)) return;
+    tp->on_commit(tp, status, tp->commit_arg);
+}
 
-    //  V the transaction's wait count number of times.
-    for(i = 0; i < cnt; i++) {
-        V(&tp->sem);
+/*  Publish a commit timestamp, once every earlier one has been.  The commits in between are
+ *  already being decided, and have only their status to set, so this does not wait long.
+ */
+static void publish(uint64_t ts) {
+    while(atomic_load(&published_ts) != ts - 1) sched_yield();
+    atomic_store(&published_ts, ts);
+}
+
+void trans_release_reads(TRANSACTION *tp) {
+    for(int i = 0; i < tp->num_reads; i++) mapEntryUnref(tp->reads[i].entry);
+    tp->num_reads = 0;
+    for(int i = 0; i < tp->num_scans; i++) {
+        blob_unref(tp->scans[i].lo, "as bound of scanned range");
+        blob_unref(tp->scans[i].hi, "as bound of scanned range");
     }
+    tp->num_scans = 0;
+}
+
+uint64_t trans_take_commit_ts(TRANSACTION *tp) {
+    tp->commit_ts = atomic_fetch_add(&commit_clock, 1) + 1;
+    return tp->commit_ts;
+}
+
+//  Commit or abort a transaction whose dependencies have all finished, and report it.
+static void decide(TRANSACTION *tp) {
+    int size;
+    DEPENDENCY *deps = depEntries(&tp->depends, &size);
 
-    debug("Transaction %d commits", tp->id);
+    //  If any transaction in the dependency set aborted, the transaction aborts too.
+    TRANS_STATUS status = TRANS_COMMITTED;
+    for(int i = 0; i < size; i++) {
+        if(deps[i].trans != NULL && trans_get_status(deps[i].trans) == TRANS_ABORTED) {
+            status = TRANS_ABORTED;
+            break;
+        }
+    }
+
+    //  Give the engine a last say, and publish any commit timestamp it took, whatever the outcome.
+    if(status == TRANS_COMMITTED && prepare_hook != NULL) status = prepare_hook(tp);
+
+    //  The transaction may have been aborted by another thread in the meantime.
+    if(!finish(tp, &status, tp->commit_ts) && tp->commit_ts) publish(tp->commit_ts);
+    report(tp, status);
 
     //  Decrease the transaction's ref count by 1.
-    trans_unref(tp, NULL);
+    trans_unref(tp, "for decided transaction");
+}
+
+void trans_commit_async(TRANSACTION *tp, TRANS_CALLBACK callback, void *arg) {
+    debug("Transaction %lu trying to commit", tp->id);
+    pthread_mutex_lock(&tp->mutex);
+    tp->on_commit = callback;
+    tp->commit_arg = arg;
+    tp->commit_due = tp->commit_ms ? timer_now() + tp->commit_ms : 0;
+    pthread_mutex_unlock(&tp->mutex);
+
+    //  Trade the idle timeout for the commit deadline.
+    if(tp->commit_ms) armTimer(tp, tp->commit_ms);
+    else if(tp->idle_ms && timer_cancel(&tp->timer)) trans_unref(tp, "for cancelled timer");
 
-    return TRANS_COMMITTED;
+    //  Hold one count ourselves, so the transaction is not decided before every edge is in place.
+    atomic_store(&tp->unresolved, 1);
+
+    /*  Count each pending transaction in the dependency set, making the edge back to this
+     *  one that it holds count.  The status check and the count are made under the same lock,
+     *  so the dependency cannot finish in between without counting us down.  Committed
+     *  dependencies are skipped without locking.
+     */
+    int size;
+    DEPENDENCY *deps = depEntries(&tp->depends, &size);
+    for(int i = 0; i < size; i++) {
+        TRANSACTION *dtp = deps[i].trans;
+        if(dtp == NULL || trans_get_status(dtp) == TRANS_COMMITTED) continue;
+        trans_check(dtp, deps[i].generation);
+
+        pthread_mutex_lock(&dtp->mutex);
+        if(atomic_load_explicit(&dtp->status, memory_order_relaxed) == TRANS_PENDING) {
+            dtp->dependents[deps[i].edge].counted = 1;
+            atomic_fetch_add(&tp->unresolved, 1);
+        }
+        pthread_mutex_unlock(&dtp->mutex);
+    }
+
+    //  Drop our own count; if every dependency has finished already, decide the transaction now.
+    resolve(tp);
+    decideReady();
+}
+
+void trans_defer_decisions() {
+    deferring++;
+}
+
+void trans_decide_deferred() {
+    if(--deferring == 0) decideReady();
+}
+
+//  Where trans_commit() waits for the decision, and what the decision was.
+typedef struct commit_wait {
+    sem_t sem;
+    TRANS_STATUS status;
+} COMMIT_WAIT;
+
+static void commitWakeup(TRANSACTION *tp, TRANS_STATUS status, void *arg) {
+    COMMIT_WAIT *wp = arg;
+    wp->status = status;
+    V(&wp->sem);
+}
+
+TRANS_STATUS trans_commit(TRANSACTION *tp) {
+    COMMIT_WAIT wait;
+    Sem_init(&wait.sem, 0, 0);
+    trans_commit_async(tp, commitWakeup, &wait);
+    P(&wait.sem);
+    sem_destroy(&wait.sem);
+    return wait.status;
 }
 
 TRANS_STATUS trans_abort(TRANSACTION *tp) {
-    debug("Try to abort transaction %d", tp->id);
+    debug("Try to abort transaction %lu", tp->id);
 
     //  If the transaction already commit, abort the program.
-    if(trans_get_status(tp) == TRANS_COMMITTED) {
+    TRANS_STATUS status = TRANS_ABORTED;
+    finish(tp, &status, 0);
+    if(status == TRANS_COMMITTED) {
         abort();
     }
-    /*  Else if the transaction is already aborted, V transaction's
-     *  wait count number of times, decrease the transaction's
-     *  ref count by 1, and return the aborted status.
-     */
-    else if(trans_get_status(tp) == TRANS_ABORTED) {
-        debug("Transaction %d has already aborted", tp->id);
 
-        pthread_mutex_lock(&tp->mutex);
-        int cnt = tp->waitcnt;
-        pthread_mutex_unlock(&tp->mutex);
-        int i;
-        for(i = 0; i < cnt; i++) {
-            V(&tp->sem);
-        }
+    //  Either way, decrease the transaction's ref count by 1, and return the aborted status.
+    trans_unref(tp, "for aborting transaction");
+    return TRANS_ABORTED;
+}
 
-        trans_unref(tp, "for aborting transaction");
-        return TRANS_ABORTED;
+TRANS_STATUS trans_wound(TRANSACTION *tp) {
+    TRANS_STATUS status = TRANS_ABORTED;
+    if(finish(tp, &status, 0)) {
+        debug("Transaction %lu wounded", tp->id);
+        atomic_fetch_add(&wounds, 1);
+        doom(tp);
     }
-    /*  Else the transaction is pending. Set the status to
-     *  aborted and V transaction's wait count number of times,
-     *  decrease the transaction's ref count by 1, and return the
-     *  aborted status.
-     */
-    else {
-        pthread_mutex_lock(&tp->mutex);
+    return status;
+}
 
-        tp->status = TRANS_ABORTED;
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
 
-        pthread_mutex_unlock(&tp->mutex);
+#define SIPROUND(v0, v1, v2, v3) do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+} while(0)
 
-        pthread_mutex_lock(&tp->mutex);
-        int cnt = tp->waitcnt;
-        pthread_mutex_unlock(&tp->mutex);
-        int i;
-        for(i = 0; i < cnt; i++) {
-            V(&tp->sem);
-        }
+//  SipHash-2-4 of a message under a 128-bit key, reading words little-endian as the reference does.
+static uint64_t sipHash(const uint64_t key[2], const unsigned char *msg, size_t len) {
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key[0], v1 = 0x646f72616e646f6dULL ^ key[1];
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key[0], v3 = 0x7465646279746573ULL ^ key[1];
+    size_t i;
+    for(i = 0; i + 8 <= len; i += 8) {
+        uint64_t m = 0;
+        for(int j = 0; j < 8; j++) m |= (uint64_t) msg[i + j] << (8 * j);
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    uint64_t b = (uint64_t) len << 56;
+    for(int j = 0; i + j < len; j++) b |= (uint64_t) msg[i + j] << (8 * j);
+    v3 ^= b;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    for(int r = 0; r < 4; r++) SIPROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
 
+//  Slot in a table of redeemed tokens that holds an ID plus one, or the empty slot where it would go.
+static REDEEMED *redeemedSlot(REDEEMED *table, int capacity, uint64_t key) {
+    unsigned int mask = capacity - 1;
+    unsigned int i = key * 0x9E3779B97F4A7C15ULL >> 32 & mask;
+    while(table[i].id != 0 && table[i].id != key) i = (i + 1) & mask;
+    return &table[i];
+}
 
-        debug("Transaction %d has aborted", tp->id);
-        trans_unref(tp, "for aborting transaction");
+//  Move the redeemed tokens that have not expired into a table at most a quarter full.
+static void redeemedRebuild(uint64_t now) {
+    int live = 0;
+    for(int i = 0; i < redeemed.capacity; i++)
+        if(redeemed.table[i].id != 0 && now - redeemed.table[i].issued <= TRANS_TOKEN_TTL) live++;
+    int capacity = 64;
+    while(capacity < live * 4) capacity *= 2;
 
-        return TRANS_ABORTED;
+    REDEEMED *table = Calloc(capacity, sizeof(REDEEMED));
+    for(int i = 0; i < redeemed.capacity; i++) {
+        REDEEMED *rp = &redeemed.table[i];
+        if(rp->id != 0 && now - rp->issued <= TRANS_TOKEN_TTL) *redeemedSlot(table, capacity, rp->id) = *rp;
     }
+    if(redeemed.table != NULL) Free(redeemed.table);
+    redeemed.table = table;
+    redeemed.capacity = capacity;
+    redeemed.count = live;
 }
 
-TRANS_STATUS trans_get_status(TRANSACTION *tp) {
-    //  Lock.
+//  Note the token of a transaction as redeemed.  Returns zero if it was already.
+static int redeem(uint64_t id, uint64_t issued, uint64_t now) {
+    pthread_mutex_lock(&redeemed.mutex);
+    if((redeemed.count + 1) * 2 > redeemed.capacity) redeemedRebuild(now);
+    REDEEMED *rp = redeemedSlot(redeemed.table, redeemed.capacity, id + 1);
+    int fresh = rp->id == 0;
+    if(fresh) {
+        *rp = (REDEEMED){ .id = id + 1, .issued = issued };
+        redeemed.count++;
+    }
+    pthread_mutex_unlock(&redeemed.mutex);
+    return fresh;
+}
+
+/*  A retry token is the ID of the transaction that aborted, its priority and the time of
+ *  issue, in host order, followed by the MAC of all three.
+ */
+void trans_retry_token(TRANSACTION *tp, unsigned char *token) {
+    uint64_t fields[3] = { tp->id, tp->priority, timer_now() };
+    memcpy(token, fields, sizeof(fields));
+    uint64_t mac = sipHash(token_key, token, sizeof(fields));
+    memcpy(token + sizeof(fields), &mac, sizeof(mac));
+}
+
+int trans_redeem_token(TRANSACTION *tp, const unsigned char *token, size_t size) {
+    uint64_t fields[3], mac;
+    if(size != TRANS_TOKEN_SIZE) return 0;
+    memcpy(fields, token, sizeof(fields));
+    memcpy(&mac, token + sizeof(fields), sizeof(mac));
+    if(mac != sipHash(token_key, token, sizeof(fields))) return 0;
+
+    //  A token expires, and can only be used once in the meantime.
+    uint64_t id = fields[0], priority = fields[1], issued = fields[2], now = timer_now();
+    if(issued > now || now - issued > TRANS_TOKEN_TTL) {
+        debug("Retry token of transaction %lu has expired", id);
+        return 0;
+    }
+    if(!redeem(id, issued, now)) {
+        debug("Retry token of transaction %lu has been redeemed already", id);
+        return 0;
+    }
+
+    if(priority < tp->priority) tp->priority = priority;
+    debug("Transaction %lu retries with priority %lu", tp->id, tp->priority);
+    atomic_fetch_add(&retries, 1);
+    return 1;
+}
+
+/*  Called when the timer of a transaction fires, holding the timer's reference.  Abort
+ *  the transaction if its idle timeout or commit deadline has passed, or else move the
+ *  timer on to the time at which it next might.
+ */
+static void transExpired(void *arg) {
+    TRANSACTION *tp = arg;
+    uint64_t now = timer_now();
+
     pthread_mutex_lock(&tp->mutex);
+    int committing = tp->on_commit != NULL;
+    uint64_t due = 0;
+    if(atomic_load_explicit(&tp->status, memory_order_relaxed) == TRANS_PENDING) {
+        if(committing) due = tp->commit_due;
+        else if(tp->idle_ms) due = atomic_load_explicit(&tp->last_active, memory_order_relaxed) + tp->idle_ms;
+    }
+    pthread_mutex_unlock(&tp->mutex);
+
+    //  There was activity since the timer was armed, so the reference goes back with the timer.
+    if(due > now) {
+        if(timer_arm(&tp->timer, due - now, transExpired, tp)) trans_unref(tp, "for timer armed already");
+        return;
+    }
+
+    //  A commit that is given up is reported now, rather than when its dependencies finish.
+    TRANS_STATUS status = TRANS_ABORTED;
+    if(due != 0 && finish(tp, &status, 0)) {
+        debug("Transaction %lu has %s", tp->id, committing ? "waited too long to commit" : "been idle too long");
+        atomic_fetch_add(committing ? &commit_aborts : &idle_aborts, 1);
+        doom(tp);
+    }
+    trans_unref(tp, "for expired timer");
+}
 
-    //  Obtain transaction status.
-    TRANS_STATUS status = tp->status;
+void trans_set_default_timeouts(long idle_ms, long commit_ms) {
+    default_idle_ms = idle_ms;
+    default_commit_ms = commit_ms;
+}
 
-    //  Unlock.
+void trans_set_timeouts(TRANSACTION *tp, long idle_ms, long commit_ms) {
+    pthread_mutex_lock(&tp->mutex);
+    tp->idle_ms = idle_ms;
+    tp->commit_ms = commit_ms;
+    atomic_store_explicit(&tp->last_active, timer_now(), memory_order_relaxed);
     pthread_mutex_unlock(&tp->mutex);
+    if(idle_ms) armTimer(tp, idle_ms);
+}
 
-    //  Return status.
-    return status;
+void trans_keepalive(TRANSACTION *tp) {
+    if(tp->idle_ms) atomic_store_explicit(&tp->last_active, timer_now(), memory_order_relaxed);
+}
+
+void trans_stats(TRANS_STATS *sp) {
+    sp->idle_aborts = atomic_load(&idle_aborts);
+    sp->commit_aborts = atomic_load(&commit_aborts);
+    sp->wounds = atomic_load(&wounds);
+    sp->retries = atomic_load(&retries);
+    sp->cascades = atomic_load(&cascades);
+}
+
+void trans_show_stats() {
+    TRANS_STATS stats;
+    trans_stats(&stats);
+    fprintf(stderr, "TRANSACTION STATISTICS:\n");
+    fprintf(stderr, "\tidle transactions aborted: %ld\n", stats.idle_aborts);
+    fprintf(stderr, "\tcommits given up waiting: %ld\n", stats.commit_aborts);
+    fprintf(stderr, "\ttransactions wounded: %ld\n", stats.wounds);
+    fprintf(stderr, "\ttransactions retried with a token: %ld\n", stats.retries);
+    fprintf(stderr, "\ttransactions aborted with a dependency: %ld\n", stats.cascades);
+}
+
+uint64_t trans_oldest_pending() {
+    pthread_mutex_lock(&pending_mutex);
+    uint64_t id = pending_list.pending_next != &pending_list ? pending_list.pending_next->id : atomic_load(&trans_ID);
+    pthread_mutex_unlock(&pending_mutex);
+    return id;
+}
+
+uint64_t trans_snapshot_horizon() {
+    return atomic_load(&snapshot_horizon);
+}
+
+uint64_t trans_watermark() {
+    uint64_t watermark, horizon;
+
+    /*  The oldest pending ID and the horizon only change under the mutex, and the ID never goes
+     *  backwards, so a snapshot taken after the ID is read is no less than it, and one taken
+     *  before is covered by the horizon.  The published timestamp moves without the mutex, so
+     *  under the other engines only the mutex keeps a snapshot from being taken in between.
+     */
+    if(engine == ENGINE_ORDERED) {
+        watermark = atomic_load(&oldest_pending);
+        horizon = atomic_load(&snapshot_horizon);
+    }
+    else {
+        pthread_mutex_lock(&pending_mutex);
+        watermark = atomic_load(&published_ts) + 1;
+        horizon = atomic_load(&snapshot_horizon);
+        pthread_mutex_unlock(&pending_mutex);
+    }
+    return horizon < watermark ? horizon : watermark;
+}
+
+void trans_check(TRANSACTION *tp, unsigned int generation) {
+    if(tp->generation != generation) {
+        fprintf(stderr, "Stale reference to transaction %p (generation %u, now %u)\n", tp, generation, tp->generation);
+        abort();
+    }
+}
+
+void trans_set_completion_hook(void (*hook)(TRANSACTION *tp)) {
+    completion_hook = hook;
+}
+
+void trans_set_release_hook(void (*hook)(TRANSACTION *tp)) {
+    release_hook = hook;
+}
+
+void trans_set_prepare_hook(TRANS_STATUS (*hook)(TRANSACTION *tp)) {
+    prepare_hook = hook;
+}
+
+void trans_select_engine(int e) {
+    engine = e;
+}
+
+int trans_engine() {
+    return engine;
+}
+
+TRANS_STATUS trans_get_status(TRANSACTION *tp) {
+    //  Pairs with the release store that sets a final status.
+    return atomic_load_explicit(&tp->status, memory_order_acquire);
 }
 
 void trans_show(TRANSACTION *tp) {
-    fprintf(stderr, "[id=%d, status=%d, refcnt=%d]", tp->id, tp->status, tp->refcnt);
+    fprintf(stderr, "[id=%lu, status=%d, refcnt=%d]", tp->id, atomic_load(&tp->status), tp->refcnt);
 }
 
 void trans_show_all() {
-    //  Print all of the transactions.
+    //  Print all of the transactions, holding every list of the registry.
     fprintf(stderr, "TRANSACTIONS:\n");
-    TRANSACTION *cur = trans_list.next;
-    while(cur != &trans_list) {
-        trans_show(cur);
-        cur = cur->next;
+#ifndef NO_TRANS_REGISTRY
+    for(int i = 0; i < TRANS_SHARDS; i++) pthread_mutex_lock(&registry[i].mutex);
+    for(int i = 0; i < TRANS_SHARDS; i++) {
+        TRANSACTION *cur = registry[i].head.next;
+        while(cur != &registry[i].head) {
+            trans_show(cur);
+            cur = cur->next;
+        }
     }
+    for(int i = TRANS_SHARDS - 1; i >= 0; i--) pthread_mutex_unlock(&registry[i].mutex);
+#else
+    fprintf(stderr, "(registry not compiled in)");
+#endif
     fprintf(stderr, "\n");
 }
\ No newline at end of file
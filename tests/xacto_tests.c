@@ -1,11 +1,21 @@
 #include <criterion/criterion.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <wait.h>
 
+#include "transaction.h"
+#include "store.h"
+#include "data.h"
+#include "protocol.h"
+#include "csapp.h"
+#include "helpers.h"
+#include "swiss.h"
+#include "epoch.h"
+
 static void init() {
 #ifndef NO_SERVER
     int ret;
@@ -71,3 +81,845 @@ Test(student_suite, 01_connect, .init = init, .fini = fini, .timeout = 5) {
     int ret = system("util/client -p 9999 </dev/null | grep 'Connected to server'");
     cr_assert_eq(ret, 0, "expected %d, was %d\n", 0, ret);
 }
+
+/*
+ * Tests that drive the store directly, without a server.
+ */
+
+static void store_setup() {
+    trans_init();
+    store_init();
+}
+
+static void store_teardown() {
+    store_fini();
+    trans_fini();
+}
+
+//  Keys emitted by a range, joined with spaces.
+typedef struct {
+    char keys[256];
+    int count;
+} RANGE_RESULT;
+
+static void collect_key(KEY *key, BLOB *value, void *arg) {
+    RANGE_RESULT *rp = arg;
+    if(rp->count++ > 0) strcat(rp->keys, " ");
+    strncat(rp->keys, key->blob->content, key->blob->size);
+}
+
+static TRANS_STATUS put_string(TRANSACTION *tp, char *key, char *value) {
+    return store_put_raw(tp, key, strlen(key), value != NULL ? blob_create(value, strlen(value)) : NULL);
+}
+
+//  GET a key into a buffer of at least 32 bytes, as an empty string if it has no value.
+static TRANS_STATUS get_string(TRANSACTION *tp, char *key, char *buf) {
+    BLOB *value;
+    TRANS_STATUS status = store_get_raw(tp, key, strlen(key), &value);
+    buf[0] = '\0';
+    if(value != NULL) {
+        snprintf(buf, 32, "%.*s", (int) value->size, value->content);
+        blob_unref(value, "obtained from store_get");
+    }
+    return status;
+}
+
+static TRANS_STATUS range_strings(TRANSACTION *tp, char *lo, char *hi, int limit, RANGE_RESULT *rp) {
+    memset(rp, 0, sizeof(*rp));
+    return store_range(tp, lo, lo != NULL ? strlen(lo) : 0, hi, hi != NULL ? strlen(hi) : 0, limit, collect_key, rp);
+}
+
+static void put_keys(char **keys) {
+    TRANSACTION *tp = trans_create();
+    for(int i = 0; keys[i] != NULL; i++)
+        cr_assert_eq(put_string(tp, keys[i], "v"), TRANS_PENDING, "put of %s failed", keys[i]);
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "loading transaction did not commit");
+}
+
+Test(store_suite, 00_range_bounds, .init = store_setup, .fini = store_teardown, .timeout = 5) {
+    put_keys((char *[]){ "a1", "a2", "a3", "b1", "b2", "c", NULL });
+    TRANSACTION *tp = trans_create();
+    RANGE_RESULT res;
+    cr_assert_eq(range_strings(tp, "a", "b", 0, &res), TRANS_PENDING, "range [a, b) failed");
+    cr_assert_eq(strcmp(res.keys, "a1 a2 a3"), 0, "range [a, b) returned \"%s\"", res.keys);
+    cr_assert_eq(range_strings(tp, "a2", "b1", 0, &res), TRANS_PENDING, "range [a2, b1) failed");
+    cr_assert_eq(strcmp(res.keys, "a2 a3"), 0, "range [a2, b1) returned \"%s\"", res.keys);
+    cr_assert_eq(range_strings(tp, "b", NULL, 0, &res), TRANS_PENDING, "range [b, ...) failed");
+    cr_assert_eq(strcmp(res.keys, "b1 b2 c"), 0, "range [b, ...) returned \"%s\"", res.keys);
+    cr_assert_eq(range_strings(tp, NULL, "a2", 0, &res), TRANS_PENDING, "range [..., a2) failed");
+    cr_assert_eq(strcmp(res.keys, "a1"), 0, "range [..., a2) returned \"%s\"", res.keys);
+    cr_assert_eq(range_strings(tp, "d", "e", 0, &res), TRANS_PENDING, "empty range failed");
+    cr_assert_eq(res.count, 0, "empty range returned \"%s\"", res.keys);
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "scanning transaction did not commit");
+}
+
+Test(store_suite, 01_range_limit, .init = store_setup, .fini = store_teardown, .timeout = 5) {
+    put_keys((char *[]){ "a1", "a2", "a3", "b1", NULL });
+    TRANSACTION *tp = trans_create();
+    RANGE_RESULT res;
+    cr_assert_eq(range_strings(tp, NULL, NULL, 2, &res), TRANS_PENDING, "range with limit 2 failed");
+    cr_assert_eq(strcmp(res.keys, "a1 a2"), 0, "range with limit 2 returned \"%s\"", res.keys);
+    cr_assert_eq(range_strings(tp, "a2", NULL, 1, &res), TRANS_PENDING, "range with limit 1 failed");
+    cr_assert_eq(strcmp(res.keys, "a2"), 0, "range with limit 1 returned \"%s\"", res.keys);
+    cr_assert_eq(range_strings(tp, "a", "b", 10, &res), TRANS_PENDING, "range with limit 10 failed");
+    cr_assert_eq(strcmp(res.keys, "a1 a2 a3"), 0, "range with limit 10 returned \"%s\"", res.keys);
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "scanning transaction did not commit");
+}
+
+Test(store_suite, 02_range_phantom, .init = store_setup, .fini = store_teardown, .timeout = 5) {
+    put_keys((char *[]){ "a", "z", NULL });
+
+    //  An older transaction may not put a key into a gap a younger one has scanned.
+    TRANSACTION *older = trans_create();
+    TRANSACTION *tp = trans_create();
+    RANGE_RESULT res;
+    cr_assert_eq(range_strings(tp, "m", "n", 0, &res), TRANS_PENDING, "range [m, n) failed");
+    cr_assert_eq(res.count, 0, "range [m, n) returned \"%s\"", res.keys);
+    cr_assert_eq(put_string(older, "mm", "x"), TRANS_ABORTED, "put into a scanned gap did not abort");
+    trans_abort(older);
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "scanning transaction did not commit");
+
+    //  A younger one may.
+    tp = trans_create();
+    cr_assert_eq(range_strings(tp, "m", "n", 0, &res), TRANS_PENDING, "range [m, n) failed");
+    TRANSACTION *younger = trans_create();
+    cr_assert_eq(put_string(younger, "mm", "x"), TRANS_PENDING, "put after a scan by an older transaction failed");
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "scanning transaction did not commit");
+    cr_assert_eq(trans_commit(younger), TRANS_COMMITTED, "younger writer did not commit");
+}
+
+Test(store_suite, 03_range_limit_gap, .init = store_setup, .fini = store_teardown, .timeout = 5) {
+    put_keys((char *[]){ "a1", "a5", NULL });
+
+    //  The gap after the last entry collected under a limit is not covered.
+    TRANSACTION *older = trans_create();
+    TRANSACTION *tp = trans_create();
+    RANGE_RESULT res;
+    cr_assert_eq(range_strings(tp, "a", "b", 1, &res), TRANS_PENDING, "range with limit 1 failed");
+    cr_assert_eq(strcmp(res.keys, "a1"), 0, "range with limit 1 returned \"%s\"", res.keys);
+    cr_assert_eq(put_string(older, "a3", "x"), TRANS_PENDING, "put past the limit of a scan failed");
+    cr_assert_eq(put_string(older, "a0", "x"), TRANS_ABORTED, "put before the limit of a scan did not abort");
+    trans_abort(older);
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "scanning transaction did not commit");
+}
+
+static void swiss_setup() {
+    store_select_index(INDEX_SWISS);
+    store_setup();
+}
+
+//  Wait for the reaper to have removed at least a number of entries.
+static void wait_removed(long count) {
+    STORE_STATS stats;
+    do {
+        usleep(1000);
+        store_stats(&stats);
+    } while(stats.removed < count);
+}
+
+Test(store_suite, 04_swiss_store, .init = swiss_setup, .fini = store_teardown, .timeout = 10) {
+    char key[16], buf[32];
+
+    //  Enough keys that every shard grows.
+    TRANSACTION *tp = trans_create();
+    for(int i = 0; i < 4000; i++) {
+        sprintf(key, "k%d", i);
+        cr_assert_eq(put_string(tp, key, key), TRANS_PENDING, "put of %s failed", key);
+    }
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "loading transaction did not commit");
+
+    //  Remove every other key, and wait for the reaper to take the entries out.
+    tp = trans_create();
+    for(int i = 0; i < 4000; i += 2) {
+        sprintf(key, "k%d", i);
+        cr_assert_eq(put_string(tp, key, NULL), TRANS_PENDING, "put of NULL for %s failed", key);
+    }
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "removing transaction did not commit");
+    wait_removed(2000);
+
+    //  Put the removed keys back, into slots left DELETED, and read everything.
+    tp = trans_create();
+    for(int i = 0; i < 4000; i += 2) {
+        sprintf(key, "k%d", i);
+        cr_assert_eq(put_string(tp, key, "again"), TRANS_PENDING, "put of %s again failed", key);
+    }
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "reloading transaction did not commit");
+    tp = trans_create();
+    for(int i = 0; i < 4000; i++) {
+        sprintf(key, "k%d", i);
+        cr_assert_eq(get_string(tp, key, buf), TRANS_PENDING, "get of %s failed", key);
+        cr_assert_eq(strcmp(buf, i % 2 ? key : "again"), 0, "get of %s returned \"%s\"", key, buf);
+    }
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "reading transaction did not commit");
+}
+
+/*
+ * Map entries for driving an index directly, with a chosen hash so that they
+ * can be made to share a shard, a first group and a fingerprint.
+ */
+#define SWISS_HASH(fingerprint, group, shard) \
+    ((uint64_t) (fingerprint) << 57 | (uint64_t) (group) << 6 | (shard))
+
+static MAP_ENTRY *swiss_entry(char *name, uint64_t hash) {
+    MAP_ENTRY *mapEntry = Calloc(sizeof(MAP_ENTRY), 1);
+    mapEntry->key = key_create(blob_create(name, strlen(name)));
+    mapEntry->key->hash = hash;
+    return mapEntry;
+}
+
+static void swiss_entry_dispose(MAP_ENTRY *mapEntry) {
+    key_dispose(mapEntry->key);
+    Free(mapEntry);
+}
+
+Test(store_suite, 05_swiss_deleted_slot, .init = store_setup, .fini = store_teardown, .timeout = 5) {
+    SWISS *sp = swiss_init(0);
+    MAP_ENTRY *a = swiss_entry("a", SWISS_HASH(5, 0, 0));
+    MAP_ENTRY *b = swiss_entry("b", SWISS_HASH(5, 0, 0));
+    MAP_ENTRY *c = swiss_entry("c", SWISS_HASH(5, 0, 0));
+    cr_assert_eq(swiss_insert(sp, a), a, "insert of a failed");
+    cr_assert_eq(swiss_insert(sp, b), b, "insert of b failed");
+    cr_assert_eq(swiss_insert(sp, c), c, "insert of c failed");
+
+    //  A second entry for a key is not inserted.
+    MAP_ENTRY *dup = swiss_entry("b", SWISS_HASH(5, 0, 0));
+    cr_assert_eq(swiss_insert(sp, dup), b, "duplicate of b was inserted");
+    cr_assert_eq(swiss_lookup(sp, dup->key), b, "lookup of b failed");
+
+    //  Probes go on past a DELETED slot to the keys placed after it.
+    cr_assert(swiss_remove(sp, b), "remove of b failed");
+    cr_assert(!swiss_remove(sp, b), "b was removed twice");
+    cr_assert_null(swiss_lookup(sp, b->key), "b was found after its removal");
+    cr_assert_eq(swiss_lookup(sp, c->key), c, "c was lost past the DELETED slot");
+
+    //  The DELETED slot is taken by the next insert on the same probe sequence.
+    MAP_ENTRY *d = swiss_entry("d", SWISS_HASH(5, 0, 0));
+    cr_assert_eq(swiss_insert(sp, d), d, "insert of d failed");
+    cr_assert_eq(swiss_lookup(sp, d->key), d, "lookup of d failed");
+    cr_assert_eq(swiss_lookup(sp, a->key), a, "lookup of a failed");
+    cr_assert_eq(swiss_lookup(sp, c->key), c, "lookup of c failed");
+    cr_assert_eq(swiss_insert(sp, dup), dup, "reinsert of b failed");
+    cr_assert_eq(swiss_lookup(sp, b->key), dup, "lookup of reinserted b failed");
+
+    swiss_entry_dispose(b);
+    swiss_fini(sp, swiss_entry_dispose);
+}
+
+Test(store_suite, 06_swiss_cleanup, .init = store_setup, .fini = store_teardown, .timeout = 10) {
+    //  Room for 100 keys a shard, so that 50 never make one grow.
+    SWISS *sp = swiss_init(SWISS_SHARDS * 100);
+    MAP_ENTRY *batch[50];
+    char name[16];
+
+    /*  Fill one shard from a different group each time and empty it again, so that
+     *  DELETED slots pile up until an insert rehashes the shard at the same size.
+     */
+    for(int round = 0; round < 8; round++) {
+        for(int i = 0; i < 50; i++) {
+            sprintf(name, "k%d.%d", round, i);
+            batch[i] = swiss_entry(name, SWISS_HASH(i, round, 0));
+            cr_assert_eq(swiss_insert(sp, batch[i]), batch[i], "insert of %s failed", name);
+        }
+        for(int i = 0; i < 50; i++)
+            cr_assert_eq(swiss_lookup(sp, batch[i]->key), batch[i], "lookup of k%d.%d failed", round, i);
+        for(int i = 0; i < 50; i++) {
+            cr_assert(swiss_remove(sp, batch[i]), "remove of k%d.%d failed", round, i);
+            cr_assert_null(swiss_lookup(sp, batch[i]->key), "k%d.%d was found after its removal", round, i);
+            swiss_entry_dispose(batch[i]);
+        }
+    }
+    swiss_fini(sp, swiss_entry_dispose);
+}
+
+//  An index grown by one thread while others look up the keys it has inserted.
+#define SWISS_KEYS 20000
+
+typedef struct {
+    SWISS *sp;
+    MAP_ENTRY **entries;
+    atomic_int inserted;
+    atomic_int failures;
+} SWISS_GROWTH;
+
+static void *swiss_reader(void *arg) {
+    SWISS_GROWTH *gp = arg;
+    unsigned int seed = 1;
+    int count;
+    do {
+        count = atomic_load(&gp->inserted);
+        if(count == 0) continue;
+        MAP_ENTRY *mapEntry = gp->entries[rand_r(&seed) % count];
+        epoch_enter();
+        if(swiss_lookup(gp->sp, mapEntry->key) != mapEntry) atomic_fetch_add(&gp->failures, 1);
+        epoch_exit();
+    } while(count < SWISS_KEYS);
+    return NULL;
+}
+
+Test(store_suite, 07_swiss_growth, .init = store_setup, .fini = store_teardown, .timeout = 20) {
+    SWISS_GROWTH growth = { .sp = swiss_init(0), .entries = Malloc(SWISS_KEYS * sizeof(MAP_ENTRY *)) };
+    char name[16];
+    for(int i = 0; i < SWISS_KEYS; i++) {
+        sprintf(name, "k%d", i);
+        growth.entries[i] = swiss_entry(name, content_hash(name, strlen(name)));
+    }
+
+    pthread_t readers[2];
+    for(int i = 0; i < 2; i++) Pthread_create(&readers[i], NULL, swiss_reader, &growth);
+    for(int i = 0; i < SWISS_KEYS; i++) {
+        cr_assert_eq(swiss_insert(growth.sp, growth.entries[i]), growth.entries[i], "insert of k%d failed", i);
+        atomic_store(&growth.inserted, i + 1);
+    }
+    for(int i = 0; i < 2; i++) Pthread_join(readers[i], NULL);
+    cr_assert_eq(atomic_load(&growth.failures), 0, "%d lookups during growth failed", atomic_load(&growth.failures));
+
+    swiss_fini(growth.sp, swiss_entry_dispose);
+    Free(growth.entries);
+}
+
+#define CACHE_BUDGET (64 * 1024)
+
+static void cache_setup() {
+    store_set_budget(CACHE_BUDGET);
+    store_setup();
+}
+
+static void cache_tpl_setup() {
+    trans_select_engine(ENGINE_2PL);
+    cache_setup();
+}
+
+//  Put keys enough to go well over the budget, and wait for the reaper to evict down to it.
+static void overfill(TRANSACTION *tp) {
+    char key[16];
+    for(int i = 0; i < 2000; i++) {
+        sprintf(key, "fill%d", i);
+        cr_assert_eq(put_string(tp, key, "0123456789abcdef0123456789abcdef"), TRANS_PENDING, "put of %s failed", key);
+    }
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "filling transaction did not commit");
+
+    STORE_STATS stats;
+    do {
+        usleep(1000);
+        store_stats(&stats);
+    } while(stats.evicted == 0 || stats.bytes > stats.budget);
+}
+
+Test(store_suite, 08_cache_pending, .init = cache_setup, .fini = store_teardown, .timeout = 10) {
+    /*  The filling transaction is the older, so that its versions are old enough to
+     *  evict while the other is pending.
+     */
+    TRANSACTION *filler = trans_create();
+    TRANSACTION *tp = trans_create();
+    cr_assert_eq(put_string(tp, "pending", "p"), TRANS_PENDING, "put of pending key failed");
+    overfill(filler);
+
+    //  An entry with a pending version is not evicted.
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "pending transaction did not commit");
+    tp = trans_create();
+    char buf[32];
+    cr_assert_eq(get_string(tp, "pending", buf), TRANS_PENDING, "get of pending key failed");
+    cr_assert_eq(strcmp(buf, "p"), 0, "pending key read \"%s\" after eviction", buf);
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "reading transaction did not commit");
+}
+
+Test(store_suite, 09_cache_locked, .init = cache_tpl_setup, .fini = store_teardown, .timeout = 10) {
+    put_keys((char *[]){ "locked", NULL });
+
+    //  An entry locked under 2PL is not evicted, though its value is committed.
+    TRANSACTION *filler = trans_create();
+    TRANSACTION *tp = trans_create();
+    char buf[32];
+    cr_assert_eq(get_string(tp, "locked", buf), TRANS_PENDING, "get of locked key failed");
+    overfill(filler);
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "locking transaction did not commit");
+
+    tp = trans_create();
+    cr_assert_eq(get_string(tp, "locked", buf), TRANS_PENDING, "get of locked key failed");
+    cr_assert_eq(strcmp(buf, "v"), 0, "locked key read \"%s\" after eviction", buf);
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "reading transaction did not commit");
+}
+
+//  The store's map, to see how far a resize has got.
+extern struct map store;
+
+Test(store_suite, 10_half_resize, .init = store_setup, .fini = store_teardown, .timeout = 10) {
+    char key[16], buf[32];
+
+    //  One entry more than there are buckets starts a resize, which each later operation moves on a little.
+    TRANSACTION *tp = trans_create();
+    for(int i = 0; i <= NUM_BUCKETS; i++) {
+        sprintf(key, "k%d", i);
+        cr_assert_eq(put_string(tp, key, key), TRANS_PENDING, "put of %s failed", key);
+    }
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "loading transaction did not commit");
+    cr_assert_not_null(atomic_load(&store.old_table), "no resize was started");
+
+    //  With the resize half done, delete some keys and insert others.
+    tp = trans_create();
+    for(int i = 0; i < NUM_BUCKETS / REHASH_STEP / 4; i++) {
+        sprintf(key, "k%d", i);
+        cr_assert_eq(put_string(tp, key, NULL), TRANS_PENDING, "put of NULL for %s failed", key);
+        sprintf(key, "n%d", i);
+        cr_assert_eq(put_string(tp, key, key), TRANS_PENDING, "put of %s failed", key);
+    }
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "updating transaction did not commit");
+    cr_assert_not_null(atomic_load(&store.old_table), "resize finished too soon");
+    cr_assert(store.rehash_idx > 0, "resize did not move on");
+
+    //  The reaper takes the deleted entries out of whichever table they are in.
+    wait_removed(NUM_BUCKETS / REHASH_STEP / 4);
+    cr_assert_not_null(atomic_load(&store.old_table), "resize finished too soon");
+
+    //  Every key reads what was last put, while the resize finishes.
+    tp = trans_create();
+    for(int i = 0; i <= NUM_BUCKETS; i++) {
+        sprintf(key, "k%d", i);
+        cr_assert_eq(get_string(tp, key, buf), TRANS_PENDING, "get of %s failed", key);
+        cr_assert_eq(strcmp(buf, i < NUM_BUCKETS / REHASH_STEP / 4 ? "" : key), 0, "get of %s returned \"%s\"", key, buf);
+    }
+    for(int i = 0; i < NUM_BUCKETS / REHASH_STEP / 4; i++) {
+        sprintf(key, "n%d", i);
+        cr_assert_eq(get_string(tp, key, buf), TRANS_PENDING, "get of %s failed", key);
+        cr_assert_eq(strcmp(buf, key), 0, "get of %s returned \"%s\"", key, buf);
+    }
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "reading transaction did not commit");
+    cr_assert_null(atomic_load(&store.old_table), "resize did not finish");
+}
+
+Test(trans_suite, 00_retry_token, .init = store_setup, .fini = store_teardown, .timeout = 5) {
+    unsigned char token[TRANS_TOKEN_SIZE], forged[TRANS_TOKEN_SIZE];
+    TRANSACTION *tp = trans_create();
+    trans_ref(tp, "for token");
+    trans_abort(tp);
+    trans_retry_token(tp, token);
+    uint64_t priority = tp->priority;
+    trans_unref(tp, "for token");
+
+    //  A forged token is refused.
+    memcpy(forged, token, sizeof(token));
+    forged[0] ^= 1;
+    tp = trans_create();
+    cr_assert_eq(trans_redeem_token(tp, forged, sizeof(forged)), 0, "forged token was accepted");
+    trans_abort(tp);
+
+    //  A genuine one is accepted once.
+    tp = trans_create();
+    cr_assert_neq(trans_redeem_token(tp, token, sizeof(token)), 0, "genuine token was refused");
+    cr_assert_eq(tp->priority, priority, "retried transaction did not take over the priority");
+    trans_abort(tp);
+    tp = trans_create();
+    cr_assert_eq(trans_redeem_token(tp, token, sizeof(token)), 0, "replayed token was accepted");
+    trans_abort(tp);
+}
+
+static void idle_setup() {
+    trans_set_default_timeouts(100, 0);
+    store_setup();
+}
+
+static void deadline_setup() {
+    trans_set_default_timeouts(0, 100);
+    store_setup();
+}
+
+Test(trans_suite, 01_idle_abort, .init = idle_setup, .fini = store_teardown, .timeout = 5) {
+    TRANS_STATS stats;
+
+    //  A writer that goes quiet is aborted, and the commit waiting for it is decided.
+    TRANSACTION *quiet = trans_create();
+    cr_assert_eq(put_string(quiet, "k", "q"), TRANS_PENDING, "put by the quiet writer failed");
+    TRANSACTION *tp = trans_create();
+    cr_assert_eq(put_string(tp, "k", "d"), TRANS_PENDING, "put by the dependent failed");
+    cr_assert_eq(trans_commit(tp), TRANS_ABORTED, "dependent of an idle writer did not abort");
+    cr_assert_eq(trans_get_status(quiet), TRANS_ABORTED, "idle writer was not aborted");
+    trans_abort(quiet);
+    trans_stats(&stats);
+    cr_assert_eq(stats.idle_aborts, 1, "%ld idle aborts counted", stats.idle_aborts);
+    cr_assert_eq(stats.cascades, 1, "%ld cascades counted", stats.cascades);
+
+    //  The key is free for the next writer.
+    tp = trans_create();
+    cr_assert_eq(put_string(tp, "k", "n"), TRANS_PENDING, "put after the abort failed");
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "writer after the abort did not commit");
+}
+
+Test(trans_suite, 02_commit_deadline, .init = deadline_setup, .fini = store_teardown, .timeout = 5) {
+    TRANS_STATS stats;
+
+    //  A commit still waiting for its dependency at the deadline is given up.
+    TRANSACTION *older = trans_create();
+    cr_assert_eq(put_string(older, "k", "o"), TRANS_PENDING, "put by the older writer failed");
+    TRANSACTION *tp = trans_create();
+    cr_assert_eq(put_string(tp, "k", "d"), TRANS_PENDING, "put by the dependent failed");
+    cr_assert_eq(trans_commit(tp), TRANS_ABORTED, "overdue commit was not given up");
+    trans_stats(&stats);
+    cr_assert_eq(stats.commit_aborts, 1, "%ld commit aborts counted", stats.commit_aborts);
+    cr_assert_eq(stats.idle_aborts, 0, "%ld idle aborts counted", stats.idle_aborts);
+
+    //  The dependency itself is left alone, and commits.
+    cr_assert_eq(trans_commit(older), TRANS_COMMITTED, "older writer did not commit");
+    trans_stats(&stats);
+    cr_assert_eq(stats.commit_aborts, 1, "%ld commit aborts counted", stats.commit_aborts);
+}
+
+//  Note the status with which an asynchronous commit was decided.
+static void record_status(TRANSACTION *tp, TRANS_STATUS status, void *arg) {
+    *(TRANS_STATUS *) arg = status;
+}
+
+Test(trans_suite, 03_wounded_commit, .init = store_setup, .fini = store_teardown, .timeout = 5) {
+    //  A younger transaction waiting to commit behind a pending writer...
+    TRANSACTION *first = trans_create();
+    TRANSACTION *older = trans_create();
+    TRANSACTION *younger = trans_create();
+    cr_assert_eq(put_string(first, "k", "f"), TRANS_PENDING, "put by the first writer failed");
+    cr_assert_eq(put_string(younger, "k", "y"), TRANS_PENDING, "put by the younger writer failed");
+    TRANS_STATUS status = TRANS_PENDING;
+    trans_ref(younger, "for status");
+    trans_commit_async(younger, record_status, &status);
+    cr_assert_eq(status, TRANS_PENDING, "younger writer was decided before its dependency");
+
+    //  ...is reported aborted as soon as an older one wounds it.
+    cr_assert_eq(put_string(older, "k", "o"), TRANS_PENDING, "put by the older writer failed");
+    cr_assert_eq(status, TRANS_ABORTED, "wounded commit was not reported aborted");
+    cr_assert_eq(trans_get_status(younger), TRANS_ABORTED, "younger writer was not wounded");
+    trans_unref(younger, "for status");
+    cr_assert_eq(trans_commit(first), TRANS_COMMITTED, "first writer did not commit");
+    cr_assert_eq(trans_commit(older), TRANS_COMMITTED, "older writer did not commit");
+}
+
+Test(trans_suite, 04_cascade_chain, .init = store_setup, .fini = store_teardown, .timeout = 5) {
+    //  Each of b, c and d reads what the one before it wrote.
+    TRANSACTION *a = trans_create();
+    TRANSACTION *b = trans_create();
+    TRANSACTION *c = trans_create();
+    TRANSACTION *d = trans_create();
+    char buf[32];
+    cr_assert_eq(put_string(a, "a", "1"), TRANS_PENDING, "put by a failed");
+    cr_assert_eq(get_string(b, "a", buf), TRANS_PENDING, "get by b failed");
+    cr_assert_eq(put_string(b, "b", "2"), TRANS_PENDING, "put by b failed");
+    cr_assert_eq(get_string(c, "b", buf), TRANS_PENDING, "get by c failed");
+    cr_assert_eq(put_string(c, "c", "3"), TRANS_PENDING, "put by c failed");
+    cr_assert_eq(get_string(d, "c", buf), TRANS_PENDING, "get by d failed");
+
+    //  Commits requested down the chain wait for a.
+    TRANS_STATUS b_status = TRANS_PENDING, c_status = TRANS_PENDING;
+    trans_ref(b, "for status");
+    trans_ref(c, "for status");
+    trans_commit_async(b, record_status, &b_status);
+    trans_commit_async(c, record_status, &c_status);
+    cr_assert_eq(b_status, TRANS_PENDING, "b was decided before a");
+    cr_assert_eq(c_status, TRANS_PENDING, "c was decided before a");
+
+    //  Aborting a aborts the rest of the chain at once, reporting the commits.
+    trans_abort(a);
+    cr_assert_eq(b_status, TRANS_ABORTED, "commit of b was not reported aborted");
+    cr_assert_eq(c_status, TRANS_ABORTED, "commit of c was not reported aborted");
+    cr_assert_eq(trans_get_status(d), TRANS_ABORTED, "d was not aborted");
+    TRANS_STATS stats;
+    trans_stats(&stats);
+    cr_assert_eq(stats.cascades, 3, "%ld cascades counted", stats.cascades);
+    trans_unref(b, "for status");
+    trans_unref(c, "for status");
+    trans_abort(d);
+}
+
+Test(trans_suite, 05_dependency_set, .init = store_setup, .fini = store_teardown, .timeout = 5) {
+    TRANSACTION *tp = trans_create();
+    TRANSACTION *deps[10];
+    for(int i = 0; i < 10; i++) deps[i] = trans_create();
+
+    //  A dependency added again is not added twice, while the set is an array...
+    for(int round = 0; round < 3; round++)
+        for(int i = 0; i < DEPS_INLINE; i++) trans_add_dependency(tp, deps[i]);
+    cr_assert_eq(tp->depends.count, DEPS_INLINE, "%d dependencies in the array", tp->depends.count);
+    cr_assert_eq(tp->depends.capacity, 0, "array was replaced by a table of %d", tp->depends.capacity);
+
+    //  ...nor once it has spilled into a table.
+    for(int round = 0; round < 3; round++)
+        for(int i = 0; i < 10; i++) trans_add_dependency(tp, deps[i]);
+    cr_assert_eq(tp->depends.count, 10, "%d dependencies in the table", tp->depends.count);
+    cr_assert_neq(tp->depends.capacity, 0, "array did not spill into a table");
+    for(int i = 0; i < 10; i++)
+        cr_assert_eq(deps[i]->num_dependents, 1, "dependency %d has %d edges back", i, deps[i]->num_dependents);
+
+    //  The transaction commits once all of them have.
+    for(int i = 0; i < 10; i++)
+        cr_assert_eq(trans_commit(deps[i]), TRANS_COMMITTED, "dependency %d did not commit", i);
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "dependent did not commit");
+}
+
+/*
+ * Tests of sessions (BEGIN, ABORT and COMMIT on one connection), each against a
+ * server of its own.
+ */
+
+#define SESSION_PORT "9998"
+
+static pid_t session_server;
+
+static void session_setup() {
+    if((session_server = fork()) == 0) {
+	execlp("bin/xacto", "xacto", "-p", SESSION_PORT, NULL);
+	abort();
+    }
+    int ret, i = 0;
+    do { // Wait for server to start
+	usleep(100000);
+	ret = system("netstat -an | fgrep '0.0.0.0:" SESSION_PORT "' > /dev/null");
+    } while(++i < 50 && WEXITSTATUS(ret));
+}
+
+static void session_teardown() {
+    kill(session_server, SIGHUP);
+    waitpid(session_server, NULL, 0);
+}
+
+static void send_request(int fd, XACTO_PACKET_TYPE type) {
+    XACTO_PACKET pkt = { .type = type };
+    cr_assert_eq(proto_send_packet(fd, &pkt, NULL), 0, "could not send request");
+}
+
+static void send_data(int fd, char *content) {
+    XACTO_PACKET pkt = { .type = XACTO_DATA_PKT, .size = strlen(content) };
+    cr_assert_eq(proto_send_packet(fd, &pkt, content), 0, "could not send data");
+}
+
+//  Receive a packet, and return its status, or -1 at the end of the connection.
+static int recv_status(int fd, XACTO_PACKET_TYPE type) {
+    XACTO_PACKET pkt;
+    void *data = NULL;
+    if(proto_recv_packet(fd, &pkt, &data) < 0) return -1;
+    cr_assert_eq(pkt.type, type, "expected packet of type %d, was %d", type, pkt.type);
+    if(pkt.size != 0) free(data);
+    return pkt.status;
+}
+
+static int session_put(int fd, char *key, char *value) {
+    send_request(fd, XACTO_PUT_PKT);
+    send_data(fd, key);
+    send_data(fd, value);
+    return recv_status(fd, XACTO_REPLY_PKT);
+}
+
+//  GET a key, and return nonzero if it has a value.
+static int session_get(int fd, char *key) {
+    send_request(fd, XACTO_GET_PKT);
+    send_data(fd, key);
+    cr_assert_eq(recv_status(fd, XACTO_REPLY_PKT), 0, "GET of %s failed", key);
+    XACTO_PACKET pkt;
+    void *data = NULL;
+    cr_assert_eq(proto_recv_packet(fd, &pkt, &data), 0, "no value for GET of %s", key);
+    if(pkt.size != 0) free(data);
+    return !pkt.null;
+}
+
+static int session_request(int fd, XACTO_PACKET_TYPE type) {
+    send_request(fd, type);
+    return recv_status(fd, XACTO_REPLY_PKT);
+}
+
+Test(session_suite, 00_begin_commit, .init = session_setup, .fini = session_teardown, .timeout = 10) {
+    int fd = open_clientfd("localhost", SESSION_PORT);
+    cr_assert_eq(session_request(fd, XACTO_BEGIN_PKT), 0, "BEGIN failed");
+    cr_assert_eq(session_put(fd, "k1", "v1"), 0, "PUT failed");
+    cr_assert_eq(session_request(fd, XACTO_COMMIT_PKT), 1, "first COMMIT failed");
+    cr_assert_eq(session_put(fd, "k2", "v2"), 0, "PUT after COMMIT failed");
+    cr_assert_eq(session_request(fd, XACTO_COMMIT_PKT), 1, "second COMMIT failed");
+    cr_assert(session_get(fd, "k1") && session_get(fd, "k2"), "committed value missing");
+    cr_assert_eq(session_request(fd, XACTO_COMMIT_PKT), 1, "third COMMIT failed");
+    close(fd);
+}
+
+Test(session_suite, 01_abort, .init = session_setup, .fini = session_teardown, .timeout = 10) {
+    int fd = open_clientfd("localhost", SESSION_PORT);
+    cr_assert_eq(session_request(fd, XACTO_BEGIN_PKT), 0, "BEGIN failed");
+    cr_assert_eq(session_put(fd, "k", "v"), 0, "PUT failed");
+    cr_assert_eq(session_request(fd, XACTO_ABORT_PKT), 2, "ABORT did not report the abort");
+    cr_assert(!session_get(fd, "k"), "value of aborted transaction was written");
+    cr_assert_eq(session_request(fd, XACTO_COMMIT_PKT), 1, "COMMIT after ABORT failed");
+    close(fd);
+}
+
+Test(session_suite, 02_begin_mid_transaction, .init = session_setup, .fini = session_teardown, .timeout = 10) {
+    int fd = open_clientfd("localhost", SESSION_PORT);
+    cr_assert_eq(session_request(fd, XACTO_BEGIN_PKT), 0, "BEGIN failed");
+    cr_assert_eq(session_put(fd, "k", "v"), 0, "PUT failed");
+    cr_assert_eq(session_request(fd, XACTO_BEGIN_PKT), 2, "BEGIN in a transaction did not report the abort");
+    cr_assert(!session_get(fd, "k"), "value of aborted transaction was written");
+    cr_assert_eq(session_request(fd, XACTO_COMMIT_PKT), 1, "COMMIT after BEGIN failed");
+    close(fd);
+}
+
+Test(session_suite, 03_no_session, .init = session_setup, .fini = session_teardown, .timeout = 10) {
+    int fd = open_clientfd("localhost", SESSION_PORT);
+    cr_assert_eq(session_put(fd, "k", "v"), 0, "PUT failed");
+    cr_assert_eq(session_request(fd, XACTO_COMMIT_PKT), 1, "COMMIT failed");
+    cr_assert_eq(recv_status(fd, XACTO_REPLY_PKT), -1, "connection without BEGIN was not closed");
+    close(fd);
+}
+
+Test(readonly_suite, 00_snapshot_commit, .init = store_setup, .fini = store_teardown, .timeout = 5) {
+    put_keys((char *[]){ "k", NULL });
+
+    //  A write still pending when the snapshot is taken is not seen, and nobody waits or aborts.
+    TRANSACTION *tp = trans_create();
+    cr_assert_eq(put_string(tp, "k", "new"), TRANS_PENDING, "PUT failed");
+    TRANSACTION *ro = trans_create_read_only();
+    char buf[32];
+    cr_assert_eq(get_string(ro, "k", buf), TRANS_PENDING, "read-only GET failed");
+    cr_assert_eq(strcmp(buf, "v"), 0, "snapshot read \"%s\"", buf);
+    cr_assert_eq(trans_commit(ro), TRANS_COMMITTED, "read-only transaction did not commit");
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "writer did not commit");
+}
+
+Test(readonly_suite, 01_write_aborts, .init = store_setup, .fini = store_teardown, .timeout = 5) {
+    put_keys((char *[]){ "k", NULL });
+    TRANSACTION *ro = trans_create_read_only();
+    char buf[32];
+    cr_assert_eq(get_string(ro, "k", buf), TRANS_PENDING, "read-only GET failed");
+    cr_assert_eq(put_string(ro, "k", "x"), TRANS_ABORTED, "read-only transaction that writes did not abort");
+    cr_assert_eq(trans_commit(ro), TRANS_ABORTED, "aborted read-only transaction committed");
+}
+
+static void mvcc_setup() {
+    trans_select_engine(ENGINE_MVCC);
+    store_setup();
+}
+
+Test(mvcc_suite, 00_disjoint_commit, .init = mvcc_setup, .fini = store_teardown, .timeout = 5) {
+    put_keys((char *[]){ "a", "b", NULL });
+
+    //  Concurrent writers of different keys both commit, each reading its own snapshot.
+    TRANSACTION *t1 = trans_create();
+    TRANSACTION *t2 = trans_create();
+    char buf[32];
+    cr_assert_eq(put_string(t1, "a", "1"), TRANS_PENDING, "PUT by first writer failed");
+    cr_assert_eq(put_string(t2, "b", "2"), TRANS_PENDING, "PUT by second writer failed");
+    cr_assert_eq(trans_commit(t1), TRANS_COMMITTED, "first writer did not commit");
+    cr_assert_eq(get_string(t2, "a", buf), TRANS_PENDING, "GET failed");
+    cr_assert_eq(strcmp(buf, "v"), 0, "snapshot read \"%s\", committed after it was taken", buf);
+    cr_assert_eq(trans_commit(t2), TRANS_COMMITTED, "second writer did not commit");
+}
+
+Test(mvcc_suite, 01_first_committer_wins, .init = mvcc_setup, .fini = store_teardown, .timeout = 5) {
+    put_keys((char *[]){ "k", NULL });
+    TRANSACTION *t1 = trans_create();
+    TRANSACTION *t2 = trans_create();
+    cr_assert_eq(put_string(t2, "k", "2"), TRANS_PENDING, "PUT by second writer failed");
+    cr_assert_eq(put_string(t1, "k", "1"), TRANS_PENDING, "PUT by first writer failed");
+    cr_assert_eq(trans_commit(t2), TRANS_COMMITTED, "first to commit did not");
+    cr_assert_eq(trans_commit(t1), TRANS_ABORTED, "second writer of the key committed");
+}
+
+static void occ_setup() {
+    trans_select_engine(ENGINE_OCC);
+    store_setup();
+}
+
+Test(occ_suite, 00_disjoint_commit, .init = occ_setup, .fini = store_teardown, .timeout = 5) {
+    put_keys((char *[]){ "a", "b", NULL });
+
+    //  A read that nobody has written since is still valid at commit.
+    TRANSACTION *t1 = trans_create();
+    TRANSACTION *t2 = trans_create();
+    char buf[32];
+    cr_assert_eq(get_string(t1, "a", buf), TRANS_PENDING, "GET failed");
+    cr_assert_eq(put_string(t2, "b", "2"), TRANS_PENDING, "PUT failed");
+    cr_assert_eq(trans_commit(t2), TRANS_COMMITTED, "writer did not commit");
+    cr_assert_eq(put_string(t1, "c", "1"), TRANS_PENDING, "PUT failed");
+    cr_assert_eq(trans_commit(t1), TRANS_COMMITTED, "reader of an unchanged key did not commit");
+}
+
+Test(occ_suite, 01_stale_read_aborts, .init = occ_setup, .fini = store_teardown, .timeout = 5) {
+    put_keys((char *[]){ "k", NULL });
+
+    //  A read overwritten by a commit before ours fails validation.
+    TRANSACTION *t1 = trans_create();
+    TRANSACTION *t2 = trans_create();
+    char buf[32];
+    cr_assert_eq(get_string(t1, "k", buf), TRANS_PENDING, "GET failed");
+    cr_assert_eq(put_string(t2, "k", "2"), TRANS_PENDING, "PUT failed");
+    cr_assert_eq(trans_commit(t2), TRANS_COMMITTED, "writer did not commit");
+    cr_assert_eq(put_string(t1, "c", "1"), TRANS_PENDING, "PUT failed");
+    cr_assert_eq(trans_commit(t1), TRANS_ABORTED, "reader of an overwritten key committed");
+}
+
+static void tpl_setup() {
+    trans_select_engine(ENGINE_2PL);
+    store_setup();
+}
+
+Test(tpl_suite, 00_shared_commit, .init = tpl_setup, .fini = store_teardown, .timeout = 5) {
+    put_keys((char *[]){ "k", NULL });
+
+    //  Shared locks do not conflict, nor do locks on different keys.
+    TRANSACTION *t1 = trans_create();
+    TRANSACTION *t2 = trans_create();
+    char buf[32];
+    cr_assert_eq(get_string(t1, "k", buf), TRANS_PENDING, "GET by older transaction failed");
+    cr_assert_eq(get_string(t2, "k", buf), TRANS_PENDING, "GET by younger transaction failed");
+    cr_assert_eq(put_string(t1, "a", "1"), TRANS_PENDING, "PUT by older transaction failed");
+    cr_assert_eq(put_string(t2, "b", "2"), TRANS_PENDING, "PUT by younger transaction failed");
+    cr_assert_eq(trans_commit(t2), TRANS_COMMITTED, "younger transaction did not commit");
+    cr_assert_eq(trans_commit(t1), TRANS_COMMITTED, "older transaction did not commit");
+}
+
+Test(tpl_suite, 01_younger_dies, .init = tpl_setup, .fini = store_teardown, .timeout = 5) {
+    put_keys((char *[]){ "k", NULL });
+
+    //  A younger transaction that finds a key locked in a conflicting mode dies rather than wait.
+    TRANSACTION *t1 = trans_create();
+    TRANSACTION *t2 = trans_create();
+    char buf[32];
+    cr_assert_eq(put_string(t1, "k", "1"), TRANS_PENDING, "PUT by older transaction failed");
+    cr_assert_eq(get_string(t2, "k", buf), TRANS_ABORTED, "younger transaction did not die");
+    trans_abort(t2);
+    cr_assert_eq(trans_commit(t1), TRANS_COMMITTED, "older transaction did not commit");
+}
+
+//  PUT a key from a thread of its own, so that the PUT may wait for a lock.
+typedef struct {
+    TRANSACTION *tp;
+    char *key;
+    char *value;
+    TRANS_STATUS status;
+} PUT_ARGS;
+
+static void *put_thread(void *arg) {
+    PUT_ARGS *ap = arg;
+    ap->status = put_string(ap->tp, ap->key, ap->value);
+    return NULL;
+}
+
+Test(tpl_suite, 02_older_waits, .init = tpl_setup, .fini = store_teardown, .timeout = 5) {
+    put_keys((char *[]){ "k", NULL });
+
+    //  An older transaction that finds a key locked by a younger one waits for the lock.
+    TRANSACTION *t1 = trans_create();
+    TRANSACTION *t2 = trans_create();
+    cr_assert_eq(put_string(t2, "k", "2"), TRANS_PENDING, "PUT by younger transaction failed");
+    PUT_ARGS args = { t1, "k", "1", TRANS_ABORTED };
+    pthread_t tid;
+    Pthread_create(&tid, NULL, put_thread, &args);
+    int waiting = 0;
+    while(!waiting) {
+        usleep(1000);
+        pthread_mutex_lock(&t1->mutex);
+        waiting = t1->waiting != NULL;
+        pthread_mutex_unlock(&t1->mutex);
+    }
+
+    //  It is granted the lock once the holder commits, and commits in turn.
+    cr_assert_eq(trans_commit(t2), TRANS_COMMITTED, "younger transaction did not commit");
+    Pthread_join(tid, NULL);
+    cr_assert_eq(args.status, TRANS_PENDING, "PUT by waiting transaction failed");
+    cr_assert_eq(trans_commit(t1), TRANS_COMMITTED, "waiting transaction did not commit");
+
+    TRANSACTION *tp = trans_create();
+    char buf[32];
+    cr_assert_eq(get_string(tp, "k", buf), TRANS_PENDING, "GET after both commits failed");
+    cr_assert_eq(strcmp(buf, "1"), 0, "GET returned \"%s\" rather than the older transaction's value", buf);
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED, "reading transaction did not commit");
+}